@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+# Anonymizes recorded Vk.com responses (Long Poll or API 5.x methods like messages.get) for jsondom-bench,
+# keeping the structure and the sizes of the response, so that parsing it costs the same:
+#  - user, group, chat and object ids are replaced with random ids of the same length, the same id
+#    always gets the same replacement;
+#  - letters and digits in strings are replaced with random ones of the same script, everything else
+#    (spaces, punctuation, emoji, <br>, &quot; and URL hosts) is kept;
+#  - keys and the values of "type"-like keys are kept.
+#
+# Usage: anonymize-response.py < recorded.json > anonymized.json
+
+import json
+import random
+import re
+import sys
+
+# Object keys, which contain ids.
+ID_KEYS = {'id', 'user_id', 'from_id', 'owner_id', 'chat_id', 'peer_id', 'admin_id', 'to_id',
+           'source_id', 'album_id', 'product_id', 'sticker_id', 'random_id', 'chat_active'}
+# Object keys, which values are kept.
+KEPT_KEYS = {'type', 'ext', 'emoji', 'platform'}
+# Long Poll event codes and positions of ids in them.
+LONG_POLL_ID_POSITIONS = {4: [3], 6: [1], 7: [1], 8: [1], 9: [1], 51: [1], 61: [1], 62: [1, 2]}
+# Chat ids in Long Poll are offset by this.
+CHAT_ID_OFFSET = 2000000000
+
+CYRILLIC_LOWER = 'абвгдежзиклмнопрстуфхцчшщыэюя'
+LATIN_LOWER = 'abcdefghijklmnopqrstuvwxyz'
+
+rng = random.Random(42)
+id_map = {}
+
+
+def anonymize_id(i):
+    if i < 0:
+        return -anonymize_id(-i)
+    if i >= CHAT_ID_OFFSET:
+        return CHAT_ID_OFFSET + anonymize_id(i - CHAT_ID_OFFSET)
+    if i < 10:
+        return i
+    if i not in id_map:
+        digits = len(str(i))
+        id_map[i] = rng.randint(10 ** (digits - 1), 10 ** digits - 1)
+    return id_map[i]
+
+
+def anonymize_char(c):
+    lower = c.lower()
+    if lower in CYRILLIC_LOWER or lower == 'ё':
+        r = rng.choice(CYRILLIC_LOWER)
+    elif lower in LATIN_LOWER:
+        r = rng.choice(LATIN_LOWER)
+    elif c.isdigit():
+        return rng.choice('0123456789')
+    else:
+        return c
+    return r.upper() if c != lower else r
+
+
+def anonymize_text(s):
+    # Ids in attachments of Long Poll events, e.g. "299857191_368710461".
+    if re.fullmatch(r'-?\d+(_-?\d+)*', s):
+        return '_'.join(str(anonymize_id(int(part))) for part in s.split('_'))
+    # HTML tags and entities are kept, so that message cleanup has the same work to do, and so are
+    # URL schemes and hosts.
+    parts = re.split(r'(<[a-z]+>|&[a-z]+;|[a-z]+://[^/]+)', s)
+    return ''.join(part if i % 2 else ''.join(anonymize_char(c) for c in part)
+                   for i, part in enumerate(parts))
+
+
+def anonymize(v, key=None):
+    if isinstance(v, dict):
+        return {k: anonymize(x, k) for k, x in v.items()}
+    if isinstance(v, list):
+        if key == 'updates':
+            return [anonymize_update(u) for u in v]
+        return [anonymize(x, key) for x in v]
+    if isinstance(v, bool) or v is None:
+        return v
+    if isinstance(v, int):
+        return anonymize_id(v) if key in ID_KEYS else v
+    if isinstance(v, str):
+        return v if key in KEPT_KEYS or (key and key.endswith('_type')) else anonymize_text(v)
+    return v
+
+
+def anonymize_update(u):
+    if not isinstance(u, list) or not u or not isinstance(u[0], int):
+        return anonymize(u)
+    ret = [u[0]]
+    for pos, x in enumerate(u[1:], 1):
+        if pos in LONG_POLL_ID_POSITIONS.get(u[0], []) and isinstance(x, int):
+            ret.append(anonymize_id(x))
+        else:
+            ret.append(anonymize(x))
+    return ret
+
+
+json.dump(anonymize(json.load(sys.stdin)), sys.stdout, ensure_ascii=False, separators=(',', ':'))
@@ -0,0 +1,64 @@
+// Helpers, shared by the benchmarks.
+
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+// Returns the contents of the file or exits if it could not be read.
+inline std::string bench_read_file(const char* path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        fprintf(stderr, "Unable to open %s\n", path);
+        exit(1);
+    }
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+}
+
+// Calls f iterations times and prints the average time of one call.
+template<typename F>
+void bench_run(const char* name, int iterations, F f)
+{
+    // Warm up caches and the allocator.
+    f();
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+        f();
+    std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+
+    double us = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / 1000.0;
+    printf("%-40s %10.2f us\n", name, us / iterations);
+}
+
+// Prevents the compiler from optimizing away the computation of value.
+template<typename T>
+void bench_use(const T& value)
+{
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+#ifdef __linux__
+// Returns resident set size of the process in bytes.
+inline size_t bench_get_rss()
+{
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (!f)
+        return 0;
+    unsigned long size = 0;
+    unsigned long resident = 0;
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+        resident = 0;
+    fclose(f);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+#endif
@@ -0,0 +1,136 @@
+// Compares jsondom with picojson on Long Poll and messages.get responses: parsing and reading
+// the updates the same way vk-longpoll.cpp does or the messages the same way vk-message-recv.cpp does.
+// The type of the response is detected by its contents.
+//
+// benchmarks/data contains responses in the format of API version, used by the plugin. Recorded
+// responses should be anonymized by anonymize-response.py before adding them.
+//
+// Usage: jsondom-bench <response file> [iterations]
+
+#include "jsondom.h"
+
+#include "benchutils.h"
+
+namespace
+{
+
+// Reads all updates and returns something, depending on their contents.
+template<typename Value, typename Array, typename Object>
+size_t read_updates(const Value& root)
+{
+    size_t ret = 0;
+    for (const Value& v: root.get("updates").template get<Array>()) {
+        if (!v.template is<Array>() || !v.get(0).template is<double>())
+            continue;
+        int code = v.get(0).template get<double>();
+        ret += code;
+        if (code == 4) {
+            ret += v.get(6).template get<string>().size();
+            const Value& attachments = v.get(7);
+            if (attachments.template is<Object>() && attachments.contains("attach1_type"))
+                ret++;
+        }
+    }
+    return ret;
+}
+
+// Reads all messages and their attachments and returns something, depending on their contents.
+template<typename Value, typename Array, typename Object>
+size_t read_messages(const Value& root)
+{
+    size_t ret = 0;
+    for (const Value& m: root.get("response").get("items").template get<Array>()) {
+        if (!m.template is<Object>() || !m.get("id").template is<double>())
+            continue;
+        for (const char* key: { "id", "user_id", "date", "out", "read_state" })
+            ret += size_t(m.get(key).template get<double>());
+        ret += m.get("body").template get<string>().size();
+        if (m.contains("chat_id"))
+            ret += size_t(m.get("chat_id").template get<double>());
+
+        if (m.get("attachments").template is<Array>()) {
+            for (const Value& a: m.get("attachments").template get<Array>()) {
+                const string& type = a.get("type").template get<string>();
+                const Value& fields = a.get(type);
+                if (!fields.template is<Object>())
+                    continue;
+                // Photos and stickers are the most common ones, the plugin chooses the thumbnail size.
+                const char* sizes_key = nullptr;
+                if (type == "photo")
+                    sizes_key = "sizes";
+                else if (type == "sticker")
+                    sizes_key = "images";
+                if (sizes_key && fields.get(sizes_key).template is<Array>()) {
+                    for (const Value& size: fields.get(sizes_key).template get<Array>())
+                        ret += size_t(size.get("width").template get<double>())
+                                + size.get("url").template get<string>().size();
+                }
+                if (fields.get("title").template is<string>())
+                    ret += fields.get("title").template get<string>().size();
+            }
+        }
+
+        if (m.get("fwd_messages").template is<Array>()) {
+            for (const Value& fwd: m.get("fwd_messages").template get<Array>())
+                ret += size_t(fwd.get("user_id").template get<double>())
+                        + fwd.get("body").template get<string>().size();
+        }
+    }
+    return ret;
+}
+
+} // End of anonymous namespace
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <response file> [iterations]\n", argv[0]);
+        return 1;
+    }
+    string text = bench_read_file(argv[1]);
+    int iterations = argc > 2 ? atoi(argv[2]) : 10000;
+    printf("%d bytes, %d iterations\n", (int)text.size(), iterations);
+
+    bench_run("picojson: parse", iterations, [&] {
+        picojson::value root;
+        const char* cur = text.data(); // picojson updates the iterator it received.
+        string error = picojson::parse(root, cur, text.data() + text.size());
+        bench_use(root);
+    });
+    bench_run("jsondom: parse", iterations, [&] {
+        jsondom::document doc;
+        string error = doc.parse(text.data(), text.size());
+        bench_use(doc.root());
+    });
+
+    // Long Poll responses and messages.get responses are read differently.
+    jsondom::document probe;
+    probe.parse(text.data(), text.size());
+    if (probe.root().contains("updates")) {
+        bench_run("picojson: parse and read updates", iterations, [&] {
+            picojson::value root;
+            const char* cur = text.data();
+            picojson::parse(root, cur, text.data() + text.size());
+            bench_use(read_updates<picojson::value, picojson::array, picojson::object>(root));
+        });
+        bench_run("jsondom: parse and read updates", iterations, [&] {
+            jsondom::document doc;
+            doc.parse(text.data(), text.size());
+            bench_use(read_updates<jsondom::value, jsondom::array, jsondom::object>(doc.root()));
+        });
+    } else {
+        bench_run("picojson: parse and read messages", iterations, [&] {
+            picojson::value root;
+            const char* cur = text.data();
+            picojson::parse(root, cur, text.data() + text.size());
+            bench_use(read_messages<picojson::value, picojson::array, picojson::object>(root));
+        });
+        bench_run("jsondom: parse and read messages", iterations, [&] {
+            jsondom::document doc;
+            doc.parse(text.data(), text.size());
+            bench_use(read_messages<jsondom::value, jsondom::array, jsondom::object>(doc.root()));
+        });
+    }
+
+    return 0;
+}
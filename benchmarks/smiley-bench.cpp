@@ -0,0 +1,183 @@
+// Compares conversion of smileys in messages by scanning the automaton (replace_ascii_smileys and
+// replace_unicode_smileys) with the previous implementations: calling Trie::match at each offset
+// and replacing smileys in place, and calling Trie::match only at bytes, which start some smiley.
+//
+// Usage: smiley-bench <theme file> <messages file>
+
+#include <bitset>
+
+#include <cpputils/trie.h>
+
+#include "benchutils.h"
+#include "smileytheme.h"
+
+namespace
+{
+
+bool str_at_isspace(const string& s, size_t i)
+{
+    if (i == s.length())
+        return true;
+    return ascii_isspace(s[i]);
+}
+
+bool accept_ascii_smiley(const string& message, size_t index, size_t ascii_len)
+{
+    return (index == 0 || str_at_isspace(message, index - 1))
+            && str_at_isspace(message, index + ascii_len);
+}
+
+bool accept_unicode_smiley(const string&, size_t, size_t)
+{
+    return true;
+}
+
+typedef bool (*AcceptSmiley)(const string& message, size_t index, size_t smiley_len);
+
+// A set of smileys with the bytes, which they start with.
+struct Smileys
+{
+    Trie<string> trie;
+    std::bitset<256> first_bytes;
+};
+
+void match_at_each_offset(string& message, const Smileys& smileys, AcceptSmiley accept_smiley)
+{
+    for (size_t index = 0; index < message.length();) {
+        size_t smiley_len;
+        const string* replacement = smileys.trie.match(message.data() + index, &smiley_len);
+        if (!replacement || !accept_smiley(message, index, smiley_len)) {
+            index++;
+            continue;
+        }
+
+        message.replace(index, smiley_len, *replacement);
+        index += replacement->length();
+    }
+}
+
+void match_at_first_bytes(string& message, const Smileys& smileys, AcceptSmiley accept_smiley)
+{
+    string ret;
+    size_t copied = 0;
+    for (size_t index = 0; index < message.length(); index++) {
+        if (!smileys.first_bytes[(unsigned char)message[index]])
+            continue;
+        size_t smiley_len;
+        const string* replacement = smileys.trie.match(message.data() + index, &smiley_len);
+        if (!replacement || !accept_smiley(message, index, smiley_len))
+            continue;
+
+        if (ret.empty())
+            ret.reserve(message.length());
+        ret.append(message, copied, index - copied);
+        ret += *replacement;
+        index += smiley_len - 1;
+        copied = index + 1;
+    }
+
+    if (copied == 0)
+        return;
+    ret.append(message, copied, string::npos);
+    message.swap(ret);
+}
+
+void scan_ascii(string& message, const Smileys& smileys, AcceptSmiley)
+{
+    replace_ascii_smileys(message, smileys.trie);
+}
+
+void scan_unicode(string& message, const Smileys& smileys, AcceptSmiley)
+{
+    replace_unicode_smileys(message, smileys.trie);
+}
+
+typedef void (*Convert)(string& message, const Smileys& smileys, AcceptSmiley accept_smiley);
+
+void add_smileys(const vector<std::pair<string, string>>& pairs, Smileys* smileys)
+{
+    for (const std::pair<string, string>& p: pairs) {
+        smileys->trie.insert(p.first.data(), p.second);
+        smileys->first_bytes.set((unsigned char)p.first[0]);
+    }
+    smileys->trie.freeze();
+}
+
+// Converts copies of all messages, so that each run starts from the same text.
+void convert_messages(const vector<string>& messages, const Smileys& smileys, Convert convert,
+                      AcceptSmiley accept_smiley)
+{
+    for (const string& message: messages) {
+        string converted = message;
+        convert(converted, smileys, accept_smiley);
+        bench_use(converted);
+    }
+}
+
+} // End of anonymous namespace
+
+int main(int argc, char** argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <theme file> <messages file>\n", argv[0]);
+        return 1;
+    }
+
+    SmileyTheme theme;
+    vector<string> errors;
+    parse_smiley_theme(bench_read_file(argv[1]), &theme, &errors);
+    Smileys ascii_to_unicode;
+    add_smileys(theme.ascii_to_unicode, &ascii_to_unicode);
+    Smileys unicode_to_ascii;
+    add_smileys(theme.unicode_to_ascii, &unicode_to_ascii);
+
+    vector<string> messages;
+    str_split_append(bench_read_file(argv[2]), '\n', messages);
+
+    const struct {
+        const char* name;
+        const Smileys& smileys;
+        AcceptSmiley accept_smiley;
+        Convert scan;
+    } directions[] = {
+        { "outgoing", ascii_to_unicode, accept_ascii_smiley, scan_ascii },
+        { "incoming", unicode_to_ascii, accept_unicode_smiley, scan_unicode }
+    };
+    const struct {
+        const char* name;
+        Convert convert;
+    } implementations[] = {
+        { "match at each offset", match_at_each_offset },
+        { "match at first bytes", match_at_first_bytes },
+        { "scan", nullptr }
+    };
+
+    // All implementations must give the same results.
+    for (const auto& direction: directions) {
+        for (const string& message: messages) {
+            string expected = message;
+            match_at_each_offset(expected, direction.smileys, direction.accept_smiley);
+            string first_bytes = message;
+            match_at_first_bytes(first_bytes, direction.smileys, direction.accept_smiley);
+            string scanned = message;
+            direction.scan(scanned, direction.smileys, direction.accept_smiley);
+            if (first_bytes != expected || scanned != expected) {
+                fprintf(stderr, "Results differ for %s message %s\n", direction.name, message.data());
+                return 1;
+            }
+        }
+    }
+
+    printf("%zu messages\n", messages.size());
+    const int iterations = 5000;
+    for (const auto& direction: directions) {
+        for (const auto& implementation: implementations) {
+            Convert convert = implementation.convert ? implementation.convert : direction.scan;
+            string name = string(direction.name) + ": " + implementation.name;
+            bench_run(name.data(), iterations, [&] {
+                convert_messages(messages, direction.smileys, convert, direction.accept_smiley);
+            });
+        }
+    }
+    return 0;
+}
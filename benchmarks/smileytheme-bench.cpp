@@ -0,0 +1,130 @@
+// Compares the ways of loading smiley theme on plugin startup: parsing the theme file and reading
+// and hashing the theme file to validate the index (as the plugin does now).
+//
+// Also measures the time and RSS growth of loading smiley images: reading all of them on startup
+// (as the plugin used to) and storing only their paths, reading an image when the smiley is used
+// (as the plugin does now). Each way is measured in a separate process. The images are read
+// before the measurements, so that all of them are in the page cache.
+//
+// Usage: smileytheme-bench <theme file> <index file>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "benchutils.h"
+#include "smileytheme.h"
+
+namespace
+{
+
+// The number of smileys, used in conversations after startup.
+const size_t USED_SMILEY_COUNT = 50;
+
+// Returns the contents of the image, read the same way the plugin used to read it on startup.
+vector<char> read_image(const string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    file.seekg(0, std::ios::end);
+    vector<char> contents(size_t(file.tellg()));
+    file.seekg(0, std::ios::beg);
+    file.read(contents.data(), contents.size());
+    return contents;
+}
+
+// Calls f in a child process and prints the time of the call and RSS growth. f returns the data,
+// which is kept in memory after loading.
+template<typename F>
+void measure_images(const char* name, F f)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid != 0) {
+        waitpid(pid, nullptr, 0);
+        return;
+    }
+
+    size_t rss_before = bench_get_rss();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    auto data = f();
+    std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+    size_t rss_after = bench_get_rss();
+
+    double us = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / 1000.0;
+    printf("%-40s %10.2f us, RSS growth %8.1f KB\n", name, us, (rss_after - rss_before) / 1024.0);
+    bench_use(data);
+    fflush(stdout);
+    _exit(0);
+}
+
+} // End of anonymous namespace
+
+int main(int argc, char** argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <theme file> <index file>\n", argv[0]);
+        return 1;
+    }
+    const char* theme_path = argv[1];
+    const char* index_path = argv[2];
+
+    uint64 theme_hash = smiley_theme_hash(bench_read_file(theme_path));
+    SmileyTheme index_theme;
+    string index = bench_read_file(index_path);
+    if (!read_smiley_index(index.data(), index.size(), theme_hash, &index_theme)) {
+        fprintf(stderr, "Index %s has not been compiled from %s\n", index_path, theme_path);
+        return 1;
+    }
+
+    const int iterations = 2000;
+    bench_run("parse theme file", iterations, [&] {
+        SmileyTheme theme;
+        vector<string> errors;
+        parse_smiley_theme(bench_read_file(theme_path), &theme, &errors);
+        bench_use(theme);
+    });
+    bench_run("hash theme file, read index", iterations, [&] {
+        uint64 hash = smiley_theme_hash(bench_read_file(theme_path));
+        string index_contents = bench_read_file(index_path);
+        SmileyTheme theme;
+        read_smiley_index(index_contents.data(), index_contents.size(), hash, &theme);
+        bench_use(theme);
+    });
+
+    string theme_dir = theme_path;
+    size_t slash_pos = theme_dir.rfind('/');
+    theme_dir = slash_pos != string::npos ? theme_dir.substr(0, slash_pos + 1) : string();
+    vector<string> image_paths;
+    for (const string& file: index_theme.image_files)
+        image_paths.push_back(theme_dir + file);
+    for (const string& path: image_paths)
+        bench_use(read_image(path));
+    printf("%d smiley images\n", (int)image_paths.size());
+
+    // Measures the memory, used by the measurement itself.
+    measure_images("nothing", [] {
+        return 0;
+    });
+    measure_images("read all images on startup", [&] {
+        vector<vector<char>> images;
+        for (const string& path: image_paths)
+            images.push_back(read_image(path));
+        return images;
+    });
+    measure_images("store image paths on startup", [&] {
+        vector<string> paths;
+        for (const string& file: index_theme.image_files)
+            paths.push_back(theme_dir + file);
+        return paths;
+    });
+    string used_name = str_format("store paths, read %d images on use", (int)USED_SMILEY_COUNT);
+    measure_images(used_name.data(), [&] {
+        vector<string> paths;
+        for (const string& file: index_theme.image_files)
+            paths.push_back(theme_dir + file);
+        // Each image is written to the conversation and freed.
+        for (size_t i = 0; i < USED_SMILEY_COUNT && i < paths.size(); i++)
+            bench_use(read_image(paths[i * paths.size() / USED_SMILEY_COUNT]));
+        return paths;
+    });
+    return 0;
+}
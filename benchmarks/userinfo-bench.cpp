@@ -0,0 +1,153 @@
+// Measures memory, used by user infos for a synthetic set of users: with all the fields stored
+// as separate strings (as VkUserInfo used to be) and with the rarely used fields packed into
+// PackedStrings (as VkUserInfo is now). Each layout is measured in a separate process.
+//
+// Usage: userinfo-bench [user count]
+
+#include <map>
+#include <random>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "benchutils.h"
+#include "packedstrings.h"
+
+namespace
+{
+
+// The old layout of VkUserInfo.
+struct PlainUserInfo
+{
+    string real_name;
+    string activity;
+    string bdate;
+    string domain;
+    string education;
+    time_t last_seen;
+    string mobile_phone;
+    bool online;
+    bool online_mobile;
+    string photo_min;
+    string photo_max;
+
+    void set_details(const string& bdate_, const string& education_, const string& mobile_phone_)
+    {
+        bdate = bdate_;
+        education = education_;
+        mobile_phone = mobile_phone_;
+    }
+};
+
+// Mirrors VkUserInfo from vk-common.h, which cannot be included without libpurple.
+struct PackedUserInfo
+{
+    string real_name;
+    string activity;
+    string domain;
+    time_t last_seen;
+    bool online;
+    bool online_mobile;
+    string photo_min;
+    string photo_max;
+    PackedStrings details;
+
+    void set_details(const string& bdate, const string& education, const string& mobile_phone)
+    {
+        details = PackedStrings({ bdate, education, mobile_phone });
+    }
+};
+
+const char* const first_names[] = { "Александр", "Мария", "Дмитрий", "Анна", "Сергей", "Екатерина",
+                                    "Andrey", "Olga", "Иван", "Наталья" };
+const char* const last_names[] = { "Иванов", "Смирнова", "Кузнецов", "Попова", "Васильев",
+                                   "Петрова", "Sokolov", "Михайлова", "Новиков", "Фёдорова" };
+const char* const activities[] = { "Жизнь прекрасна!", "Работаю, не беспокоить",
+                                   "Keep calm and carry on", "Учусь, учусь и ещё раз учусь" };
+const char* const universities[] = { "МГУ им. М. В. Ломоносова", "СПбГУ", "МФТИ (ГУ)",
+                                     "НИУ ВШЭ (Высшая школа экономики)" };
+const char* const faculties[] = { "Физический факультет", "Факультет ВМК", "Экономический факультет" };
+
+// Returns random URL of photo, similar to the ones returned by Vk.com.
+string random_photo_url(std::mt19937& rng, const char* suffix)
+{
+    static const char chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    unsigned server = 600000 + rng() % 30000;
+    string name;
+    for (int i = 0; i < 11; i++)
+        name += chars[rng() % (sizeof(chars) - 1)];
+    return str_format("https://pp.vk.me/c%u/v%u/%x/%s%s.jpg", server, server, unsigned(rng() % 0xFFFF),
+                      name.data(), suffix);
+}
+
+// Fills count infos with random data, seeded the same way for each layout.
+template<typename Info>
+void fill_infos(std::map<uint64, Info>& infos, int count)
+{
+    std::mt19937 rng(42);
+    for (int i = 0; i < count; i++) {
+        uint64 user_id = 1000000 + rng() % 300000000;
+        Info& info = infos[user_id];
+        info.real_name = string(first_names[rng() % 10]) + " " + last_names[rng() % 10];
+        if (rng() % 10 < 4)
+            info.activity = activities[rng() % 4];
+        if (rng() % 2 == 0)
+            info.domain = str_format("nick%u", unsigned(rng() % 100000));
+        info.last_seen = 1413800000 + rng() % 1000000;
+        info.online = rng() % 5 == 0;
+        info.online_mobile = false;
+        if (rng() % 10 < 8) {
+            info.photo_min = random_photo_url(rng, "");
+            info.photo_max = random_photo_url(rng, "_max");
+        }
+
+        string bdate;
+        if (rng() % 10 < 6)
+            bdate = str_format("%u.%u.%u", unsigned(1 + rng() % 28), unsigned(1 + rng() % 12),
+                               unsigned(1960 + rng() % 40));
+        string education;
+        if (rng() % 10 < 3)
+            education = string(universities[rng() % 4]) + ", " + faculties[rng() % 3]
+                    + str_format(" '%02u", unsigned(rng() % 20));
+        string mobile_phone;
+        if (rng() % 10 == 0)
+            mobile_phone = str_format("+7 9%02u %03u-%02u-%02u", unsigned(rng() % 100),
+                                      unsigned(rng() % 1000), unsigned(rng() % 100),
+                                      unsigned(rng() % 100));
+        info.set_details(bdate, education, mobile_phone);
+    }
+}
+
+// Fills infos in a child process and prints the used memory.
+template<typename Info>
+void measure(const char* name, int count)
+{
+    pid_t pid = fork();
+    if (pid != 0) {
+        waitpid(pid, nullptr, 0);
+        return;
+    }
+
+    size_t rss_before = bench_get_rss();
+    std::map<uint64, Info> infos;
+    fill_infos(infos, count);
+    size_t rss_after = bench_get_rss();
+
+    printf("%-20s sizeof %3d, RSS growth %8.1f KB\n", name, (int)sizeof(Info),
+           (rss_after - rss_before) / 1024.0);
+    bench_use(infos);
+    fflush(stdout);
+    _exit(0);
+}
+
+} // End of anonymous namespace
+
+int main(int argc, char** argv)
+{
+    int count = argc > 1 ? atoi(argv[1]) : 10000;
+    printf("%d users\n", count);
+    fflush(stdout);
+
+    measure<PlainUserInfo>("separate strings", count);
+    measure<PackedUserInfo>("packed details", count);
+    return 0;
+}
@@ -0,0 +1,247 @@
+// Simulates the lookups in VkData id sets and info maps, done on each Long Poll event, for an account
+// with many friends. The containers are std::set/std::map (as they used to be), std::unordered_set/
+// std::unordered_map (as they are now) and, for the id sets, sorted vectors. Also measures
+// the operations, which need the ids in order: diffing the old and the new friend ids upon update
+// and writing the ids to the info snapshot.
+//
+// Usage: vkdata-bench [friend count] [event count]
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <random>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "common.h"
+
+#include "benchutils.h"
+
+namespace
+{
+
+// The part of VkUserInfo, used by the lookups.
+struct UserInfo
+{
+    string real_name;
+    time_t last_seen;
+    bool online;
+};
+
+// Sorted vector of ids with the interface of std::set, which is used by the lookups.
+class FlatIdSet
+{
+public:
+    typedef uint64 key_type;
+    typedef vector<uint64>::const_iterator const_iterator;
+
+    const_iterator begin() const
+    {
+        return m_ids.begin();
+    }
+
+    const_iterator end() const
+    {
+        return m_ids.end();
+    }
+
+    const_iterator cend() const
+    {
+        return m_ids.end();
+    }
+
+    size_t size() const
+    {
+        return m_ids.size();
+    }
+
+    const_iterator find(uint64 id) const
+    {
+        const_iterator it = std::lower_bound(m_ids.begin(), m_ids.end(), id);
+        return (it != m_ids.end() && *it == id) ? it : m_ids.end();
+    }
+
+    void insert(uint64 id)
+    {
+        vector<uint64>::iterator it = std::lower_bound(m_ids.begin(), m_ids.end(), id);
+        if (it == m_ids.end() || *it != id)
+            m_ids.insert(it, id);
+    }
+
+private:
+    vector<uint64> m_ids;
+};
+
+// The fields of VkData, used by the lookups.
+template<typename Set, typename Map>
+struct Data
+{
+    Set friend_user_ids;
+    Set dialog_user_ids;
+    Map user_infos;
+    Set manually_added_buddies;
+    Set manually_removed_buddies;
+};
+
+// Same checks as user_should_be_in_blist (minus the open conversations).
+template<typename D>
+bool user_should_be_in_blist(const D& data, uint64 user_id)
+{
+    if (contains(data.manually_removed_buddies, user_id))
+        return false;
+    if (contains(data.friend_user_ids, user_id))
+        return true;
+    if (contains(data.manually_added_buddies, user_id))
+        return true;
+    return contains(data.dialog_user_ids, user_id);
+}
+
+// Does the lookups, which are done when a message from user_id is received: is_unknown_user,
+// user_should_be_in_blist, is_user_friend and get_user_info.
+template<typename D>
+int process_event(const D& data, uint64 user_id)
+{
+    int ret = 0;
+    const UserInfo* info = map_at_ptr(data.user_infos, user_id);
+    if (!info || info->real_name.empty())
+        ret += 1;
+    if (user_should_be_in_blist(data, user_id))
+        ret += 2;
+    if (contains(data.friend_user_ids, user_id))
+        ret += 4;
+    info = map_at_ptr(data.user_infos, user_id);
+    if (info && info->online)
+        ret += 8;
+    return ret;
+}
+
+// Returns ids, present in only one of old_ids and new_ids, as add_changed_ids does.
+template<typename Set>
+std::set<uint64> changed_ids(const Set& old_ids, const Set& new_ids)
+{
+    std::set<uint64> ret;
+    for (uint64 id: old_ids)
+        if (!contains(new_ids, id))
+            ret.insert(id);
+    for (uint64 id: new_ids)
+        if (!contains(old_ids, id))
+            ret.insert(id);
+    return ret;
+}
+
+std::set<uint64> changed_ids(const std::set<uint64>& old_ids, const std::set<uint64>& new_ids)
+{
+    std::set<uint64> ret;
+    std::set_symmetric_difference(old_ids.begin(), old_ids.end(), new_ids.begin(), new_ids.end(),
+                                  std::inserter(ret, ret.end()));
+    return ret;
+}
+
+// Returns the ids in order, as they are written to the info snapshot.
+template<typename Set>
+vector<uint64> sorted_ids(const Set& ids)
+{
+    vector<uint64> ret(ids.begin(), ids.end());
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+vector<uint64> sorted_ids(const std::set<uint64>& ids)
+{
+    return vector<uint64>(ids.begin(), ids.end());
+}
+
+// Ids of the users, known to the account, and of the events.
+struct Workload
+{
+    vector<uint64> friend_ids;
+    vector<uint64> updated_friend_ids;
+    vector<uint64> dialog_ids;
+    vector<uint64> event_user_ids;
+};
+
+Workload make_workload(size_t friend_count, size_t event_count)
+{
+    std::mt19937_64 rng(12345);
+    std::uniform_int_distribution<uint64> random_id(1, 400000000);
+
+    Workload w;
+    for (size_t i = 0; i < friend_count; i++)
+        w.friend_ids.push_back(random_id(rng));
+    // A few friends have been added and removed since the previous update.
+    w.updated_friend_ids = w.friend_ids;
+    for (size_t i = 0; i < friend_count / 100; i++)
+        w.updated_friend_ids[rng() % friend_count] = random_id(rng);
+    // Dialogs with some friends and some non-friends.
+    for (size_t i = 0; i < friend_count / 5; i++)
+        w.dialog_ids.push_back(i % 2 ? w.friend_ids[rng() % friend_count] : random_id(rng));
+    // Most of the events come from the friends and dialogs, some from the unknown users.
+    for (size_t i = 0; i < event_count; i++) {
+        unsigned kind = rng() % 10;
+        if (kind < 7)
+            w.event_user_ids.push_back(w.friend_ids[rng() % friend_count]);
+        else if (kind < 9)
+            w.event_user_ids.push_back(w.dialog_ids[rng() % w.dialog_ids.size()]);
+        else
+            w.event_user_ids.push_back(random_id(rng));
+    }
+    return w;
+}
+
+template<typename Set, typename Map>
+void run(const char* name, const Workload& w)
+{
+    Data<Set, Map> data;
+    for (uint64 id: w.friend_ids)
+        data.friend_user_ids.insert(id);
+    for (uint64 id: w.dialog_ids)
+        data.dialog_user_ids.insert(id);
+    for (uint64 id: w.friend_ids)
+        data.user_infos[id] = UserInfo{ "Имя Фамилия", 0, id % 3 == 0 };
+    for (uint64 id: w.dialog_ids)
+        data.user_infos[id] = UserInfo{ "Имя Фамилия", 0, id % 3 == 0 };
+    for (size_t i = 0; i < 20; i++) {
+        data.manually_added_buddies.insert(w.dialog_ids[i * 7 % w.dialog_ids.size()]);
+        data.manually_removed_buddies.insert(w.friend_ids[i * 13 % w.friend_ids.size()]);
+    }
+
+    Set updated_friend_ids;
+    for (uint64 id: w.updated_friend_ids)
+        updated_friend_ids.insert(id);
+
+    printf("%s\n", name);
+    bench_run("  events", 100, [&] {
+        int sum = 0;
+        for (uint64 user_id: w.event_user_ids)
+            sum += process_event(data, user_id);
+        bench_use(sum);
+    });
+    bench_run("  fill friend ids", 100, [&] {
+        Set ids;
+        for (uint64 id: w.friend_ids)
+            ids.insert(id);
+        bench_use(ids);
+    });
+    bench_run("  diff friend ids", 100, [&] {
+        bench_use(changed_ids(data.friend_user_ids, updated_friend_ids));
+    });
+    bench_run("  sort friend ids for snapshot", 100, [&] {
+        bench_use(sorted_ids(data.friend_user_ids));
+    });
+}
+
+} // End of anonymous namespace
+
+int main(int argc, char** argv)
+{
+    size_t friend_count = argc > 1 ? atoi(argv[1]) : 5000;
+    size_t event_count = argc > 2 ? atoi(argv[2]) : 10000;
+    printf("%zu friends, %zu events\n", friend_count, event_count);
+
+    Workload w = make_workload(friend_count, event_count);
+    run<std::set<uint64>, std::map<uint64, UserInfo>>("set/map", w);
+    run<std::unordered_set<uint64>, std::unordered_map<uint64, UserInfo>>("unordered_set/unordered_map", w);
+    run<FlatIdSet, std::unordered_map<uint64, UserInfo>>("sorted vector/unordered_map", w);
+    return 0;
+}
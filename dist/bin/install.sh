@@ -28,3 +28,4 @@ fi
 
 cp -r data/protocols /usr/share/pixmaps/pidgin
 cp -r data/smileys/vk /usr/share/pixmaps/pidgin/emotes
+cp bin/theme.index /usr/share/pixmaps/pidgin/emotes/vk
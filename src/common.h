@@ -7,6 +7,7 @@
 // On Linux it is used only for always enabling assert().
 #undef NDEBUG
 
+#include <algorithm>
 #include <cassert>
 #include <chrono>
 #include <cstdio>
@@ -137,6 +138,15 @@ vector<typename Cont::value_type, typename Cont::allocator_type> to_vector(const
     return vector<typename Cont::value_type, typename Cont::allocator_type>(cont.begin(), cont.end());
 }
 
+// Converts container (usually unordered set) to sorted vector, e.g. when it is saved.
+template<typename Cont>
+vector<typename Cont::value_type> to_sorted_vector(const Cont& cont)
+{
+    vector<typename Cont::value_type> ret(cont.begin(), cont.end());
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
 
 // Time functions
 
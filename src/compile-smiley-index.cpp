@@ -0,0 +1,39 @@
+// Compiles smiley theme file into the binary index, see smileytheme.h. Called during the build.
+//
+// Usage: compile-smiley-index <theme file> <index file>
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "smileytheme.h"
+
+int main(int argc, char** argv)
+{
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " <theme file> <index file>\n";
+        return 1;
+    }
+
+    std::ifstream theme_file(argv[1], std::ios::binary);
+    if (!theme_file.is_open()) {
+        std::cerr << "Unable to open theme file " << argv[1] << "\n";
+        return 1;
+    }
+    std::ostringstream contents;
+    contents << theme_file.rdbuf();
+
+    SmileyTheme theme;
+    vector<string> errors;
+    parse_smiley_theme(contents.str(), &theme, &errors);
+    for (const string& error: errors)
+        std::cerr << "Strange line in emotes theme file " << argv[1] << ", " << error << "\n";
+
+    string index = write_smiley_index(theme, smiley_theme_hash(contents.str()));
+    std::ofstream index_file(argv[2], std::ios::binary | std::ios::trunc);
+    if (!index_file.write(index.data(), index.size()) || !index_file.flush()) {
+        std::cerr << "Unable to write index file " << argv[2] << "\n";
+        return 1;
+    }
+    return 0;
+}
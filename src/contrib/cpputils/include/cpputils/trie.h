@@ -2,13 +2,19 @@
 // License: http://www.opensource.org/licenses/BSD-2-Clause
 
 // trie:
-//   A simple implementation of trie (prefix tree).
+//   A simple implementation of trie (prefix tree). After all keys have been inserted, trie can be
+//   frozen into Aho-Corasick automaton, which finds all keys in text in one linear pass.
 
 #pragma once
 
 #include <cassert>
 #include <climits>
+#include <cstdint>
+#include <map>
 #include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
 namespace cpputils
 {
@@ -40,9 +46,13 @@ public:
     // Inserts new key-value pair into trie if the key is not present in the trie already.
     // Value is constructed from passed args. Returns true if insertion occured, false
     // otherwise.
+    // Keys can not be inserted after the trie has been frozen.
     template<typename... ArgTypes>
     bool insert(const char* key, ArgTypes&&... args)
     {
+        assert(!frozen());
+        if (frozen())
+            return false;
         return insert_impl(key, std::forward<ArgTypes>(args)...);
     }
 
@@ -72,6 +82,22 @@ public:
         return m_size;
     }
 
+    // Compiles all keys into automaton, used by scan. The trie can not be modified afterwards.
+    void freeze();
+
+    // Returns true if freeze has been called.
+    bool frozen() const
+    {
+        return bool(m_automaton);
+    }
+
+    // Finds non-overlapping keys in text of given length in one pass. For each offset from left to right
+    // the longest key, starting at it, is passed to found(offset, length, value). If found returns true,
+    // scanning continues after the key, otherwise from the next offset. This gives the same matches as
+    // calling match at each offset, but takes linear time. The trie must be frozen.
+    template<typename Found>
+    void scan(const char* text, size_t length, Found found) const;
+
 private:
     static_assert(UCHAR_MAX == 255, "Are your bytes 7 bits wide or is your compiler broken?");
 
@@ -81,11 +107,16 @@ private:
     // the first bucket, chars [16-31] in the second etc.
     class NodeChildren;
 
+    // Aho-Corasick automaton, built from all keys in freeze().
+    class Automaton;
+
     // Having root as a unique_ptr instead of inline object allows easy, fast and noexcept move
     // constructor.
     std::unique_ptr<Node> m_root;
     // Number of elements in the trie.
     size_t m_size;
+    // Set in freeze(). Refers to values, stored in nodes.
+    std::unique_ptr<Automaton> m_automaton;
 
     // Used for testing.
     template<typename U>
@@ -117,6 +148,10 @@ public:
         return const_cast<Node*>(get_impl(c));
     }
 
+    // Calls func for each non-empty child in the order of chars.
+    template<typename Func>
+    void for_each(Func func) const;
+
 private:
     // Note that this compiles due to templatedness of Node. Template instantiations happen
     // only after parsing the whole file, when Node becomes a complete type.
@@ -152,6 +187,21 @@ typename Trie<T>::Node* Trie<T>::NodeChildren::add(unsigned char c)
     return &bucket->children[lower];
 }
 
+template<typename T>
+template<typename Func>
+void Trie<T>::NodeChildren::for_each(Func func) const
+{
+    if (!m_root)
+        return;
+    for (const BucketPtr& bucket: m_root->buckets) {
+        if (!bucket)
+            continue;
+        for (const Node& child: bucket->children)
+            if (!child.is_empty())
+                func(&child);
+    }
+}
+
 template<typename T>
 const typename Trie<T>::Node* Trie<T>::NodeChildren::get_impl(unsigned char c) const
 {
@@ -247,6 +297,11 @@ public:
         return reinterpret_cast<const T*>(value_storage);
     }
 
+    const char* get_prefix() const
+    {
+        return prefix;
+    }
+
     // Sets the prefix to no more than first PREFIX_SIZE - 1 chars of new_prefix.
     // Returns the length of set prefix.
     size_t set_prefix(const char* new_prefix);
@@ -433,6 +488,240 @@ const T* Trie<T>::match_impl(const char* key, size_t offset, const Trie::Node* n
     }
 }
 
+
+template<typename T>
+class Trie<T>::Automaton
+{
+public:
+    // Builds the automaton from all keys, stored under root.
+    explicit Automaton(const Node* root);
+
+    TRIE_DISABLE_COPY(Automaton);
+    TRIE_DISABLE_MOVE(Automaton);
+
+    template<typename Found>
+    void scan(const char* text, size_t length, Found found) const;
+
+private:
+    static const uint32_t NO_STATE = UINT32_MAX;
+
+    struct State
+    {
+        // Range of outgoing edges in m_edges, sorted by char.
+        uint32_t edges_begin;
+        uint32_t edges_end;
+        // The state for the longest proper suffix of this state, which is a prefix of some key.
+        uint32_t fail;
+        // The nearest state via failure links, which ends a key, or NO_STATE.
+        uint32_t dict_suffix;
+        // The length of the key prefix, corresponding to the state.
+        uint32_t depth;
+        // The value of the key, ending in this state, or nullptr.
+        const T* value;
+    };
+
+    struct Edge
+    {
+        unsigned char c;
+        uint32_t target;
+    };
+
+    // All states, root is m_states[0].
+    std::vector<State> m_states;
+    // Edges of all states, stored contiguously.
+    std::vector<Edge> m_edges;
+    // Transitions from root for all chars, root loops to itself for chars without edges.
+    uint32_t m_root_next[256];
+    // The length of the longest key.
+    size_t m_max_depth;
+
+    // Collects all keys under node (with key_prefix prepended) into keys.
+    static void collect_keys(const Node* node, std::string& key_prefix,
+                             std::vector<std::pair<std::string, const T*>>& keys);
+
+    // Returns the state after reading c in state.
+    uint32_t next_state(uint32_t state, unsigned char c) const;
+};
+
+template<typename T>
+Trie<T>::Automaton::Automaton(const Node* root)
+    : m_max_depth(0)
+{
+    std::vector<std::pair<std::string, const T*>> keys;
+    if (root) {
+        std::string key_prefix;
+        collect_keys(root, key_prefix, keys);
+    }
+
+    // Build the uncompressed trie of all keys first.
+    std::vector<std::map<unsigned char, uint32_t>> children(1);
+    m_states.push_back(State{ 0, 0, 0, NO_STATE, 0, nullptr });
+    for (const std::pair<std::string, const T*>& key: keys) {
+        uint32_t state = 0;
+        for (unsigned char c: key.first) {
+            auto it = children[state].find(c);
+            if (it != children[state].end()) {
+                state = it->second;
+            } else {
+                uint32_t new_state = m_states.size();
+                m_states.push_back(State{ 0, 0, 0, NO_STATE, m_states[state].depth + 1, nullptr });
+                children.emplace_back();
+                children[state][c] = new_state;
+                state = new_state;
+            }
+        }
+        m_states[state].value = key.second;
+        if (m_max_depth < key.first.size())
+            m_max_depth = key.first.size();
+    }
+
+    // Lay out edges contiguously.
+    for (size_t state = 0; state < m_states.size(); state++) {
+        m_states[state].edges_begin = m_edges.size();
+        for (const std::pair<const unsigned char, uint32_t>& p: children[state])
+            m_edges.push_back(Edge{ p.first, p.second });
+        m_states[state].edges_end = m_edges.size();
+    }
+
+    for (size_t c = 0; c < 256; c++) {
+        auto it = children[0].find(c);
+        m_root_next[c] = (it != children[0].end()) ? it->second : 0;
+    }
+
+    // Set failure and dictionary suffix links in breadth-first order, so that links for all
+    // shallower states are already set.
+    std::vector<uint32_t> queue;
+    for (const std::pair<const unsigned char, uint32_t>& p: children[0])
+        queue.push_back(p.second);
+    for (size_t i = 0; i < queue.size(); i++) {
+        uint32_t state = queue[i];
+        for (const std::pair<const unsigned char, uint32_t>& p: children[state]) {
+            uint32_t child = p.second;
+            uint32_t fail = next_state(m_states[state].fail, p.first);
+            m_states[child].fail = fail;
+            m_states[child].dict_suffix = m_states[fail].value ? fail : m_states[fail].dict_suffix;
+            queue.push_back(child);
+        }
+    }
+}
+
+template<typename T>
+void Trie<T>::Automaton::collect_keys(const Node* node, std::string& key_prefix,
+                                      std::vector<std::pair<std::string, const T*>>& keys)
+{
+    size_t old_size = key_prefix.size();
+    key_prefix += node->get_prefix();
+    if (node->is_leaf()) {
+        keys.emplace_back(key_prefix, node->value());
+    } else {
+        node->children()->for_each([&](const Node* child) {
+            collect_keys(child, key_prefix, keys);
+        });
+    }
+    key_prefix.resize(old_size);
+}
+
+template<typename T>
+uint32_t Trie<T>::Automaton::next_state(uint32_t state, unsigned char c) const
+{
+    while (state != 0) {
+        const State& s = m_states[state];
+        for (uint32_t e = s.edges_begin; e < s.edges_end; e++)
+            if (m_edges[e].c == c)
+                return m_edges[e].target;
+        state = s.fail;
+    }
+    return m_root_next[c];
+}
+
+template<typename T>
+template<typename Found>
+void Trie<T>::Automaton::scan(const char* text, size_t length, Found found) const
+{
+    if (m_max_depth == 0)
+        return;
+
+    // The longest reported match for each start offset, which has not been processed yet, indexed
+    // by offset modulo m_max_depth + 1. The unprocessed offsets never span more than that.
+    // Allocated on the first match, so that text without keys is scanned without allocations.
+    std::vector<std::pair<size_t, const T*>> longest;
+    size_t ring_size = m_max_depth + 1;
+    // All offsets before next_offset have been processed.
+    size_t next_offset = 0;
+    // The number of non-empty elements in longest.
+    size_t pending = 0;
+    uint32_t state = 0;
+    for (size_t end = 1; end <= length + 1; end++) {
+        // No key prefix has been read and no matches are waiting: skip the bytes, which no key
+        // starts with, without any bookkeeping. Usually most of the text is skipped here.
+        if (state == 0 && pending == 0) {
+            while (end <= length && m_root_next[(unsigned char)text[end - 1]] == 0)
+                end++;
+            next_offset = end - 1;
+        }
+
+        // Matches, starting before complete_end, can not be extended any more.
+        size_t complete_end;
+        if (end <= length) {
+            state = next_state(state, text[end - 1]);
+            uint32_t s = m_states[state].value ? state : m_states[state].dict_suffix;
+            for (; s != NO_STATE; s = m_states[s].dict_suffix) {
+                size_t match_length = m_states[s].depth;
+                size_t offset = end - match_length;
+                if (offset < next_offset)
+                    continue;
+                if (longest.empty())
+                    longest.assign(ring_size, std::pair<size_t, const T*>(0, nullptr));
+                std::pair<size_t, const T*>& l = longest[offset % ring_size];
+                if (!l.second)
+                    pending++;
+                if (l.first < match_length)
+                    l = std::make_pair(match_length, m_states[s].value);
+            }
+            complete_end = end - m_states[state].depth;
+        } else {
+            complete_end = length;
+        }
+
+        while (next_offset < complete_end) {
+            if (pending == 0) {
+                next_offset = complete_end;
+                break;
+            }
+            std::pair<size_t, const T*>& l = longest[next_offset % ring_size];
+            if (l.second && found(next_offset, l.first, *l.second)) {
+                size_t match_end = next_offset + l.first;
+                for (; next_offset < match_end; next_offset++) {
+                    std::pair<size_t, const T*>& skipped = longest[next_offset % ring_size];
+                    if (skipped.second)
+                        pending--;
+                    skipped = std::make_pair(0, nullptr);
+                }
+            } else {
+                if (l.second)
+                    pending--;
+                l = std::make_pair(0, nullptr);
+                next_offset++;
+            }
+        }
+    }
+}
+
+template<typename T>
+void Trie<T>::freeze()
+{
+    m_automaton.reset(new Automaton(m_root.get()));
+}
+
+template<typename T>
+template<typename Found>
+void Trie<T>::scan(const char* text, size_t length, Found found) const
+{
+    assert(frozen());
+    if (m_automaton)
+        m_automaton->scan(text, length, found);
+}
+
 #undef TRIE_DISABLE_COPY
 #undef TRIE_DISABLE_MOVE
 #undef TRIE_DEFAULT_MOVE
@@ -0,0 +1,57 @@
+#include "executeerrors.h"
+
+namespace
+{
+
+bool is_false(const picojson::value& v)
+{
+    return v.is<bool>() && !v.get<bool>();
+}
+
+// Returns the index of the first method, starting from start, which has the given name and satisfies
+// pred, or methods.size() if there is none.
+template<typename Pred>
+size_t find_method(const vector<string>& methods, size_t start, const string& name, Pred pred)
+{
+    for (size_t i = start; i < methods.size(); i++)
+        if (methods[i] == name && pred(i))
+            return i;
+    return methods.size();
+}
+
+} // End of anonymous namespace
+
+vector<const picojson::value*> match_execute_errors(const vector<string>& methods,
+                                                   const picojson::array& results,
+                                                   const picojson::array& errors,
+                                                   vector<const picojson::value*>* unmatched_errors)
+{
+    vector<const picojson::value*> ret(methods.size(), nullptr);
+    // Errors are in the order of calling, so the next error belongs to a method after this one.
+    size_t start = 0;
+    for (const picojson::value& error: errors) {
+        if (!error.is<picojson::object>() || !error.get("method").is<string>()) {
+            unmatched_errors->push_back(&error);
+            continue;
+        }
+        const string& name = error.get("method").get<string>();
+
+        size_t i = find_method(methods, start, name, [&](size_t j) {
+            return is_false(results[j]);
+        });
+        // Failed methods should always return false, but we do not want to lose the error.
+        if (i == methods.size()) {
+            i = find_method(methods, start, name, [](size_t) {
+                return true;
+            });
+        }
+        if (i == methods.size()) {
+            unmatched_errors->push_back(&error);
+            continue;
+        }
+
+        ret[i] = &error;
+        start = i + 1;
+    }
+    return ret;
+}
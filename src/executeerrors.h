@@ -0,0 +1,21 @@
+// Matching of errors, returned by Vk.com "execute" method, to the API methods it has run.
+
+#pragma once
+
+#include "common.h"
+
+#include <contrib/picojson/picojson.h>
+
+// "execute" returns false in "response" array for each failed method and appends the error
+// (an object with "method", "error_code" and "error_msg") to "execute_errors" array in the order
+// of calling. A method may also legitimately return false, so errors are matched to methods
+// by name and position: each error goes to the next method with the same name after the method,
+// which got the previous error, preferring the ones, which have returned false.
+//
+// methods are the names of the methods, results is "response" array (of the same size) and errors
+// is "execute_errors" array. Returns the error for each of the methods or nullptr if the method
+// has succeeded. Errors, which do not match any method, are appended to unmatched_errors.
+vector<const picojson::value*> match_execute_errors(const vector<string>& methods,
+                                                   const picojson::array& results,
+                                                   const picojson::array& errors,
+                                                   vector<const picojson::value*>* unmatched_errors);
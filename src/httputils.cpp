@@ -102,6 +102,61 @@ PurpleHttpConnection* http_request_update_on_redirect(PurpleConnection* gc, Purp
     });
 }
 
+namespace
+{
+
+// Helper struct for http_get_all.
+struct HttpGetAllData
+{
+    PurpleConnection* gc;
+    vector<string> urls;
+    size_t max_in_flight;
+    int timeout;
+    HttpGetAllItemCb item_cb;
+    SuccessCb done_cb;
+
+    // The index of the next url to request and the number of running requests.
+    size_t next_url;
+    size_t in_flight;
+};
+typedef shared_ptr<HttpGetAllData> HttpGetAllData_ptr;
+
+// Starts requests until there are max_in_flight running or calls done_cb if everything
+// has been downloaded.
+void http_get_all_next(const HttpGetAllData_ptr& data)
+{
+    while (data->in_flight < data->max_in_flight && data->next_url < data->urls.size()) {
+        size_t url_num = data->next_url;
+        data->next_url++;
+        data->in_flight++;
+
+        PurpleHttpRequest* request = purple_http_request_new(data->urls[url_num].data());
+        purple_http_request_set_timeout(request, data->timeout);
+        PurpleHttpConnection* hc = http_request(data->gc, request, [=](PurpleHttpConnection*,
+                                                                       PurpleHttpResponse* response) {
+            data->in_flight--;
+            data->item_cb(url_num, response);
+            http_get_all_next(data);
+        });
+        purple_http_request_unref(request);
+        // The connection is being closed, nothing else will be downloaded.
+        if (!hc)
+            return;
+    }
+
+    if (data->in_flight == 0 && data->next_url == data->urls.size() && data->done_cb)
+        data->done_cb();
+}
+
+} // End anonymous namespace
+
+void http_get_all(PurpleConnection* gc, const vector<string>& urls, size_t max_in_flight,
+                  int timeout, const HttpGetAllItemCb& item_cb, const SuccessCb& done_cb)
+{
+    HttpGetAllData_ptr data(new HttpGetAllData{ gc, urls, max_in_flight, timeout, item_cb, done_cb,
+                                                0, 0 });
+    http_get_all_next(data);
+}
 
 void http_request_copy_cookie_jar(PurpleHttpRequest* target, PurpleHttpConnection* source_conn)
 {
@@ -22,5 +22,15 @@ PurpleHttpConnection* http_request(PurpleConnection* gc, PurpleHttpRequest* requ
 PurpleHttpConnection* http_request_update_on_redirect(PurpleConnection* gc, PurpleHttpRequest* request,
                                                       const HttpCallback& callback);
 
+// Callback for http_get_all, url_num is the index of the url. The response can be unsuccessful.
+typedef function_ptr<void(size_t url_num, PurpleHttpResponse* response)> HttpGetAllItemCb;
+
+// Downloads urls with at most max_in_flight requests running simultaneously. item_cb is called
+// for each url as soon as it is downloaded (not necessarily in the order of urls), done_cb is
+// called after all the urls have been downloaded or have failed. Each request is aborted after
+// timeout seconds.
+void http_get_all(PurpleConnection* gc, const vector<string>& urls, size_t max_in_flight,
+                  int timeout, const HttpGetAllItemCb& item_cb, const SuccessCb& done_cb);
+
 // Copy cookie-jar from already running connection to new request.
 void http_request_copy_cookie_jar(PurpleHttpRequest* target, PurpleHttpConnection* source_conn);
@@ -0,0 +1,191 @@
+#include <algorithm>
+#include <list>
+#include <map>
+
+#include <glib/gstdio.h>
+#include <util.h>
+
+#include "imagecache.h"
+
+namespace
+{
+
+// The maximum total size of images in the cache.
+const size_t MAX_CACHE_SIZE = 50 * 1024 * 1024;
+
+class ImageCache
+{
+public:
+    ImageCache();
+
+    DISABLE_COPYING(ImageCache)
+
+    char* get(const string& url, size_t* size);
+    void put(const string& url, const char* data, size_t size);
+
+private:
+    struct Entry
+    {
+        size_t size;
+        // Position in m_lru.
+        std::list<string>::iterator lru_it;
+    };
+
+    string m_dir;
+    // Cached files by name. The names are kept in m_lru, the most recently used first.
+    std::map<string, Entry> m_entries;
+    std::list<string> m_lru;
+    size_t m_total_size;
+
+    // Reads the list of files in cache directory, ordered by modification time.
+    void load_index();
+    // Returns name of the file for the url.
+    string get_file_name(const string& url) const;
+    string get_file_path(const string& file_name) const;
+    // Moves the entry to the start of LRU list.
+    void touch(Entry& entry);
+    // Removes the least recently used files until the total size is no more than max_size.
+    void evict(size_t max_size);
+};
+
+ImageCache::ImageCache()
+    : m_total_size(0)
+{
+    char* dir = g_build_filename(purple_user_dir(), "vkcom", "images", nullptr);
+    m_dir = dir;
+    g_free(dir);
+
+    if (g_mkdir_with_parents(m_dir.data(), 0700) != 0) {
+        vkcom_debug_error("Unable to create image cache directory %s\n", m_dir.data());
+        return;
+    }
+    load_index();
+}
+
+char* ImageCache::get(const string& url, size_t* size)
+{
+    string file_name = get_file_name(url);
+    Entry* entry = map_at_ptr(m_entries, file_name);
+    if (!entry)
+        return nullptr;
+
+    string path = get_file_path(file_name);
+    char* data;
+    if (!g_file_get_contents(path.data(), &data, size, nullptr)) {
+        vkcom_debug_error("Unable to read cached image %s\n", path.data());
+        m_total_size -= entry->size;
+        m_lru.erase(entry->lru_it);
+        m_entries.erase(file_name);
+        return nullptr;
+    }
+
+    touch(*entry);
+    // Update modification time, so that the order of use is preserved between sessions.
+    g_utime(path.data(), nullptr);
+    return data;
+}
+
+void ImageCache::put(const string& url, const char* data, size_t size)
+{
+    if (size > MAX_CACHE_SIZE)
+        return;
+
+    string file_name = get_file_name(url);
+    Entry* entry = map_at_ptr(m_entries, file_name);
+    if (entry) {
+        touch(*entry);
+        return;
+    }
+
+    evict(MAX_CACHE_SIZE - size);
+
+    string path = get_file_path(file_name);
+    if (!g_file_set_contents(path.data(), data, size, nullptr)) {
+        vkcom_debug_error("Unable to write cached image %s\n", path.data());
+        return;
+    }
+
+    m_lru.push_front(file_name);
+    m_entries[file_name] = { size, m_lru.begin() };
+    m_total_size += size;
+}
+
+void ImageCache::load_index()
+{
+    GDir* dir = g_dir_open(m_dir.data(), 0, nullptr);
+    if (!dir)
+        return;
+
+    // Pairs (modification time, file name).
+    vector<std::pair<time_t, string>> files;
+    while (const char* name = g_dir_read_name(dir)) {
+        string path = get_file_path(name);
+        GStatBuf st;
+        if (g_stat(path.data(), &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+        files.push_back(std::make_pair(st.st_mtime, string(name)));
+        m_entries[name] = { size_t(st.st_size), m_lru.end() };
+        m_total_size += st.st_size;
+    }
+    g_dir_close(dir);
+
+    std::sort(files.begin(), files.end());
+    for (const std::pair<time_t, string>& file: files) {
+        m_lru.push_front(file.second);
+        m_entries[file.second].lru_it = m_lru.begin();
+    }
+
+    vkcom_debug_info("Image cache contains %d files, %d bytes\n", (int)m_entries.size(),
+                     (int)m_total_size);
+    evict(MAX_CACHE_SIZE);
+}
+
+string ImageCache::get_file_name(const string& url) const
+{
+    char* hash = g_compute_checksum_for_string(G_CHECKSUM_MD5, url.data(), url.size());
+    string ret = hash;
+    g_free(hash);
+    return ret;
+}
+
+string ImageCache::get_file_path(const string& file_name) const
+{
+    char* path = g_build_filename(m_dir.data(), file_name.data(), nullptr);
+    string ret = path;
+    g_free(path);
+    return ret;
+}
+
+void ImageCache::touch(Entry& entry)
+{
+    m_lru.splice(m_lru.begin(), m_lru, entry.lru_it);
+}
+
+void ImageCache::evict(size_t max_size)
+{
+    while (m_total_size > max_size && !m_lru.empty()) {
+        const string& file_name = m_lru.back();
+        g_unlink(get_file_path(file_name).data());
+        m_total_size -= m_entries[file_name].size;
+        m_entries.erase(file_name);
+        m_lru.pop_back();
+    }
+}
+
+ImageCache& get_image_cache()
+{
+    static ImageCache cache;
+    return cache;
+}
+
+} // End of anonymous namespace
+
+char* image_cache_get(const string& url, size_t* size)
+{
+    return get_image_cache().get(url, size);
+}
+
+void image_cache_put(const string& url, const char* data, size_t size)
+{
+    get_image_cache().put(url, data, size);
+}
@@ -0,0 +1,18 @@
+// On-disk cache of downloaded images.
+
+#pragma once
+
+#include "common.h"
+
+// Images (message thumbnails and stickers) are stored in purple user dir, each in a file,
+// named after MD5 of its URL. The total size of the cache is limited, the least recently used
+// images are removed first. The index of the cache (file sizes in the order of use) is kept
+// in memory, it is loaded upon first use and is shared between all accounts.
+
+// Returns the image, stored for url, as g_malloc'ed memory (suitable for passing to
+// purple_imgstore_add_with_id) or nullptr if there is no such image in the cache.
+char* image_cache_get(const string& url, size_t* size);
+
+// Stores the image for url in the cache, removing the least recently used images if the cache
+// becomes too large.
+void image_cache_put(const string& url, const char* data, size_t size);
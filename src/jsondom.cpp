@@ -0,0 +1,555 @@
+#include <clocale>
+#include <cstring>
+#include <cstdlib>
+
+#include "jsondom.h"
+
+namespace jsondom
+{
+
+namespace
+{
+
+// Size of one arena block. Most Long Poll responses fit into one block.
+const size_t ARENA_BLOCK_SIZE = 16 * 1024;
+// Maximum nesting level of arrays/objects, deeper documents are considered malformed.
+const size_t MAX_DEPTH = 128;
+
+const value null_value;
+
+int compare_keys(const char* a, size_t a_len, const char* b, size_t b_len)
+{
+    int ret = memcmp(a, b, std::min(a_len, b_len));
+    if (ret != 0)
+        return ret;
+    if (a_len < b_len)
+        return -1;
+    return a_len > b_len ? 1 : 0;
+}
+
+bool member_less(const member& a, const member& b)
+{
+    return compare_keys(a.key.data, a.key.size, b.key.data, b.key.size) < 0;
+}
+
+void serialize_string(const string_ref& s, string& out)
+{
+    picojson::serialize_str(s.str(), std::back_inserter(out));
+}
+
+} // End of anonymous namespace
+
+arena::arena()
+    : m_cur(nullptr),
+      m_left(0)
+{
+}
+
+arena::~arena()
+{
+    for (char* block: m_blocks)
+        free(block);
+}
+
+void* arena::alloc(size_t size)
+{
+    // Align everything to the size of double, which is the strictest alignment of value members.
+    const size_t align = sizeof(double);
+    size = (size + align - 1) & ~(align - 1);
+
+    if (size > m_left) {
+        // Large allocations get their own block and do not waste the rest of the current one.
+        if (size > ARENA_BLOCK_SIZE / 4) {
+            char* block = (char*)malloc(size);
+            m_blocks.push_back(block);
+            return block;
+        }
+        m_cur = (char*)malloc(ARENA_BLOCK_SIZE);
+        m_blocks.push_back(m_cur);
+        m_left = ARENA_BLOCK_SIZE;
+    }
+
+    void* ret = m_cur;
+    m_cur += size;
+    m_left -= size;
+    return ret;
+}
+
+const value* object::find(const char* key, size_t key_len) const
+{
+    size_t lo = 0;
+    size_t hi = m_size;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        const string_ref& mid_key = m_first[mid].key;
+        int cmp = compare_keys(mid_key.data, mid_key.size, key, key_len);
+        if (cmp == 0)
+            return &m_first[mid].val;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return nullptr;
+}
+
+const value& value::get(size_t idx) const
+{
+    if (m_type != array_type || idx >= m_children.size)
+        return null_value;
+    return ((const value*)m_children.first)[idx];
+}
+
+const value& value::get(const string& key) const
+{
+    if (m_type != object_type)
+        return null_value;
+    const value* v = get<object>().find(key.data(), key.size());
+    return v ? *v : null_value;
+}
+
+const value& value::get(const char* key) const
+{
+    if (m_type != object_type)
+        return null_value;
+    const value* v = get<object>().find(key, strlen(key));
+    return v ? *v : null_value;
+}
+
+bool value::contains(size_t idx) const
+{
+    return m_type == array_type && idx < m_children.size;
+}
+
+bool value::contains(const string& key) const
+{
+    return m_type == object_type && get<object>().find(key.data(), key.size());
+}
+
+bool value::contains(const char* key) const
+{
+    return m_type == object_type && get<object>().find(key, strlen(key));
+}
+
+string value::serialize() const
+{
+    string out;
+    serialize(out);
+    return out;
+}
+
+void value::serialize(string& out) const
+{
+    switch (m_type) {
+    case null_type:
+        out += "null";
+        break;
+    case boolean_type:
+        out += m_bool ? "true" : "false";
+        break;
+    case number_type:
+        // Format numbers exactly the same way picojson does.
+        out += picojson::value(m_number).serialize();
+        break;
+    case string_type:
+        serialize_string(m_string, out);
+        break;
+    case array_type: {
+        out += '[';
+        bool first = true;
+        for (const value& v: get<array>()) {
+            if (!first)
+                out += ',';
+            first = false;
+            v.serialize(out);
+        }
+        out += ']';
+        break;
+    }
+    case object_type: {
+        out += '{';
+        bool first = true;
+        for (const member& m: get<object>()) {
+            if (!first)
+                out += ',';
+            first = false;
+            serialize_string(m.key, out);
+            out += ':';
+            m.val.serialize(out);
+        }
+        out += '}';
+        break;
+    }
+    }
+}
+
+// Recursive descent parser. Arrays and objects are first accumulated in the scratch vectors
+// (shared between all nesting levels) and copied to the arena once their size is known.
+class parser
+{
+public:
+    parser(arena& a, const char* text, size_t len)
+        : m_arena(a),
+          m_cur(text),
+          m_end(text + len),
+          m_depth(0)
+    {
+    }
+
+    string parse(value& root)
+    {
+        skip_ws();
+        if (!parse_value(root))
+            return error();
+        skip_ws();
+        if (m_cur != m_end) {
+            m_error = "garbage after the value";
+            return error();
+        }
+        return string();
+    }
+
+private:
+    arena& m_arena;
+    const char* m_cur;
+    const char* m_end;
+    size_t m_depth;
+    vector<value> m_values;
+    vector<member> m_members;
+    string m_error;
+
+    string error() const
+    {
+        if (m_error.empty())
+            return "syntax error";
+        return m_error;
+    }
+
+    void skip_ws()
+    {
+        while (m_cur != m_end && (*m_cur == ' ' || *m_cur == '\t' || *m_cur == '\r' || *m_cur == '\n'))
+            m_cur++;
+    }
+
+    bool expect(char c)
+    {
+        skip_ws();
+        if (m_cur == m_end || *m_cur != c)
+            return false;
+        m_cur++;
+        return true;
+    }
+
+    bool match_literal(const char* lit)
+    {
+        size_t len = strlen(lit);
+        if ((size_t)(m_end - m_cur) < len || memcmp(m_cur, lit, len) != 0)
+            return false;
+        m_cur += len;
+        return true;
+    }
+
+    bool parse_value(value& v)
+    {
+        if (m_cur == m_end) {
+            m_error = "unexpected end of document";
+            return false;
+        }
+
+        switch (*m_cur) {
+        case 'n':
+            v.m_type = value::null_type;
+            return match_literal("null");
+        case 't':
+            v.m_type = value::boolean_type;
+            v.m_bool = true;
+            return match_literal("true");
+        case 'f':
+            v.m_type = value::boolean_type;
+            v.m_bool = false;
+            return match_literal("false");
+        case '"':
+            v.m_type = value::string_type;
+            return parse_string(v.m_string);
+        case '[':
+            return parse_array(v);
+        case '{':
+            return parse_object(v);
+        default:
+            if ((*m_cur >= '0' && *m_cur <= '9') || *m_cur == '-')
+                return parse_number(v);
+            return false;
+        }
+    }
+
+    bool parse_number(value& v)
+    {
+        const char* start = m_cur;
+        while (m_cur != m_end && *m_cur != '\0' && strchr("0123456789+-.eE", *m_cur))
+            m_cur++;
+
+        // strtod requires zero-terminated string, numbers are short, so copy to the stack.
+        // strtod also expects the decimal point of the current locale (e.g. ',' in ru_RU),
+        // so '.' is replaced with it the same way picojson does.
+        const char* decimal_point = localeconv()->decimal_point;
+        size_t decimal_len = strlen(decimal_point);
+        char buf[64];
+        size_t len = 0;
+        for (const char* p = start; p != m_cur; p++) {
+            if (*p == '.') {
+                if (len + decimal_len >= sizeof(buf))
+                    return false;
+                memcpy(buf + len, decimal_point, decimal_len);
+                len += decimal_len;
+            } else {
+                if (len + 1 >= sizeof(buf))
+                    return false;
+                buf[len++] = *p;
+            }
+        }
+        buf[len] = '\0';
+
+        char* endp;
+        v.m_type = value::number_type;
+        v.m_number = strtod(buf, &endp);
+        return endp == buf + len;
+    }
+
+    // Parses string, pointing to the opening quote. The string is referenced in the text if it
+    // has no escape sequences, otherwise it is unescaped into the arena.
+    bool parse_string(string_ref& s)
+    {
+        m_cur++;
+        const char* start = m_cur;
+        while (m_cur != m_end && *m_cur != '"' && *m_cur != '\\')
+            m_cur++;
+        if (m_cur == m_end) {
+            m_error = "unexpected end of document";
+            return false;
+        }
+        if (*m_cur == '"') {
+            s.data = start;
+            s.size = m_cur - start;
+            m_cur++;
+            return true;
+        }
+
+        // Unescaped string is never longer than the escaped one. Find the closing quote first
+        // to know how much memory to allocate.
+        const char* p = m_cur;
+        while (p != m_end && *p != '"') {
+            if (*p == '\\' && ++p == m_end)
+                break;
+            p++;
+        }
+        if (p == m_end) {
+            m_error = "unexpected end of document";
+            return false;
+        }
+
+        char* out = (char*)m_arena.alloc(p - start);
+        size_t out_len = m_cur - start;
+        memcpy(out, start, out_len);
+        while (*m_cur != '"') {
+            if (*m_cur != '\\') {
+                out[out_len++] = *m_cur++;
+                continue;
+            }
+            m_cur++;
+            switch (*m_cur++) {
+            case '"': out[out_len++] = '"'; break;
+            case '\\': out[out_len++] = '\\'; break;
+            case '/': out[out_len++] = '/'; break;
+            case 'b': out[out_len++] = '\b'; break;
+            case 'f': out[out_len++] = '\f'; break;
+            case 'n': out[out_len++] = '\n'; break;
+            case 'r': out[out_len++] = '\r'; break;
+            case 't': out[out_len++] = '\t'; break;
+            case 'u':
+                if (!parse_codepoint(out, out_len))
+                    return false;
+                break;
+            default:
+                return false;
+            }
+        }
+        m_cur++;
+        s.data = out;
+        s.size = out_len;
+        return true;
+    }
+
+    bool parse_hex4(unsigned& cp)
+    {
+        if (m_end - m_cur < 4)
+            return false;
+        cp = 0;
+        for (int i = 0; i < 4; i++) {
+            char c = *m_cur++;
+            cp <<= 4;
+            if (c >= '0' && c <= '9')
+                cp |= c - '0';
+            else if (c >= 'a' && c <= 'f')
+                cp |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F')
+                cp |= c - 'A' + 10;
+            else
+                return false;
+        }
+        return true;
+    }
+
+    // Parses \uXXXX (possibly a surrogate pair) and writes it as UTF-8. UTF-8 sequence is never
+    // longer than the escape sequence, so out always has enough space.
+    bool parse_codepoint(char* out, size_t& out_len)
+    {
+        unsigned cp;
+        if (!parse_hex4(cp))
+            return false;
+        if (cp >= 0xd800 && cp <= 0xdbff) {
+            if (m_end - m_cur < 2 || m_cur[0] != '\\' || m_cur[1] != 'u')
+                return false;
+            m_cur += 2;
+            unsigned low;
+            if (!parse_hex4(low) || low < 0xdc00 || low > 0xdfff)
+                return false;
+            cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+        } else if (cp >= 0xdc00 && cp <= 0xdfff) {
+            return false;
+        }
+
+        if (cp < 0x80) {
+            out[out_len++] = cp;
+        } else if (cp < 0x800) {
+            out[out_len++] = 0xc0 | (cp >> 6);
+            out[out_len++] = 0x80 | (cp & 0x3f);
+        } else if (cp < 0x10000) {
+            out[out_len++] = 0xe0 | (cp >> 12);
+            out[out_len++] = 0x80 | ((cp >> 6) & 0x3f);
+            out[out_len++] = 0x80 | (cp & 0x3f);
+        } else {
+            out[out_len++] = 0xf0 | (cp >> 18);
+            out[out_len++] = 0x80 | ((cp >> 12) & 0x3f);
+            out[out_len++] = 0x80 | ((cp >> 6) & 0x3f);
+            out[out_len++] = 0x80 | (cp & 0x3f);
+        }
+        return true;
+    }
+
+    bool enter()
+    {
+        if (++m_depth > MAX_DEPTH) {
+            m_error = "nesting is too deep";
+            return false;
+        }
+        return true;
+    }
+
+    bool parse_array(value& v)
+    {
+        if (!enter())
+            return false;
+        m_cur++;
+
+        size_t scratch_start = m_values.size();
+        skip_ws();
+        if (m_cur != m_end && *m_cur == ']') {
+            m_cur++;
+        } else {
+            while (true) {
+                skip_ws();
+                value item;
+                if (!parse_value(item))
+                    return false;
+                m_values.push_back(item);
+                if (expect(']'))
+                    break;
+                if (!expect(','))
+                    return false;
+            }
+        }
+
+        size_t size = m_values.size() - scratch_start;
+        value* items = nullptr;
+        if (size > 0) {
+            items = (value*)m_arena.alloc(size * sizeof(value));
+            std::copy(m_values.begin() + scratch_start, m_values.end(), items);
+            m_values.resize(scratch_start);
+        }
+
+        v.m_type = value::array_type;
+        v.m_children.first = items;
+        v.m_children.size = size;
+        m_depth--;
+        return true;
+    }
+
+    bool parse_object(value& v)
+    {
+        if (!enter())
+            return false;
+        m_cur++;
+
+        size_t scratch_start = m_members.size();
+        skip_ws();
+        if (m_cur != m_end && *m_cur == '}') {
+            m_cur++;
+        } else {
+            while (true) {
+                skip_ws();
+                if (m_cur == m_end || *m_cur != '"')
+                    return false;
+                member m;
+                if (!parse_string(m.key))
+                    return false;
+                if (!expect(':'))
+                    return false;
+                skip_ws();
+                if (!parse_value(m.val))
+                    return false;
+                m_members.push_back(m);
+                if (expect('}'))
+                    break;
+                if (!expect(','))
+                    return false;
+            }
+        }
+
+        size_t size = m_members.size() - scratch_start;
+        member* members = nullptr;
+        if (size > 0) {
+            members = (member*)m_arena.alloc(size * sizeof(member));
+            std::copy(m_members.begin() + scratch_start, m_members.end(), members);
+            m_members.resize(scratch_start);
+            // Objects in API responses are small, sorting is cheap. Stable sort keeps duplicate
+            // keys in order, so that only the last one can be kept like picojson does.
+            std::stable_sort(members, members + size, member_less);
+            size_t unique_size = 0;
+            for (size_t i = 0; i < size; i++) {
+                if (i + 1 < size && !member_less(members[i], members[i + 1]))
+                    continue;
+                members[unique_size++] = members[i];
+            }
+            size = unique_size;
+        }
+
+        v.m_type = value::object_type;
+        v.m_children.first = members;
+        v.m_children.size = size;
+        m_depth--;
+        return true;
+    }
+};
+
+document::document()
+{
+}
+
+string document::parse(const char* text, size_t len)
+{
+    m_root = value();
+    parser p(m_arena, text, len);
+    return p.parse(m_root);
+}
+
+} // namespace jsondom
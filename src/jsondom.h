@@ -0,0 +1,237 @@
+// Read-only JSON DOM, allocated in a single arena.
+
+#pragma once
+
+#include "common.h"
+
+#include <contrib/picojson/picojson.h>
+
+// An alternative to picojson::value for the hot paths, where lots of JSON is parsed and only read
+// (e.g. Long Poll). picojson allocates every string, array and object (std::map) separately,
+// jsondom allocates all nodes in one arena, which is freed at once with jsondom::document.
+// Strings without escape sequences point directly into the parsed text, so the text must outlive
+// the document. Objects are stored as arrays of members, sorted by key.
+//
+// The query interface mimics picojson: is<T>(), get<T>(), get(index), get(key), contains(index),
+// contains(key) and serialize(), so the code can be switched between the two with a namespace
+// alias. The only difference is that get<T>() returns by value (strings are copied, arrays
+// and objects are lightweight views).
+namespace jsondom
+{
+
+// A simple bump allocator: memory is allocated from large blocks and freed all at once.
+class arena
+{
+public:
+    arena();
+    ~arena();
+
+    DISABLE_COPYING(arena)
+
+    void* alloc(size_t size);
+
+private:
+    vector<char*> m_blocks;
+    char* m_cur;
+    size_t m_left;
+};
+
+// Pointer to the string data, which is not owned.
+struct string_ref
+{
+    const char* data;
+    size_t size;
+
+    string str() const
+    {
+        return string(data, size);
+    }
+};
+
+struct null {};
+class value;
+struct member;
+
+// View of the array values, allocated in the arena.
+class array
+{
+public:
+    array(const value* first = nullptr, size_t size = 0)
+        : m_first(first),
+          m_size(size)
+    {
+    }
+
+    const value* begin() const;
+    const value* end() const;
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    const value& operator[](size_t i) const;
+
+private:
+    const value* m_first;
+    size_t m_size;
+};
+
+// View of the object members, allocated in the arena and sorted by key.
+class object
+{
+public:
+    object(const member* first = nullptr, size_t size = 0)
+        : m_first(first),
+          m_size(size)
+    {
+    }
+
+    const member* begin() const;
+    const member* end() const;
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    // Returns nullptr if there is no such key.
+    const value* find(const char* key, size_t key_len) const;
+
+private:
+    const member* m_first;
+    size_t m_size;
+};
+
+class value
+{
+public:
+    enum type_t {
+        null_type,
+        boolean_type,
+        number_type,
+        string_type,
+        array_type,
+        object_type
+    };
+
+    value()
+        : m_type(null_type)
+    {
+    }
+
+    template<typename T> bool is() const;
+    template<typename T> T get() const;
+
+    // Returns null value if the index is out of bounds or the value is not an array.
+    const value& get(size_t idx) const;
+    // Resolves ambiguity between get(size_t) and get(const char*) for get(0).
+    const value& get(int idx) const { return get((size_t)idx); }
+    // Returns null value if there is no such key or the value is not an object.
+    const value& get(const string& key) const;
+    const value& get(const char* key) const;
+
+    bool contains(size_t idx) const;
+    bool contains(int idx) const { return contains((size_t)idx); }
+    bool contains(const string& key) const;
+    bool contains(const char* key) const;
+
+    string serialize() const;
+    void serialize(string& out) const;
+
+private:
+    type_t m_type;
+    union {
+        bool m_bool;
+        double m_number;
+        string_ref m_string;
+        struct {
+            const void* first;
+            size_t size;
+        } m_children;
+    };
+
+    friend class parser;
+};
+
+struct member
+{
+    string_ref key;
+    value val;
+};
+
+inline const value* array::begin() const { return m_first; }
+inline const value* array::end() const { return m_first + m_size; }
+inline const value& array::operator[](size_t i) const { return m_first[i]; }
+
+inline const member* object::begin() const { return m_first; }
+inline const member* object::end() const { return m_first + m_size; }
+
+template<> inline bool value::is<null>() const { return m_type == null_type; }
+template<> inline bool value::is<bool>() const { return m_type == boolean_type; }
+template<> inline bool value::is<double>() const { return m_type == number_type; }
+template<> inline bool value::is<string>() const { return m_type == string_type; }
+template<> inline bool value::is<string_ref>() const { return m_type == string_type; }
+template<> inline bool value::is<array>() const { return m_type == array_type; }
+template<> inline bool value::is<object>() const { return m_type == object_type; }
+
+// Similar to picojson, get<T> asserts that the type is correct.
+template<> inline bool value::get<bool>() const
+{
+    assert(m_type == boolean_type);
+    return m_bool;
+}
+
+template<> inline double value::get<double>() const
+{
+    assert(m_type == number_type);
+    return m_number;
+}
+
+template<> inline string_ref value::get<string_ref>() const
+{
+    assert(m_type == string_type);
+    return m_string;
+}
+
+template<> inline string value::get<string>() const
+{
+    assert(m_type == string_type);
+    return m_string.str();
+}
+
+template<> inline array value::get<array>() const
+{
+    assert(m_type == array_type);
+    return array((const value*)m_children.first, m_children.size);
+}
+
+template<> inline object value::get<object>() const
+{
+    assert(m_type == object_type);
+    return object((const member*)m_children.first, m_children.size);
+}
+
+// Parsed JSON document, owns all the values.
+class document
+{
+public:
+    document();
+
+    DISABLE_COPYING(document)
+
+    // Parses text, which must outlive the document. Returns error string or empty string on success.
+    string parse(const char* text, size_t len);
+
+    const value& root() const
+    {
+        return m_root;
+    }
+
+private:
+    arena m_arena;
+    value m_root;
+};
+
+} // namespace jsondom
+
+// Checks if JSON value is an object, contains key and the type of value for that key is T.
+// Same as field_is_present for picojson::value.
+template<typename T>
+bool field_is_present(const jsondom::value& v, const char* key)
+{
+    return v.get(key).is<T>();
+}
@@ -0,0 +1,52 @@
+#include <cstring>
+
+#include "jsonschema.h"
+
+namespace
+{
+
+// FNV-1a hash.
+size_t hash_key(const char* key, size_t key_len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < key_len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+} // End of anonymous namespace
+
+JsonKeyTable::JsonKeyTable(const vector<const char*>& keys)
+{
+    // Keep the load factor below 0.5, so that probe sequences are short.
+    size_t size = 4;
+    while (size < keys.size() * 2)
+        size *= 2;
+    m_entries.resize(size, Entry{ nullptr, 0, -1 });
+    m_mask = size - 1;
+
+    for (size_t i = 0; i < keys.size(); i++) {
+        // Positional schemas have no keys.
+        if (!keys[i])
+            continue;
+        size_t key_len = strlen(keys[i]);
+        size_t pos = hash_key(keys[i], key_len) & m_mask;
+        while (m_entries[pos].key)
+            pos = (pos + 1) & m_mask;
+        m_entries[pos] = Entry{ keys[i], key_len, int(i) };
+    }
+}
+
+int JsonKeyTable::find(const char* key, size_t key_len) const
+{
+    size_t pos = hash_key(key, key_len) & m_mask;
+    while (m_entries[pos].key) {
+        const Entry& entry = m_entries[pos];
+        if (entry.key_len == key_len && memcmp(entry.key, key, key_len) == 0)
+            return entry.field;
+        pos = (pos + 1) & m_mask;
+    }
+    return -1;
+}
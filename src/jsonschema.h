@@ -0,0 +1,311 @@
+// Decoding of JSON values into structs, described by field tables.
+
+#pragma once
+
+#include "common.h"
+
+#include <contrib/picojson/picojson.h>
+
+#include "jsondom.h"
+
+// Instead of checking each field with field_is_present and looking it up with get() (which is
+// a std::map lookup for picojson), the struct is described once by JsonSchema: a table of fields
+// with pointers to the struct members. Decoding walks the JSON object once, looking up each key
+// in the precomputed hash table of field keys. Positional schemas describe JSON arrays, where
+// each element is a field (e.g. Long Poll updates).
+//
+// The struct must be default-constructible and provide a static schema() method:
+//
+//     struct Foo
+//     {
+//         uint64 id;
+//         string name;
+//
+//         static const JsonSchema<Foo>& schema();
+//     };
+//
+//     const JsonSchema<Foo>& Foo::schema()
+//     {
+//         static const JsonSchema<Foo> schema = {
+//             JSON_FIELD(Foo, id, "id", JSON_REQUIRED),
+//             JSON_FIELD(Foo, name, "name", JSON_OPTIONAL),
+//         };
+//         return schema;
+//     }
+//
+// Both picojson and jsondom values can be decoded. Members can have the following types: bool,
+// int, int64, uint64, double, string, vector<T> of the supported types, structs with schema
+// and const pointers to the JSON value (these point into the decoded tree and are valid
+// as long as it is alive).
+
+const bool JSON_REQUIRED = true;
+const bool JSON_OPTIONAL = false;
+
+// Hash table from field keys to field numbers. Keys are not copied and must be static strings.
+class JsonKeyTable
+{
+public:
+    JsonKeyTable(const vector<const char*>& keys);
+
+    // Returns field number or -1 if the key is not present.
+    int find(const char* key, size_t key_len) const;
+
+private:
+    struct Entry
+    {
+        const char* key;
+        size_t key_len;
+        int field;
+    };
+
+    // Open addressing with linear probing, size is a power of 2.
+    vector<Entry> m_entries;
+    size_t m_mask;
+};
+
+// Helper functions for decoding the values of the supported types. Return false if the type
+// of JSON value does not match.
+template<typename V>
+bool json_decode_value(const V& v, bool& out)
+{
+    // Vk.com usually returns flags as 0/1 numbers.
+    if (v.template is<bool>())
+        out = v.template get<bool>();
+    else if (v.template is<double>())
+        out = v.template get<double>() != 0.0;
+    else
+        return false;
+    return true;
+}
+
+template<typename V>
+bool json_decode_value(const V& v, double& out)
+{
+    if (!v.template is<double>())
+        return false;
+    out = v.template get<double>();
+    return true;
+}
+
+template<typename V>
+bool json_decode_value(const V& v, int& out)
+{
+    if (!v.template is<double>())
+        return false;
+    out = v.template get<double>();
+    return true;
+}
+
+template<typename V>
+bool json_decode_value(const V& v, int64& out)
+{
+    if (!v.template is<double>())
+        return false;
+    out = v.template get<double>();
+    return true;
+}
+
+template<typename V>
+bool json_decode_value(const V& v, uint64& out)
+{
+    if (!v.template is<double>())
+        return false;
+    out = int64(v.template get<double>());
+    return true;
+}
+
+template<typename V>
+bool json_decode_value(const V& v, string& out)
+{
+    if (!v.template is<string>())
+        return false;
+    out = v.template get<string>();
+    return true;
+}
+
+// Pointer to the value inside the tree.
+template<typename V>
+bool json_decode_value(const V& v, const V*& out)
+{
+    out = &v;
+    return true;
+}
+
+// Pointers to the values of a different JSON implementation cannot be decoded.
+template<typename V, typename T>
+bool json_decode_value(const V&, const T*&)
+{
+    return false;
+}
+
+inline bool json_is_array(const picojson::value& v)
+{
+    return v.is<picojson::array>();
+}
+
+inline bool json_is_array(const jsondom::value& v)
+{
+    return v.is<jsondom::array>();
+}
+
+inline const picojson::array& json_get_array(const picojson::value& v)
+{
+    return v.get<picojson::array>();
+}
+
+inline jsondom::array json_get_array(const jsondom::value& v)
+{
+    return v.get<jsondom::array>();
+}
+
+template<typename V, typename T>
+bool json_decode_value(const V& v, vector<T>& out)
+{
+    out.clear();
+    if (!json_is_array(v))
+        return false;
+    for (const V& item: json_get_array(v)) {
+        out.emplace_back();
+        if (!json_decode_value(item, out.back())) {
+            out.clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+// Structs with schemas.
+template<typename V, typename T>
+bool json_decode_value(const V& v, T& out)
+{
+    return T::schema().decode(v, out);
+}
+
+// Decodes JSON value into struct T with schema. Returns false if the value does not match
+// the schema (e.g. is not an object or some required field is missing).
+template<typename T, typename V>
+bool json_decode(const V& v, T& out)
+{
+    return T::schema().decode(v, out);
+}
+
+// Calls f(key, key_len, value) for each member of JSON object. Returns false if v is not an object.
+template<typename F>
+bool json_for_each_member(const picojson::value& v, F f)
+{
+    if (!v.is<picojson::object>())
+        return false;
+    for (const auto& it: v.get<picojson::object>())
+        f(it.first.data(), it.first.size(), it.second);
+    return true;
+}
+
+template<typename F>
+bool json_for_each_member(const jsondom::value& v, F f)
+{
+    if (!v.is<jsondom::object>())
+        return false;
+    for (const jsondom::member& m: v.get<jsondom::object>())
+        f(m.key.data, m.key.size, m.val);
+    return true;
+}
+
+template<typename S, typename T, T S::*Member, typename V>
+bool json_decode_member(const V& v, S& out)
+{
+    return json_decode_value(v, out.*Member);
+}
+
+// Describes one field of the struct S. key is the object key, it is ignored for positional schemas.
+#define JSON_FIELD(S, member, key, required) \
+    JsonSchema<S>::Field{ key, required, \
+        &json_decode_member<S, decltype(S::member), &S::member, picojson::value>, \
+        &json_decode_member<S, decltype(S::member), &S::member, jsondom::value> }
+
+template<typename S>
+class JsonSchema
+{
+public:
+    struct Field
+    {
+        const char* key;
+        bool required;
+        bool (*decode_picojson)(const picojson::value& v, S& out);
+        bool (*decode_jsondom)(const jsondom::value& v, S& out);
+    };
+
+    // Creates schema for JSON object, fields are matched by key.
+    JsonSchema(std::initializer_list<Field> fields)
+        : m_fields(fields),
+          m_keys(get_keys(m_fields)),
+          m_positional(false)
+    {
+        assert(m_fields.size() <= 64);
+    }
+
+    // Creates schema for JSON array, i-th field is the i-th element.
+    static JsonSchema positional(std::initializer_list<Field> fields)
+    {
+        JsonSchema schema(fields);
+        schema.m_positional = true;
+        return schema;
+    }
+
+    // Decodes v into out. All the fields, which are not present in v, are value-initialized
+    // (i.e. zero for numbers, empty for strings). Optional fields with wrong type are ignored.
+    template<typename V>
+    bool decode(const V& v, S& out) const
+    {
+        out = S();
+        uint64 decoded_mask = 0;
+        if (m_positional) {
+            if (!json_is_array(v))
+                return false;
+            size_t i = 0;
+            for (const V& item: json_get_array(v)) {
+                if (i >= m_fields.size())
+                    break;
+                if (decode_field(m_fields[i], item, out))
+                    decoded_mask |= uint64(1) << i;
+                i++;
+            }
+        } else {
+            bool is_object = json_for_each_member(v, [&](const char* key, size_t key_len,
+                                                         const V& item) {
+                int i = m_keys.find(key, key_len);
+                if (i >= 0 && decode_field(m_fields[i], item, out))
+                    decoded_mask |= uint64(1) << i;
+            });
+            if (!is_object)
+                return false;
+        }
+
+        for (size_t i = 0; i < m_fields.size(); i++)
+            if (m_fields[i].required && !(decoded_mask & (uint64(1) << i)))
+                return false;
+        return true;
+    }
+
+private:
+    vector<Field> m_fields;
+    JsonKeyTable m_keys;
+    bool m_positional;
+
+    static vector<const char*> get_keys(const vector<Field>& fields)
+    {
+        vector<const char*> keys;
+        for (const Field& field: fields)
+            keys.push_back(field.key);
+        return keys;
+    }
+
+    static bool decode_field(const Field& field, const picojson::value& v, S& out)
+    {
+        return field.decode_picojson(v, out);
+    }
+
+    static bool decode_field(const Field& field, const jsondom::value& v, S& out)
+    {
+        return field.decode_jsondom(v, out);
+    }
+};
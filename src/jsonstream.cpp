@@ -0,0 +1,166 @@
+#include "jsonstream.h"
+
+JsonItemsStream::JsonItemsStream(const vector<string>& path, const ItemCb& item_cb)
+    : m_path(path),
+      m_item_cb(item_cb),
+      m_items_count(0),
+      m_skip_count(0)
+{
+    restart();
+}
+
+void JsonItemsStream::restart()
+{
+    m_skip_count = std::max(m_skip_count, m_items_count);
+
+    m_levels.clear();
+    m_in_string = false;
+    m_escape = false;
+    m_reading_key = false;
+    m_key.clear();
+    m_in_items = false;
+    m_items_level = 0;
+    m_item.clear();
+    m_rest.clear();
+    m_items_count = 0;
+    m_error.clear();
+}
+
+bool JsonItemsStream::feed(const char* data, size_t len)
+{
+    if (!m_error.empty())
+        return false;
+
+    for (size_t i = 0; i < len; i++) {
+        char c = data[i];
+
+        if (m_in_string) {
+            current_text().push_back(c);
+            if (m_escape) {
+                m_escape = false;
+            } else if (c == '\\') {
+                m_escape = true;
+            } else if (c == '"') {
+                m_in_string = false;
+                if (m_reading_key) {
+                    m_levels.back().key = m_key;
+                    m_reading_key = false;
+                }
+                continue;
+            }
+
+            if (m_reading_key)
+                m_key.push_back(c);
+            continue;
+        }
+
+        switch (c) {
+        case '"':
+            current_text().push_back(c);
+            m_in_string = true;
+            if (!m_levels.empty() && m_levels.back().is_object && m_levels.back().expect_key) {
+                m_reading_key = true;
+                m_key.clear();
+            }
+            break;
+        case '{':
+            current_text().push_back(c);
+            m_levels.push_back({ true, true, string() });
+            break;
+        case '[':
+            if (is_items_array()) {
+                m_rest.push_back(c);
+                m_levels.push_back({ false, false, string() });
+                m_in_items = true;
+                m_items_level = m_levels.size();
+            } else {
+                current_text().push_back(c);
+                m_levels.push_back({ false, false, string() });
+            }
+            break;
+        case '}':
+        case ']':
+            if (m_levels.empty() || m_levels.back().is_object != (c == '}')) {
+                m_error = "unbalanced brackets";
+                return false;
+            }
+            if (m_in_items && m_levels.size() == m_items_level) {
+                if (!finish_item())
+                    return false;
+                m_in_items = false;
+            }
+            current_text().push_back(c);
+            m_levels.pop_back();
+            break;
+        case ',':
+            if (m_in_items && m_levels.size() == m_items_level) {
+                if (!finish_item())
+                    return false;
+                break;
+            }
+            current_text().push_back(c);
+            if (!m_levels.empty() && m_levels.back().is_object)
+                m_levels.back().expect_key = true;
+            break;
+        case ':':
+            current_text().push_back(c);
+            if (!m_levels.empty() && m_levels.back().is_object)
+                m_levels.back().expect_key = false;
+            break;
+        default:
+            current_text().push_back(c);
+            break;
+        }
+    }
+    return true;
+}
+
+string JsonItemsStream::finish(picojson::value& root)
+{
+    if (!m_error.empty())
+        return m_error;
+    if (m_in_string || !m_levels.empty())
+        return "unexpected end of document";
+
+    const char* first = m_rest.data();
+    return picojson::parse(root, first, m_rest.data() + m_rest.size());
+}
+
+string& JsonItemsStream::current_text()
+{
+    return m_in_items ? m_item : m_rest;
+}
+
+bool JsonItemsStream::is_items_array() const
+{
+    if (m_in_items || m_levels.size() != m_path.size())
+        return false;
+
+    for (size_t i = 0; i < m_levels.size(); i++) {
+        const Level& level = m_levels[i];
+        if (!level.is_object || level.expect_key || level.key != m_path[i])
+            return false;
+    }
+    return true;
+}
+
+bool JsonItemsStream::finish_item()
+{
+    // Empty array or whitespace before the closing bracket.
+    if (m_item.find_first_not_of(" \t\r\n") == string::npos) {
+        m_item.clear();
+        return true;
+    }
+
+    picojson::value item;
+    const char* first = m_item.data();
+    m_error = picojson::parse(item, first, m_item.data() + m_item.size());
+    m_item.clear();
+    if (!m_error.empty())
+        return false;
+
+    if (m_items_count >= m_skip_count)
+        m_item_cb(item);
+    m_items_count++;
+    return true;
+}
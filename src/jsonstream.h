@@ -0,0 +1,73 @@
+// Incremental parsing of JSON documents, received in chunks.
+
+#pragma once
+
+#include "common.h"
+
+#include <contrib/picojson/picojson.h>
+
+// Parses JSON document, which is received in chunks (e.g. HTTP response), and passes the elements
+// of one array (e.g. "items" in {"response":{"count":1,"items":[...]}}) to the callback as soon as
+// each element has been received. Only one element is kept in memory at any time, the rest of
+// the document is stored as text with the array replaced by an empty one and is parsed in finish().
+class JsonItemsStream
+{
+public:
+    typedef function_ptr<void(const picojson::value& item)> ItemCb;
+
+    // path is the sequence of object keys, leading to the array, item_cb is called for each array
+    // element.
+    JsonItemsStream(const vector<string>& path, const ItemCb& item_cb);
+
+    DISABLE_COPYING(JsonItemsStream)
+
+    // Parses the next chunk of the document. Returns false if the document is malformed, all
+    // the following chunks are ignored in this case.
+    bool feed(const char* data, size_t len);
+
+    // Parses the rest of the document (everything except the array elements) into root. Returns
+    // error string or empty string on success.
+    string finish(picojson::value& root);
+
+    // Starts parsing the document anew, e.g. when the document is being downloaded once more.
+    // The elements, which have already been passed to the callback, are skipped.
+    void restart();
+
+private:
+    // One level of nested objects/arrays.
+    struct Level
+    {
+        bool is_object;
+        // For objects: true if the next string is the key, the last read key.
+        bool expect_key;
+        string key;
+    };
+
+    vector<string> m_path;
+    ItemCb m_item_cb;
+
+    vector<Level> m_levels;
+    bool m_in_string;
+    bool m_escape;
+    bool m_reading_key;
+    string m_key;
+    // True if we are inside the array and the nesting level of the array.
+    bool m_in_items;
+    size_t m_items_level;
+    // The text of the current array element.
+    string m_item;
+    // The text of the document except the array elements.
+    string m_rest;
+    // The number of array elements, parsed since the last restart, and the number of elements
+    // to skip.
+    size_t m_items_count;
+    size_t m_skip_count;
+    string m_error;
+
+    // Returns the buffer, where the current character must be appended.
+    string& current_text();
+    // Returns true if the array, which is being opened, is the one, defined by path.
+    bool is_items_array() const;
+    // Parses the current element and passes it to the callback.
+    bool finish_item();
+};
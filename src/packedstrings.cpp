@@ -0,0 +1,36 @@
+#include <cstring>
+
+#include "packedstrings.h"
+
+PackedStrings::PackedStrings(const vector<string>& strs)
+{
+    // Do not allocate anything if all strings are empty.
+    size_t size = 0;
+    for (const string& str: strs)
+        size += str.size();
+    if (size == 0)
+        return;
+
+    m_data.reserve(size + strs.size() - 1);
+    for (size_t i = 0; i < strs.size(); i++) {
+        if (i != 0)
+            m_data += '\0';
+        m_data += strs[i];
+    }
+}
+
+string PackedStrings::get(size_t index) const
+{
+    const char* start = m_data.data();
+    const char* end = start + m_data.size();
+    for (size_t i = 0; i < index; i++) {
+        start = (const char*)memchr(start, '\0', end - start);
+        if (!start)
+            return string();
+        start++;
+    }
+    const char* str_end = (const char*)memchr(start, '\0', end - start);
+    if (!str_end)
+        str_end = end;
+    return string(start, str_end);
+}
@@ -0,0 +1,20 @@
+// Compact storage for strings, which are rarely used.
+
+#pragma once
+
+#include "common.h"
+
+// Several strings, packed into one allocation. The strings must not contain '\0'.
+class PackedStrings
+{
+public:
+    PackedStrings() = default;
+    PackedStrings(const vector<string>& strs);
+
+    // Returns string number index or empty string if there are fewer strings.
+    string get(size_t index) const;
+
+private:
+    // Strings, separated by '\0'.
+    string m_data;
+};
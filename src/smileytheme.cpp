@@ -0,0 +1,369 @@
+#include <cstring>
+
+#include "smileytheme.h"
+
+namespace
+{
+
+bool smiley_in_default_theme(const string& smiley)
+{
+    return smiley == ":-)" || smiley == ":-D" || smiley == ":-(" || smiley == ";-)"
+            || smiley == ":-*" || smiley == "8-)" || smiley == ":'(" || smiley == "O:-)"
+            || smiley == ":-X";
+}
+
+// Escapes text the same way purple_markup_escape_text does (it is g_markup_escape_text, which does
+// not escape '). This file is also compiled into compile-smiley-index, so libpurple cannot be used.
+string markup_escape(const string& text)
+{
+    string ret;
+    for (char c: text) {
+        switch (c) {
+        case '&':
+            ret += "&amp;";
+            break;
+        case '<':
+            ret += "&lt;";
+            break;
+        case '>':
+            ret += "&gt;";
+            break;
+        case '"':
+            ret += "&quot;";
+            break;
+        default:
+            ret += c;
+            break;
+        }
+    }
+    return ret;
+}
+
+// v = { filename, smiley shortcut, [smile shortcut 2, ...] }
+void process_theme_smiley_line(const vector<string>& v, const string& buf, SmileyTheme* theme,
+                               vector<string>* errors)
+{
+    // We do not want to set images for custom smileys, which are already present in default
+    // theme (and probably all other themes).
+    bool add_smiley_image = true;
+    for (size_t i = 1; i < v.size(); i++) {
+        if (smiley_in_default_theme(v[i])) {
+            add_smiley_image = false;
+            break;
+        }
+    }
+
+    if (add_smiley_image) {
+        uint32_t image_num = theme->image_files.size();
+        theme->image_files.push_back(v[0]);
+        for (size_t i = 1; i < v.size(); i++)
+            theme->smiley_images.push_back(std::make_pair(v[i], image_num));
+    }
+
+    // Find the unicode and first ASCII version of smiley.
+    string ascii_version;
+    string unicode_version;
+    for (size_t i = 1; i < v.size(); i++) {
+        // Check if any chars are >= 128
+        bool is_unicode = false;
+        for (unsigned char c: v[i]) {
+            if (c > 127) {
+                is_unicode = true;
+                break;
+            }
+        }
+        if (is_unicode) {
+            if (unicode_version.empty())
+                unicode_version = v[i];
+        } else {
+            if (ascii_version.empty())
+                ascii_version = v[i];
+        }
+    }
+
+    if (unicode_version.empty()) {
+        errors->push_back("does not contain a unicode version: " + buf);
+        return;
+    }
+    for (size_t i = 1; i < v.size(); i++) {
+        if (v[i] != unicode_version)
+            theme->ascii_to_unicode.push_back(std::make_pair(v[i], unicode_version));
+    }
+
+    if (!ascii_version.empty())
+        theme->unicode_to_ascii.push_back(std::make_pair(unicode_version, markup_escape(ascii_version)));
+}
+
+// The index starts with magic and format version. All integers are stored as LEB128 varints,
+// strings are stored as length followed by bytes, lists are stored as the number of elements
+// followed by elements.
+const char SMILEY_INDEX_MAGIC[] = "VKSI";
+const size_t SMILEY_INDEX_MAGIC_LEN = 4;
+const uint64 SMILEY_INDEX_VERSION = 1;
+
+class IndexWriter
+{
+public:
+    void put_uint(uint64 v);
+    void put_string(const string& str);
+    void put_string_pairs(const vector<std::pair<string, string>>& pairs);
+
+    const string& data() const
+    {
+        return m_data;
+    }
+
+private:
+    string m_data;
+};
+
+void IndexWriter::put_uint(uint64 v)
+{
+    while (v >= 0x80) {
+        m_data += char((v & 0x7F) | 0x80);
+        v >>= 7;
+    }
+    m_data += char(v);
+}
+
+void IndexWriter::put_string(const string& str)
+{
+    put_uint(str.size());
+    m_data += str;
+}
+
+void IndexWriter::put_string_pairs(const vector<std::pair<string, string>>& pairs)
+{
+    put_uint(pairs.size());
+    for (const std::pair<string, string>& p: pairs) {
+        put_string(p.first);
+        put_string(p.second);
+    }
+}
+
+// All get_ methods return false if the index is truncated or malformed.
+class IndexReader
+{
+public:
+    IndexReader(const char* data, size_t size);
+
+    bool get_uint(uint64* v);
+    bool get_string(string* str);
+    bool get_string_pairs(vector<std::pair<string, string>>* pairs);
+
+    bool at_end() const
+    {
+        return m_cur == m_end;
+    }
+
+private:
+    const char* m_cur;
+    const char* m_end;
+};
+
+IndexReader::IndexReader(const char* data, size_t size)
+    : m_cur(data),
+      m_end(data + size)
+{
+}
+
+bool IndexReader::get_uint(uint64* v)
+{
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (m_cur == m_end)
+            return false;
+        unsigned char c = *m_cur++;
+        *v |= uint64(c & 0x7F) << shift;
+        if (!(c & 0x80))
+            return true;
+    }
+    return false;
+}
+
+bool IndexReader::get_string(string* str)
+{
+    uint64 len;
+    if (!get_uint(&len) || len > uint64(m_end - m_cur))
+        return false;
+    str->assign(m_cur, len);
+    m_cur += len;
+    return true;
+}
+
+bool IndexReader::get_string_pairs(vector<std::pair<string, string>>* pairs)
+{
+    uint64 count;
+    if (!get_uint(&count))
+        return false;
+    for (uint64 i = 0; i < count; i++) {
+        string first;
+        string second;
+        if (!get_string(&first) || !get_string(&second))
+            return false;
+        pairs->push_back(std::make_pair(std::move(first), std::move(second)));
+    }
+    return true;
+}
+
+bool str_at_isspace(const string& s, size_t i)
+{
+    if (i == s.length())
+        return true;
+    return ascii_isspace(s[i]);
+}
+
+// Replaces all smileys in message, found in smileys, with their values. accept_smiley is called
+// for each match and can reject it. The result is built in a new string, so that each part
+// of the message is copied only once.
+template<typename AcceptSmiley>
+void replace_smileys(string& message, const Trie<string>& smileys, AcceptSmiley accept_smiley)
+{
+    string ret;
+    // message[0, copied) has already been processed and appended to ret.
+    size_t copied = 0;
+    smileys.scan(message.data(), message.length(),
+                 [&](size_t index, size_t smiley_len, const string& replacement) {
+        if (!accept_smiley(index, smiley_len))
+            return false;
+
+        if (ret.empty())
+            ret.reserve(message.length());
+        ret.append(message, copied, index - copied);
+        ret += replacement;
+        copied = index + smiley_len;
+        return true;
+    });
+
+    // Nothing has been replaced.
+    if (copied == 0)
+        return;
+    ret.append(message, copied, string::npos);
+    message.swap(ret);
+}
+
+} // End of anonymous namespace
+
+void parse_smiley_theme(const string& contents, SmileyTheme* theme, vector<string>* errors)
+{
+    bool found_section = false;
+    size_t line_start = 0;
+    while (line_start < contents.size()) {
+        size_t line_end = contents.find('\n', line_start);
+        if (line_end == string::npos)
+            line_end = contents.size();
+        string buf = contents.substr(line_start, line_end - line_start);
+        line_start = line_end + 1;
+
+        str_trim(buf);
+        if (buf.length() == 0)
+            continue;
+
+        if (buf[0] == '[') {
+            found_section = true;
+            continue;
+        }
+
+        if (found_section) {
+            vector<string> v; // v = { filename, smiley shortcut, [smile shortcut 2, ...] }
+            str_split_append(buf, ' ', v);
+            if (v.size() <= 1) {
+                errors->push_back("strange line: " + buf);
+                continue;
+            }
+
+            process_theme_smiley_line(v, buf, theme, errors);
+        }
+    }
+}
+
+uint64 smiley_theme_hash(const string& contents)
+{
+    // 64-bit FNV-1a.
+    uint64 hash = 14695981039346656037ULL;
+    for (unsigned char c: contents) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+string write_smiley_index(const SmileyTheme& theme, uint64 theme_hash)
+{
+    IndexWriter writer;
+    writer.put_uint(SMILEY_INDEX_VERSION);
+    writer.put_uint(theme_hash);
+    writer.put_string_pairs(theme.ascii_to_unicode);
+    writer.put_string_pairs(theme.unicode_to_ascii);
+    writer.put_uint(theme.image_files.size());
+    for (const string& file: theme.image_files)
+        writer.put_string(file);
+    writer.put_uint(theme.smiley_images.size());
+    for (const std::pair<string, uint32_t>& p: theme.smiley_images) {
+        writer.put_string(p.first);
+        writer.put_uint(p.second);
+    }
+
+    return string(SMILEY_INDEX_MAGIC, SMILEY_INDEX_MAGIC_LEN) + writer.data();
+}
+
+bool read_smiley_index(const char* data, size_t size, uint64 theme_hash, SmileyTheme* theme)
+{
+    if (size < SMILEY_INDEX_MAGIC_LEN || memcmp(data, SMILEY_INDEX_MAGIC, SMILEY_INDEX_MAGIC_LEN) != 0)
+        return false;
+
+    // Everything is read into temporary first, so that broken index does not leave theme
+    // partially filled.
+    SmileyTheme ret;
+    IndexReader reader(data + SMILEY_INDEX_MAGIC_LEN, size - SMILEY_INDEX_MAGIC_LEN);
+    uint64 version;
+    uint64 hash;
+    if (!reader.get_uint(&version) || version != SMILEY_INDEX_VERSION
+            || !reader.get_uint(&hash) || hash != theme_hash
+            || !reader.get_string_pairs(&ret.ascii_to_unicode)
+            || !reader.get_string_pairs(&ret.unicode_to_ascii))
+        return false;
+
+    uint64 count;
+    if (!reader.get_uint(&count))
+        return false;
+    for (uint64 i = 0; i < count; i++) {
+        string file;
+        if (!reader.get_string(&file))
+            return false;
+        ret.image_files.push_back(std::move(file));
+    }
+
+    if (!reader.get_uint(&count))
+        return false;
+    for (uint64 i = 0; i < count; i++) {
+        string smiley;
+        uint64 image_num;
+        if (!reader.get_string(&smiley) || !reader.get_uint(&image_num)
+                || image_num >= ret.image_files.size())
+            return false;
+        ret.smiley_images.push_back(std::make_pair(std::move(smiley), uint32_t(image_num)));
+    }
+
+    if (!reader.at_end())
+        return false;
+    *theme = std::move(ret);
+    return true;
+}
+
+void replace_ascii_smileys(string& message, const Trie<string>& ascii_to_unicode)
+{
+    replace_smileys(message, ascii_to_unicode, [&](size_t index, size_t ascii_len) {
+        // Check that there are spaces before and after the smiley. Otherwise, it is very easy
+        // to mix it with normal text, e.g. parse 8) in "12345678)" or :( in "like that:(some text)"
+        return (index == 0 || str_at_isspace(message, index - 1))
+                && str_at_isspace(message, index + ascii_len);
+    });
+}
+
+void replace_unicode_smileys(string& message, const Trie<string>& unicode_to_ascii)
+{
+    replace_smileys(message, unicode_to_ascii, [](size_t, size_t) {
+        return true;
+    });
+}
@@ -0,0 +1,47 @@
+// Parsing of Vk.com smiley theme, its precompiled binary index and conversion of smileys in text.
+
+#pragma once
+
+#include <cpputils/trie.h>
+
+#include "common.h"
+
+// Smiley theme, processed into the lists of smileys, used by the plugin. Pairs are listed in the order
+// of the theme file, when the same key is listed several times, the first value must be used.
+struct SmileyTheme
+{
+    // Text smileys and Unicode smileys, which they are converted to when sending.
+    vector<std::pair<string, string>> ascii_to_unicode;
+    // Unicode smileys and "canonical" text smileys, which they are converted to when receiving.
+    // Text smileys ARE escaped.
+    vector<std::pair<string, string>> unicode_to_ascii;
+    // File names of smiley images, relative to the theme directory.
+    vector<string> image_files;
+    // Smileys and indices of their images in image_files.
+    vector<std::pair<string, uint32_t>> smiley_images;
+};
+
+// Parses the contents of theme file. Descriptions of strange lines are appended to errors.
+void parse_smiley_theme(const string& contents, SmileyTheme* theme, vector<string>* errors);
+
+// Returns hash of the contents of theme file. The index is valid only for the theme file
+// with the same hash.
+uint64 smiley_theme_hash(const string& contents);
+
+// The index is a binary file, which contains the theme hash and all lists from SmileyTheme,
+// so that the plugin does not parse the theme file on each start. It is compiled
+// by compile-smiley-index during the build and installed next to the theme file. The plugin
+// uses the index only if its hash matches the installed theme file, otherwise it parses the theme file.
+const char SMILEY_INDEX_FILE_NAME[] = "theme.index";
+
+// Returns the contents of the index for theme.
+string write_smiley_index(const SmileyTheme& theme, uint64 theme_hash);
+// Reads index from data. Returns false if the index is broken, has different format version
+// or has been compiled for a theme file with a different hash.
+bool read_smiley_index(const char* data, size_t size, uint64 theme_hash, SmileyTheme* theme);
+
+// Replaces text smileys in message with Unicode ones from ascii_to_unicode (which must be frozen).
+// Only smileys with spaces before and after are replaced.
+void replace_ascii_smileys(string& message, const Trie<string>& ascii_to_unicode);
+// Replaces Unicode smileys in message with text ones from unicode_to_ascii (which must be frozen).
+void replace_unicode_smileys(string& message, const Trie<string>& unicode_to_ascii);
@@ -3,7 +3,9 @@
 #include <contrib/purple/http.h>
 
 #include "vk-common.h"
+#include "executeerrors.h"
 #include "httputils.h"
+#include "jsonstream.h"
 #include "miscutils.h"
 
 #include "vk-api.h"
@@ -13,21 +15,28 @@ const char api_version[] = "5.78";
 namespace
 {
 
-// We store call parameters, because we may need to repeat the call on error.
-struct VkCall
-{
-    string method_name;
-    CallParams params;
-};
+// Sends the call to Vk.com.
+void send_call(PurpleConnection* gc, const VkCall& call);
 
 // Callback, which is called upon receiving response to API call.
 void on_vk_call_cb(PurpleHttpConnection* http_conn, PurpleHttpResponse* response, const VkCall& call,
+                   const CallSuccessCb& success_cb, const CallErrorCb& error_cb,
+                   JsonItemsStream* items_stream);
+
+// Returns true if the call can be sent as a part of "execute" call.
+bool is_batchable(const VkCall& call);
+
+// Creates "execute" call, which runs all batched calls.
+VkCall make_batch_call(const vector<VkCall>& batch);
+
+// Process error: maybe do another call and/or re-authorize.
+void process_error(PurpleHttpConnection* http_conn, const picojson::value& error, const VkCall &call,
                    const CallSuccessCb& success_cb, const CallErrorCb& error_cb);
 
 } // End of anonymous namespace
 
 void vk_call_api(PurpleConnection* gc, const char* method_name, const CallParams& params,
-                 const CallSuccessCb& success_cb, const CallErrorCb& error_cb)
+                 const CallSuccessCb& success_cb, const CallErrorCb& error_cb, VkCallPriority priority)
 {
     vkcom_debug_info("    API call %s\n", method_name);
 
@@ -40,30 +49,258 @@ void vk_call_api(PurpleConnection* gc, const char* method_name, const CallParams
     VkCall call;
     call.method_name = method_name;
     call.params = params;
+    call.success_cb = success_cb;
+    call.error_cb = error_cb;
+    call.priority = priority;
+    gc_data.call_queue().push(call);
+}
+
+namespace
+{
+
+// The current rate limit on Vk.com.
+const size_t MAX_CALLS_PER_SECOND = 3;
+// The token returns to the bucket a bit later than a second after the call has been sent, because
+// the calls may reach Vk.com with different delays.
+const int TOKEN_RETURN_TIMEOUT = 1100;
+// The maximum number of API methods, which can be run by one "execute".
+const size_t MAX_BATCH_SIZE = 25;
+// Non-interactive calls wait this long before sending, so that they could be batched.
+const int BATCH_TIMEOUT = 20;
+
+} // End of anonymous namespace
+
+VkCallQueue::VkCallQueue(PurpleConnection* gc)
+    : m_gc(gc),
+      m_send_scheduled(false)
+{
+}
+
+void VkCallQueue::push(const VkCall& call, bool retry)
+{
+    if (retry)
+        m_queues[call.priority].push_front(call);
+    else
+        m_queues[call.priority].push_back(call);
+
+    if (m_send_scheduled)
+        return;
+
+    if (call.priority == VK_PRIORITY_INTERACTIVE)
+        send_queued();
+    else
+        schedule_send(BATCH_TIMEOUT);
+}
+
+void VkCallQueue::on_rate_limit_hit()
+{
+    steady_time_point now = steady_clock::now();
+    m_token_return_times.assign(MAX_CALLS_PER_SECOND, now + std::chrono::milliseconds(TOKEN_RETURN_TIMEOUT));
+}
+
+void VkCallQueue::send_queued()
+{
+    if (get_data(m_gc).is_closing())
+        return;
+
+    while (true) {
+        deque<VkCall>* queue = nullptr;
+        for (deque<VkCall>& q: m_queues) {
+            if (!q.empty()) {
+                queue = &q;
+                break;
+            }
+        }
+        if (!queue)
+            return;
+
+        steady_time_point now = steady_clock::now();
+        while (!m_token_return_times.empty() && m_token_return_times.front() <= now)
+            m_token_return_times.pop_front();
+
+        if (m_token_return_times.size() >= MAX_CALLS_PER_SECOND) {
+            // Wait until the first token returns. We add 1 msec, because timers are not precise.
+            int wait_timeout = to_milliseconds(m_token_return_times.front() - now) + 1;
+            vkcom_debug_info("Call rate limit reached, sending next call in %d msec\n", wait_timeout);
+            schedule_send(wait_timeout);
+            return;
+        }
+
+        m_token_return_times.push_back(now + std::chrono::milliseconds(TOKEN_RETURN_TIMEOUT));
+        VkCall call = queue->front();
+        queue->pop_front();
+
+        if (is_batchable(call)) {
+            vector<VkCall> batch = { call };
+            for (deque<VkCall>& q: m_queues) {
+                auto it = q.begin();
+                while (it != q.end() && batch.size() < MAX_BATCH_SIZE) {
+                    if (is_batchable(*it)) {
+                        batch.push_back(*it);
+                        it = q.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+            }
+
+            if (batch.size() > 1)
+                call = make_batch_call(batch);
+        }
+
+        send_call(m_gc, call);
+    }
+}
 
-    string method_url = str_format("https://api.vk.com/method/%s?v=%s&access_token=%s", method_name,
-                                   api_version, gc_data.access_token().data());
+void VkCallQueue::schedule_send(int timeout)
+{
+    m_send_scheduled = true;
+    timeout_add(m_gc, timeout, [=] {
+        m_send_scheduled = false;
+        send_queued();
+        return false;
+    });
+}
+
+namespace
+{
+
+typedef shared_ptr<JsonItemsStream> JsonItemsStream_ptr;
+
+// Response writer for the calls with process_item_cb.
+gboolean items_stream_writer(PurpleHttpConnection*, PurpleHttpResponse* response, const gchar* buffer,
+                             size_t offset, size_t length, gpointer user_data)
+{
+    JsonItemsStream* items_stream = (JsonItemsStream*)user_data;
+    // Error pages are not JSON, we do not need them anyway.
+    if (purple_http_response_get_code(response) != 200)
+        return TRUE;
+
+    // The request has been repeated by http_request after the network error.
+    if (offset == 0)
+        items_stream->restart();
+
+    // The parsing error is reported upon finishing the request.
+    items_stream->feed(buffer, length);
+    return TRUE;
+}
+
+void send_call(PurpleConnection* gc, const VkCall& call)
+{
+    VkData& gc_data = get_data(gc);
+    string method_url = str_format("https://api.vk.com/method/%s?v=%s&access_token=%s",
+                                   call.method_name.data(), api_version, gc_data.access_token().data());
     PurpleHttpRequest* req = purple_http_request_new(method_url.data());
     purple_http_request_set_method(req, "POST");
     purple_http_request_header_add(req, "Content-Type", "application/x-www-form-urlencoded");
-    if (!params.empty()) {
-        string body = urlencode_form(params);
+    if (!call.params.empty()) {
+        string body = urlencode_form(call.params);
         purple_http_request_set_contents(req, body.data(), body.length());
     }
 
+    JsonItemsStream_ptr items_stream;
+    if (call.process_item_cb) {
+        items_stream.reset(new JsonItemsStream({ "response", "items" }, call.process_item_cb));
+        purple_http_request_set_response_writer(req, items_stream_writer, items_stream.get());
+    }
+
     http_request(gc, req, [=](PurpleHttpConnection* http_conn, PurpleHttpResponse* response) {
         // Connection has been cancelled due to account being disconnected. Do not do any response
         // processing, as callbacks may initiate new HTTP requests.
         if (get_data(gc).is_closing())
             return;
 
-        on_vk_call_cb(http_conn, response, call, success_cb, error_cb);
+        on_vk_call_cb(http_conn, response, call, call.success_cb, call.error_cb, items_stream.get());
     });
     purple_http_request_unref(req);
 }
 
-namespace
+bool is_batchable(const VkCall& call)
+{
+    // Interactive calls are not delayed by batching. Besides, messages.send may require captcha
+    // and captcha_sid/captcha_img are not returned for the methods, called from "execute".
+    // The items in "execute" response cannot be processed while receiving the response.
+    return call.priority != VK_PRIORITY_INTERACTIVE && call.method_name != "execute"
+            && !call.process_item_cb;
+}
+
+// Returns VKScript object literal with call parameters, e.g. {"user_ids":"1,2","fields":"domain"}.
+string params_to_vkscript(const CallParams& params)
+{
+    picojson::object obj;
+    for (const pair<string, string>& p: params)
+        obj[p.first] = picojson::value(p.second);
+    return picojson::value(obj).serialize();
+}
+
+// Splits the response of "execute" between the batched calls. Errors of the failed calls are
+// processed by process_error, same as for the calls, sent separately.
+void process_batch_response(PurpleHttpConnection* http_conn, const picojson::value& root,
+                            const vector<VkCall>& batch)
+{
+    const picojson::value& response = root.get("response");
+    if (!response.is<picojson::array>() || response.get<picojson::array>().size() != batch.size()) {
+        vkcom_debug_error("Strange response from execute: %s\n", response.serialize().data());
+        for (const VkCall& call: batch)
+            if (call.error_cb)
+                call.error_cb(picojson::value());
+        return;
+    }
+
+    static const picojson::array empty_errors;
+    const picojson::array& errors = field_is_present<picojson::array>(root, "execute_errors")
+            ? root.get("execute_errors").get<picojson::array>() : empty_errors;
+
+    vector<string> methods;
+    for (const VkCall& call: batch)
+        methods.push_back(call.method_name);
+    const picojson::array& results = response.get<picojson::array>();
+    vector<const picojson::value*> unmatched_errors;
+    vector<const picojson::value*> call_errors = match_execute_errors(methods, results, errors,
+                                                                      &unmatched_errors);
+    for (const picojson::value* error: unmatched_errors)
+        vkcom_debug_error("Strange error in execute_errors: %s\n", error->serialize().data());
+
+    for (size_t i = 0; i < batch.size(); i++) {
+        const VkCall& call = batch[i];
+        if (call_errors[i]) {
+            vkcom_debug_info("Vk.com call %s in execute failed\n", call.method_name.data());
+            process_error(http_conn, *call_errors[i], call, call.success_cb, call.error_cb);
+        } else {
+            if (call.success_cb)
+                call.success_cb(results[i]);
+        }
+    }
+}
+
+VkCall make_batch_call(const vector<VkCall>& batch)
 {
+    vkcom_debug_info("Sending %d calls in one execute\n", (int)batch.size());
+
+    string code = "return [";
+    for (size_t i = 0; i < batch.size(); i++) {
+        if (i > 0)
+            code += ",";
+        code += str_format("API.%s(%s)", batch[i].method_name.data(),
+                           params_to_vkscript(batch[i].params).data());
+    }
+    code += "];";
+
+    shared_ptr<vector<VkCall>> batched_calls{ new vector<VkCall>(batch) };
+
+    VkCall call;
+    call.method_name = "execute";
+    call.params = { {"code", code} };
+    call.error_cb = [=](const picojson::value& error) {
+        for (const VkCall& c: *batched_calls)
+            if (c.error_cb)
+                c.error_cb(error);
+    };
+    // Calls are batched in the order of priority, so the first one has the highest.
+    call.priority = batch.front().priority;
+    call.batched_calls = batched_calls;
+    return call;
+}
 
 // Someone started authentication, waits until the auth token is set and repeats the call.
 void vk_call_after_auth(PurpleConnection* gc, const VkCall& call,
@@ -78,7 +315,7 @@ void vk_call_after_auth(PurpleConnection* gc, const VkCall& call,
         if (get_data(gc).is_authenticating())
             vk_call_after_auth(gc, call, success_cb, error_cb);
         else
-            vk_call_api(gc, call.method_name.data(), call.params, success_cb, error_cb);
+            get_data(gc).call_queue().push(call, true);
         return false;
     });
 }
@@ -115,22 +352,23 @@ void process_error(PurpleHttpConnection* http_conn, const picojson::value& error
 
             gc_data.clear_access_token();
             gc_data.authenticate([=] {
-                vk_call_api(gc, call.method_name.data(), call.params, success_cb, error_cb);
+                get_data(gc).call_queue().push(call, true);
             }, [=] {
                 if (error_cb)
                     error_cb(picojson::value());
             });
         }
     } else if (error_code == VK_TOO_MANY_REQUESTS_PER_SECOND) {
-        const int RETRY_TIMEOUT = 400; // 400msec is less than 3 requests per second (the current rate limit on Vk.com
-        vkcom_debug_info("Call rate limit hit, retrying in %d msec\n", RETRY_TIMEOUT);
+        vkcom_debug_info("Call rate limit hit, retrying\n");
 
-        timeout_add(gc, RETRY_TIMEOUT, [=] {
-            vk_call_api(gc, call.method_name.data(), call.params, success_cb, error_cb);
-            return false;
-        });
+        gc_data.call_queue().on_rate_limit_hit();
+        gc_data.call_queue().push(call, true);
     } else if (error_code == VK_FLOOD_CONTROL) {
-        // Simply ignore the error.
+        // The callers must be notified: vk_call_api_items waits for all requested pages
+        // to either succeed or fail.
+        vkcom_debug_error("Flood control error for %s\n", call.method_name.data());
+        if (error_cb)
+            error_cb(error);
     } else if (error_code == VK_VALIDATION_REQUIRED) {
         // As far as I could understand, once you complete validation, all future requests/login
         // attempts will work correctly, so there is no need to do anything apart from showing
@@ -182,7 +420,8 @@ void process_error(PurpleHttpConnection* http_conn, const picojson::value& error
 }
 
 void on_vk_call_cb(PurpleHttpConnection* http_conn, PurpleHttpResponse* response, const VkCall &call,
-                   const CallSuccessCb& success_cb, const CallErrorCb& error_cb)
+                   const CallSuccessCb& success_cb, const CallErrorCb& error_cb,
+                   JsonItemsStream* items_stream)
 {
     if (!purple_http_response_is_successful(response)) {
         vkcom_debug_error("Error while calling API: %s\n", purple_http_response_get_error(response));
@@ -191,15 +430,26 @@ void on_vk_call_cb(PurpleHttpConnection* http_conn, PurpleHttpResponse* response
         return;
     }
 
-    const char* response_text = purple_http_response_get_data(response, nullptr);
-    const char* response_text_copy = response_text; // Picojson updates iterators it received.
     picojson::value root;
-    string error = picojson::parse(root, response_text, response_text + strlen(response_text));
-    if (!error.empty()) {
-        vkcom_debug_error("Error parsing %s: %s\n", response_text_copy, error.data());
-        if (error_cb)
-            error_cb(picojson::value());
-        return;
+    if (items_stream) {
+        string error = items_stream->finish(root);
+        if (!error.empty()) {
+            vkcom_debug_error("Error parsing response to %s: %s\n", call.method_name.data(), error.data());
+            if (error_cb)
+                error_cb(picojson::value());
+            return;
+        }
+    } else {
+        size_t response_len;
+        const char* response_text = purple_http_response_get_data(response, &response_len);
+        const char* response_text_copy = response_text; // Picojson updates iterators it received.
+        string error = picojson::parse(root, response_text, response_text + response_len);
+        if (!error.empty()) {
+            vkcom_debug_error("Error parsing %s: %s\n", response_text_copy, error.data());
+            if (error_cb)
+                error_cb(picojson::value());
+            return;
+        }
     }
 
     // Process all errors, potentially re-executing the request.
@@ -215,14 +465,16 @@ void on_vk_call_cb(PurpleHttpConnection* http_conn, PurpleHttpResponse* response
         return;
     }
 
+    if (call.batched_calls) {
+        process_batch_response(http_conn, root, *call.batched_calls);
+        return;
+    }
+
     if (success_cb)
         success_cb(root.get("response"));
 }
 
 
-// We do not want to copy CallParams when storing in lambda, the easiest way is storing them in shared_ptr.
-typedef shared_ptr<CallParams> CallParams_ptr;
-
 // Adds or replaces existing parameter value in CallParams.
 void add_or_replace_call_param(CallParams& params, const char* name, const char* value)
 {
@@ -235,51 +487,215 @@ void add_or_replace_call_param(CallParams& params, const char* name, const char*
     params.emplace_back(name, value);
 }
 
-void vk_call_api_items_impl(PurpleConnection* gc, const char* method_name,
-                            const CallParams_ptr& params, bool pagination,
-                            const CallProcessItemCb& call_process_item_cb,
-                            const CallFinishedCb& call_finished_cb, const CallErrorCb& error_cb,
-                            size_t offset)
+// The maximum number of pages, which are requested simultaneously by vk_call_api_items.
+const unsigned MAX_PAGES_IN_FLIGHT = 3;
+
+// A page of items, which is being received or has been received.
+struct ItemsPage
+{
+    // Items, which have been received before all the preceding pages have been processed.
+    picojson::array items;
+    // The total number of items in the page, received so far.
+    size_t items_count;
+    // True when the whole page has been received.
+    bool received;
+};
+
+// State of vk_call_api_items. The first page is requested alone, because we need to know the page
+// size and the total count of items. After that up to MAX_PAGES_IN_FLIGHT next pages are requested
+// at once (they get rate-limited by VkCallQueue). Items are parsed while the response is being
+// received and are passed to call_process_item_cb strictly in the order of offsets: the items
+// of the first unprocessed page are passed immediately, the items of the next pages wait until
+// all the preceding pages have been processed.
+//
+// The list may change between requests (e.g. new message arrives), so the items may be shifted between
+// the pages and duplicates are possible. All the callers already tolerate this.
+struct ItemsCallData
+{
+    PurpleConnection* gc;
+    string method_name;
+    CallParams params;
+    bool pagination;
+    CallProcessItemCb call_process_item_cb;
+    CallFinishedCb call_finished_cb;
+    CallErrorCb error_cb;
+    VkCallPriority priority;
+
+    // The number of items in the first page, the offsets of all next pages are multiples of it.
+    size_t page_size;
+    // The total number of items, updated from each response.
+    uint64 count;
+    // Offset of the next page to be requested.
+    size_t next_request_offset;
+    // Offset of the first page, which has not been fully processed.
+    size_t next_process_offset;
+    // Pages, which have been requested and not processed yet.
+    map<size_t, ItemsPage> pages;
+    unsigned pages_in_flight;
+    // Set upon error or when all items have been processed, the late responses are ignored.
+    bool finished;
+};
+typedef shared_ptr<ItemsCallData> ItemsCallData_ptr;
+
+void request_items_page(const ItemsCallData_ptr& data, size_t offset);
+
+// Requests next pages until either MAX_PAGES_IN_FLIGHT pages are requested or all items
+// have been requested.
+void request_next_items_pages(const ItemsCallData_ptr& data)
+{
+    while (data->pages_in_flight < MAX_PAGES_IN_FLIGHT && data->next_request_offset < data->count) {
+        request_items_page(data, data->next_request_offset);
+        data->next_request_offset += data->page_size;
+    }
+}
+
+void finish_items_call(const ItemsCallData_ptr& data)
+{
+    data->finished = true;
+    data->pages.clear();
+    if (data->call_finished_cb)
+        data->call_finished_cb();
+}
+
+// Passes the items, which have been waiting for the preceding pages, and moves to the next page
+// until the page, which has not been fully received.
+void process_received_items_pages(const ItemsCallData_ptr& data)
+{
+    while (true) {
+        auto it = data->pages.find(data->next_process_offset);
+        if (it == data->pages.end())
+            break;
+
+        ItemsPage& page = it->second;
+        picojson::array items;
+        items.swap(page.items);
+        for (const picojson::value& v: items)
+            data->call_process_item_cb(v);
+
+        // The rest of the items will be passed immediately upon receiving.
+        if (!page.received)
+            return;
+
+        // Either items have been removed from the list and there is nothing left or the callback
+        // has initiated closing the connection.
+        if (page.items_count == 0 || get_data(data->gc).is_closing()) {
+            finish_items_call(data);
+            return;
+        }
+        data->pages.erase(it);
+        data->next_process_offset += data->page_size;
+    }
+
+    if (data->next_process_offset >= data->count && data->pages_in_flight == 0) {
+        finish_items_call(data);
+        return;
+    }
+
+    request_next_items_pages(data);
+}
+
+void request_items_page(const ItemsCallData_ptr& data, size_t offset)
 {
+    VkData& gc_data = get_data(data->gc);
+    if (gc_data.is_closing())
+        return;
+
+    VkCall call;
+    call.method_name = data->method_name;
+    call.params = data->params;
     if (offset > 0) {
-        vkcom_debug_info("    API call with offset %d\n", (int)offset);
-        add_or_replace_call_param(*params, "offset", to_string(offset).data());
+        vkcom_debug_info("    API call %s with offset %d\n", data->method_name.data(), (int)offset);
+        add_or_replace_call_param(call.params, "offset", to_string(offset).data());
+    } else {
+        vkcom_debug_info("    API call %s\n", data->method_name.data());
     }
 
-    vk_call_api(gc, method_name, *params, [=] (const picojson::value& result) {
+    data->pages[offset] = { picojson::array(), 0, false };
+    data->pages_in_flight++;
+
+    call.process_item_cb = [=](const picojson::value& item) {
+        if (data->finished)
+            return;
+
+        ItemsPage& page = data->pages[offset];
+        page.items_count++;
+        if (offset == data->next_process_offset)
+            data->call_process_item_cb(item);
+        else
+            page.items.push_back(item);
+    };
+
+    call.success_cb = [=](const picojson::value& result) {
+        data->pages_in_flight--;
+        if (data->finished)
+            return;
+
         if (!field_is_present<picojson::array>(result, "items")
                 || !field_is_present<double>(result, "count")) {
             vkcom_debug_error("Strange response, no 'count' and/or 'items' are present: %s\n",
                                result.serialize().data());
-            if (error_cb)
-                error_cb(picojson::value());
+            data->finished = true;
+            if (data->error_cb)
+                data->error_cb(picojson::value());
             return;
         }
 
-        const picojson::array& items = result.get("items").get<picojson::array>();
-        for (const picojson::value& v: items)
-            call_process_item_cb(v);
-
-        uint64 count = result.get("count").get<double>();
-        size_t next_offset = offset + items.size();
-        // Either we've received all items or method does not have pagination.
-        if (next_offset >= count || items.empty() || !pagination) {
-            if (call_finished_cb)
-                call_finished_cb();
+        data->count = result.get("count").get<double>();
+        ItemsPage& page = data->pages[offset];
+        page.received = true;
+        if (offset == 0) {
+            // Either we've received all items or method does not have pagination.
+            if (page.items_count >= data->count || page.items_count == 0 || !data->pagination
+                    || get_data(data->gc).is_closing()) {
+                finish_items_call(data);
+                return;
+            }
+
+            data->page_size = page.items_count;
+            data->next_request_offset = data->page_size;
+            data->next_process_offset = data->page_size;
+            data->pages.erase(offset);
+            request_next_items_pages(data);
         } else {
-            vk_call_api_items_impl(gc, method_name, params, pagination, call_process_item_cb,
-                                   call_finished_cb, error_cb, next_offset);
+            process_received_items_pages(data);
         }
-    }, error_cb);
+    };
+
+    call.error_cb = [=](const picojson::value& error) {
+        data->pages_in_flight--;
+        if (data->finished)
+            return;
+
+        data->finished = true;
+        if (data->error_cb)
+            data->error_cb(error);
+    };
+
+    call.priority = data->priority;
+    gc_data.call_queue().push(call);
 }
 
 } // End of anonymous namespace
 
 void vk_call_api_items(PurpleConnection* gc, const char* method_name, const CallParams& params, bool pagination,
                        const CallProcessItemCb& call_process_item_cb, const CallFinishedCb& call_finished_cb,
-                       const CallErrorCb& error_cb)
+                       const CallErrorCb& error_cb, VkCallPriority priority)
 {
-    CallParams_ptr params_ptr{ new CallParams(params) };
-    vk_call_api_items_impl(gc, method_name, params_ptr, pagination, call_process_item_cb,
-                           call_finished_cb, error_cb, 0);
+    ItemsCallData_ptr data{ new ItemsCallData() };
+    data->gc = gc;
+    data->method_name = method_name;
+    data->params = params;
+    data->pagination = pagination;
+    data->call_process_item_cb = call_process_item_cb;
+    data->call_finished_cb = call_finished_cb;
+    data->error_cb = error_cb;
+    data->priority = priority;
+    data->page_size = 0;
+    data->count = 0;
+    data->next_request_offset = 0;
+    data->next_process_offset = 0;
+    data->pages_in_flight = 0;
+    data->finished = false;
+
+    request_items_page(data, 0);
 }
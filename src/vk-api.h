@@ -2,8 +2,10 @@
 
 #pragma once
 
+#include <deque>
 #include <utility>
 
+using std::deque;
 using std::pair;
 
 #include "common.h"
@@ -12,17 +14,36 @@ using std::pair;
 
 #include "contrib/picojson/picojson.h"
 
-// Calls method with params.
+// Priority of API call. Vk.com limits the number of calls per second, so the calls are queued
+// and the calls with higher priority are sent first.
+enum VkCallPriority {
+    // Calls, initiated by the user, who waits for the result (sending messages, typing
+    // notifications etc.)
+    VK_PRIORITY_INTERACTIVE,
+    // Calls, which follow long poll events (e.g. receiving new messages).
+    VK_PRIORITY_LONGPOLL,
+    // All other calls.
+    VK_PRIORITY_NORMAL,
+    // Periodic background updates (e.g. update_user_chat_infos).
+    VK_PRIORITY_BACKGROUND,
+
+    VK_PRIORITY_COUNT
+};
+
+// Calls method with params. The call is not sent immediately, but is added to the per-connection
+// queue, see VkCallQueue.
 typedef vector<pair<string, string>> CallParams;
 typedef function_ptr<void(const picojson::value& result)> CallSuccessCb;
 typedef function_ptr<void(const picojson::value& error)> CallErrorCb;
 void vk_call_api(PurpleConnection* gc, const char* method_name, const CallParams& params,
-                 const CallSuccessCb& success_cb, const CallErrorCb& error_cb);
+                 const CallSuccessCb& success_cb, const CallErrorCb& error_cb,
+                 VkCallPriority priority = VK_PRIORITY_NORMAL);
 
 // Helper function for calling APIs with "messages.get" or "messages.getDialogs" which return
 // "items" array as a part of return value and may accept "offset" as a parameter.
 //
-// pagination is true for methods which accept "offset", false otherwise,
+// pagination is true for methods which accept "offset", false otherwise (several pages are requested
+// simultaneously, but the items are always processed in the order of offsets),
 // call_process_item_cb is called for each item in the array,
 // call_finished_cb is called upon completion,
 // error_cb is called upon error.
@@ -30,4 +51,69 @@ typedef function_ptr<void(const picojson::value&)> CallProcessItemCb;
 typedef function_ptr<void()> CallFinishedCb;
 void vk_call_api_items(PurpleConnection* gc, const char* method_name, const CallParams& params,
                        bool pagination, const CallProcessItemCb& call_process_item_cb,
-                       const CallFinishedCb& call_finished_cb, const CallErrorCb& error_cb);
+                       const CallFinishedCb& call_finished_cb, const CallErrorCb& error_cb,
+                       VkCallPriority priority = VK_PRIORITY_NORMAL);
+
+// A single API call. We store call parameters, because the call waits in the queue and we may need
+// to repeat the call on error.
+struct VkCall
+{
+    string method_name;
+    CallParams params;
+    CallSuccessCb success_cb;
+    CallErrorCb error_cb;
+    VkCallPriority priority;
+    // Set for "execute" calls, which VkCallQueue creates from several queued calls. The response
+    // is split between these calls.
+    shared_ptr<vector<VkCall>> batched_calls;
+    // If set, elements of "items" array in the response are passed to process_item_cb while
+    // the response is being received and success_cb receives the response with empty "items".
+    // Used by vk_call_api_items.
+    CallProcessItemCb process_item_cb;
+};
+
+// A queue of API calls, which have not been sent yet. Vk.com allows at most 3 calls per second
+// and returns VK_TOO_MANY_REQUESTS_PER_SECOND for any excess calls, so instead of sending calls
+// immediately and retrying them after the error, we send calls no faster than the limit.
+//
+// The limit is enforced by a token bucket: there are MAX_CALLS_PER_SECOND tokens, each sent call
+// takes one and the token returns to the bucket a second after the call has been sent. Calls
+// with higher priority are sent first, calls with equal priority are sent in the order of adding.
+//
+// Vk.com counts "execute" as a single call, no matter how many API methods it runs, so up to
+// MAX_BATCH_SIZE queued calls are sent as one "execute" call. All calls except the interactive
+// ones wait for a short while before sending, so that the calls, issued one after another, get
+// batched together.
+//
+// Each connection has its own queue, see VkData::call_queue().
+class VkCallQueue
+{
+public:
+    VkCallQueue(PurpleConnection* gc);
+
+    DISABLE_COPYING(VkCallQueue)
+
+    // Adds call to the queue and sends as many calls, as the rate limit allows. Retried calls
+    // are added to the front of the queue, so that they do not wait behind the calls, which
+    // have been issued after them.
+    void push(const VkCall& call, bool retry = false);
+
+    // Must be called when Vk.com returns VK_TOO_MANY_REQUESTS_PER_SECOND despite the rate limit
+    // (e.g. if another client uses the same access token): takes all tokens from the bucket.
+    void on_rate_limit_hit();
+
+private:
+    PurpleConnection* m_gc;
+    // Queued calls, one queue per priority.
+    deque<VkCall> m_queues[VK_PRIORITY_COUNT];
+    // Times, when the tokens taken from the bucket will return, in ascending order.
+    deque<steady_time_point> m_token_return_times;
+    // True if the timer for sending the queued calls has been added.
+    bool m_send_scheduled;
+
+    // Sends queued calls until either the queue or the bucket is empty. Adds the timer for sending
+    // the rest of the calls when the bucket is empty.
+    void send_queued();
+    // Adds the timer, which calls send_queued.
+    void schedule_send(int timeout);
+};
@@ -1,8 +1,13 @@
+#include <algorithm>
+#include <iterator>
+
 #include "httputils.h"
 #include "miscutils.h"
 #include "vk-api.h"
 #include "vk-chat.h"
 #include "vk-common.h"
+#include "vk-infocache.h"
+#include "vk-schema.h"
 #include "vk-utils.h"
 
 #include "vk-buddy.h"
@@ -15,125 +20,156 @@ const char user_fields[] = "first_name,last_name,bdate,education,photo_50,photo_
                            "online,contacts,activity,last_seen,domain";
 
 // Creates single string from multiple fields in user_fields, describing education.
-string make_education_string(const picojson::value& v)
+string make_education_string(const VkUserFields& user)
 {
-    string ret;
-    if (field_is_present<string>(v, "university_name")) {
-        ret = v.get("university_name").get<string>();
-        if (ret.empty())
-            return ret;
-        if (field_is_present<string>(v, "faculty_name"))
-            ret = v.get("faculty_name").get<string>() +  ", " + ret;
-        if (field_is_present<double>(v, "graduation")) {
-            int graduation = int(v.get("graduation").get<double>());
-            if (graduation != 0) {
-                ret += " ";
-
-                char buf[128];
-                // Strip '20' from graduation year
-                if (graduation >= 2000)
-                    sprintf(buf, "'%02d", graduation % 100);
-                else
-                    sprintf(buf, "%d", graduation);
-                ret += buf;
-            }
-        }
+    string ret = user.university_name;
+    if (ret.empty())
+        return ret;
+    if (!user.faculty_name.empty())
+        ret = user.faculty_name +  ", " + ret;
+    if (user.graduation != 0) {
+        ret += " ";
+
+        char buf[128];
+        // Strip '20' from graduation year
+        if (user.graduation >= 2000)
+            sprintf(buf, "'%02d", user.graduation % 100);
+        else
+            sprintf(buf, "%d", user.graduation);
+        ret += buf;
     }
     return ret;
 }
 
-// Updates user info about user.
-void update_user_info_from(PurpleConnection* gc, const picojson::value& fields)
+// Returns the last part of url. Used as buddy icon checksum, see update_blist_buddy.
+string get_filename(const char* url)
 {
-    if (!field_is_present<double>(fields, "id")
-            || !field_is_present<string>(fields, "first_name")
-            || !field_is_present<string>(fields, "last_name")) {
-        vkcom_debug_error("Incomplete user information in friends.get or users.get: %s\n",
-                           picojson::value(fields).serialize().data());
-        return;
-    }
-    uint64 user_id = fields.get("id").get<double>();
+    string ret;
+    str_rsplit(url, '/', nullptr, &ret);
+    return ret;
+}
 
-    VkUserInfo& info = get_data(gc).user_infos[user_id];
-    info.real_name = fields.get("first_name").get<string>() + " " + fields.get("last_name").get<string>();
+// Returns true if any of the fields, shown in buddy list, differ. Icon urls are compared
+// by filename only, because the host changes randomly due to load balancing, and last seen time
+// is compared only for offline users, because it is not shown for online ones (and changes
+// on each update for them).
+bool blist_fields_differ(const VkUserInfo& a, const VkUserInfo& b)
+{
+    if (a.real_name != b.real_name || a.online != b.online || a.online_mobile != b.online_mobile)
+        return true;
+    if (get_filename(a.photo_min.data()) != get_filename(b.photo_min.data()))
+        return true;
+    return !b.online && !b.online_mobile && a.last_seen != b.last_seen;
+}
+
+// Fills info from user.
+void set_user_info_fields(PurpleConnection* gc, const VkUserFields& user, VkUserInfo& info)
+{
+    uint64 user_id = user.id;
+    info.real_name = user.first_name + " " + user.last_name;
 
     // This usually means that user has been deleted.
-    if (field_is_present<string>(fields, "deactivated"))
+    if (!user.deactivated.empty())
         return;
 
-    if (field_is_present<string>(fields, "photo_50")) {
-        info.photo_min = fields.get("photo_50").get<string>();
+    if (!user.photo_50.empty()) {
         static const char empty_photo_a[] = "http://vkontakte.ru/images/camera_a.gif";
         static const char empty_photo_b[] = "http://vkontakte.ru/images/camera_b.gif";
         static const char empty_photo_c[] = "https://vk.com/images/camera_c.gif";
-        if (info.photo_min == empty_photo_a || info.photo_min == empty_photo_b
-                || info.photo_min == empty_photo_c)
+        if (user.photo_50 == empty_photo_a || user.photo_50 == empty_photo_b
+                || user.photo_50 == empty_photo_c)
             info.photo_min.clear();
+        else
+            info.photo_min = user.photo_50;
     }
 
-    if (field_is_present<string>(fields, "activity"))
-        info.activity = unescape_html(fields.get("activity").get<string>());
-    else
-        info.activity.clear();
-
-    if (field_is_present<string>(fields, "bdate"))
-        info.bdate = unescape_html(fields.get("bdate").get<string>());
-    else
-        info.bdate.clear();
-
-    info.education = unescape_html(make_education_string(fields));
+    info.activity = unescape_html(user.activity);
+    info.set_details(unescape_html(user.bdate), unescape_html(make_education_string(user)),
+                     unescape_html(user.mobile_phone));
+    info.photo_max = user.photo_max_orig;
 
-    if (field_is_present<string>(fields, "photo_max_orig"))
-        info.photo_max = fields.get("photo_max_orig").get<string>();
-    else
-        info.photo_max.clear();
-
-    if (field_is_present<string>(fields, "mobile_phone"))
-        info.mobile_phone = unescape_html(fields.get("mobile_phone").get<string>());
-    else
-        info.mobile_phone.clear();
-
-    if (field_is_present<string>(fields, "domain"))
-        info.domain = fields.get("domain").get<string>();
-    else
-        info.domain.clear();
+    info.domain = user.domain;
     if (info.domain == user_name_from_id(user_id))
         info.domain.clear();
 
-    bool online = false;
-    if (field_is_present<double>(fields, "online"))
-        online = fields.get("online").get<double>() == 1;
-
-    bool online_mobile = field_is_present<double>(fields, "online_mobile");
-
     // Update presence only for non-friends.
     if (!is_user_friend(gc, user_id)) {
-        info.online = online;
-        info.online_mobile = online_mobile;
+        info.online = user.online;
+        info.online_mobile = user.online_mobile;
     } else {
-        if (info.online != online || info.online_mobile != online_mobile)
+        if (info.online != user.online || info.online_mobile != user.online_mobile)
             vkcom_debug_error("Strange, got different online status for %llu"
                               " in friends.get vs Long Poll: %d, %d vs %d, %d\n",
-                              (unsigned long long)user_id, online, online_mobile,
+                              (unsigned long long)user_id, user.online, user.online_mobile,
                               info.online, info.online_mobile);
     }
 
-    if (field_is_present<picojson::object>(fields, "last_seen"))
-        info.last_seen = fields.get("last_seen").get("time").get<double>();
+    if (user.last_seen.time != 0)
+        info.last_seen = user.last_seen.time;
+}
+
+// Updates user info about user. Marks buddy list node as dirty if anything, shown in buddy list,
+// has changed.
+void update_user_info_from(PurpleConnection* gc, const VkUserFields& user)
+{
+    uint64 user_id = user.id;
+
+    VkData& gc_data = get_data(gc);
+    VkUserInfo* info = map_at_ptr(gc_data.user_infos, user_id);
+    if (!info) {
+        set_user_info_fields(gc, user, gc_data.user_infos[user_id]);
+        gc_data.dirty_blist_user_ids.insert(user_id);
+        return;
+    }
+
+    VkUserInfo old_info = *info;
+    set_user_info_fields(gc, user, *info);
+    if (blist_fields_differ(old_info, *info))
+        gc_data.dirty_blist_user_ids.insert(user_id);
+}
+
+void update_user_info_from(PurpleConnection* gc, const picojson::value& fields)
+{
+    VkUserFields user;
+    if (!json_decode(fields, user)) {
+        vkcom_debug_error("Incomplete user information in friends.get or users.get: %s\n",
+                           fields.serialize().data());
+        return;
+    }
+    update_user_info_from(gc, user);
+}
+
+// Adds ids, present in only one of old_ids and new_ids, to dirty_ids.
+void add_changed_ids(const set<uint64>& old_ids, const set<uint64>& new_ids, set<uint64>& dirty_ids)
+{
+    std::set_symmetric_difference(old_ids.begin(), old_ids.end(), new_ids.begin(), new_ids.end(),
+                                  std::inserter(dirty_ids, dirty_ids.end()));
+}
+
+// Same as above for unordered sets. Looking up each id is faster than sorting both sets.
+void add_changed_ids(const unordered_set<uint64>& old_ids, const unordered_set<uint64>& new_ids,
+                     set<uint64>& dirty_ids)
+{
+    for (uint64 id: old_ids)
+        if (!contains(new_ids, id))
+            dirty_ids.insert(id);
+    for (uint64 id: new_ids)
+        if (!contains(old_ids, id))
+            dirty_ids.insert(id);
 }
 
 // Returns all "id" elements from each item in items.
-set<uint64> get_ids_from_items(const picojson::array& items)
+unordered_set<uint64> get_ids_from_items(const picojson::array& items)
 {
-    set<uint64> ret;
+    unordered_set<uint64> ret;
     for (const picojson::value& it: items) {
         if (!it.is<picojson::object>()) {
             vkcom_debug_error("Strange response: %s\n", it.serialize().data());
-            return set<uint64>();
+            return unordered_set<uint64>();
         }
         if (!field_is_present<double>(it, "id")) {
             vkcom_debug_error("Strange response: %s\n", it.serialize().data());
-            return set<uint64>();
+            return unordered_set<uint64>();
         }
         uint64 id = it.get("id").get<double>();
         ret.insert(id);
@@ -164,7 +200,10 @@ void update_friends_info(PurpleConnection* gc, const SuccessCb& success_cb)
 
         // We must update friend_user_ids before we update user infos, because we do not want
         // to update presence information.
-        get_data(gc).friend_user_ids = get_ids_from_items(items);
+        VkData& gc_data = get_data(gc);
+        unordered_set<uint64> friend_user_ids = get_ids_from_items(items);
+        add_changed_ids(gc_data.friend_user_ids, friend_user_ids, gc_data.dirty_blist_user_ids);
+        gc_data.friend_user_ids = std::move(friend_user_ids);
 
         for (const picojson::value& v: items) {
             if (!v.is<picojson::object>()) {
@@ -179,14 +218,23 @@ void update_friends_info(PurpleConnection* gc, const SuccessCb& success_cb)
     }, [=](const picojson::value&) {
         purple_connection_error_reason(gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
                                        i18n("Unable to retrieve buddy list"));
-    });
+    }, VK_PRIORITY_BACKGROUND);
 }
 
-// We fill in members of this structure and then move them to corresponding VkData fields.
+// The interval between full scans of dialogs in seconds.
+const time_t DIALOGS_FULL_SCAN_INTERVAL = 24 * 60 * 60;
+
+// We fill in members of this structure and then move or merge them to corresponding VkData fields.
 struct GetUsersChatsData
 {
-    set<uint64> user_ids;
+    unordered_set<uint64> user_ids;
     set<uint64> chat_ids;
+    // Chats without participants, i.e. inactive or left by the user.
+    set<uint64> inactive_chat_ids;
+    // If false, the scan stops at the first dialog with message not newer than VkData::dialogs_last_msg_id.
+    bool full_scan;
+    // The newest message id in the scanned dialogs.
+    uint64 last_msg_id;
 };
 typedef shared_ptr<GetUsersChatsData> GetUsersChatsData_ptr;
 
@@ -210,8 +258,11 @@ void get_users_chats_from_dialogs_impl(PurpleConnection* gc, const SuccessCb& su
 
         uint64 count = v.get("count").get<double>();
         const picojson::array& items = v.get("items").get<picojson::array>();
+        // Dialogs are sorted by the last message, so all the following dialogs have already been seen.
+        bool reached_seen = false;
         for (const picojson::value& m: items) {
-            if (!field_is_present<picojson::object>(m, "message")) {
+            if (!field_is_present<picojson::object>(m, "message")
+                    || !field_is_present<double>(m.get("message"), "id")) {
                 vkcom_debug_error("Strange response from messages.getDialogs: %s\n",
                                   v.serialize().data());
                 purple_connection_error_reason(gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
@@ -220,6 +271,12 @@ void get_users_chats_from_dialogs_impl(PurpleConnection* gc, const SuccessCb& su
             }
 
             const picojson::value& message = m.get("message");
+            uint64 msg_id = message.get("id").get<double>();
+            if (!data->full_scan && msg_id <= gc_data.dialogs_last_msg_id) {
+                reached_seen = true;
+                break;
+            }
+            data->last_msg_id = std::max(data->last_msg_id, msg_id);
             if (field_is_present<double>(message, "chat_id")) {
                 if (!field_is_present<string>(message, "title")
                         || !field_is_present<picojson::array>(message, "chat_active")
@@ -232,15 +289,18 @@ void get_users_chats_from_dialogs_impl(PurpleConnection* gc, const SuccessCb& su
                 }
 
                 // If there are no chat participants, chat is inactive, ignore it (messages.getChat
-                // returns an error in these cases).
+                // returns an error in these cases). It is remembered only to remove it from chat_ids
+                // when not doing the full scan.
+                uint64 chat_id = message.get("chat_id").get<double>();
                 const picojson::array& chat_active = message.get("chat_active")
                                                             .get<picojson::array>();
-                if (chat_active.size() == 0)
+                if (chat_active.size() == 0) {
+                    data->inactive_chat_ids.insert(chat_id);
                     continue;
+                }
 
                 // NOTE: we could parse chat title and participants and add entries to chat_infos,
                 // but it's easier to do it via update_chat_infos.
-                uint64 chat_id = message.get("chat_id").get<double>();
                 data->chat_ids.insert(chat_id);
             } else {
                 if (!field_is_present<double>(message, "user_id")) {
@@ -257,23 +317,50 @@ void get_users_chats_from_dialogs_impl(PurpleConnection* gc, const SuccessCb& su
         }
 
         size_t next_offset = offset + items.size();
-        if (next_offset < count) {
+        if (!reached_seen && next_offset < count) {
             get_users_chats_from_dialogs_impl(gc, success_cb, data, next_offset);
         } else {
-            gc_data.chat_ids = std::move(data->chat_ids);
-            gc_data.dialog_user_ids = std::move(data->user_ids);
+            if (data->full_scan) {
+                add_changed_ids(gc_data.chat_ids, data->chat_ids, gc_data.dirty_blist_chat_ids);
+                add_changed_ids(gc_data.dialog_user_ids, data->user_ids, gc_data.dirty_blist_user_ids);
+                gc_data.chat_ids = std::move(data->chat_ids);
+                gc_data.dialog_user_ids = std::move(data->user_ids);
+                gc_data.dialogs_full_scan_time = time(nullptr);
+            } else {
+                vkcom_debug_info("Got %d updated dialogs\n",
+                                 int(data->chat_ids.size() + data->user_ids.size()));
+                for (uint64 chat_id: data->chat_ids)
+                    if (gc_data.chat_ids.insert(chat_id).second)
+                        gc_data.dirty_blist_chat_ids.insert(chat_id);
+                for (uint64 chat_id: data->inactive_chat_ids)
+                    if (gc_data.chat_ids.erase(chat_id) > 0)
+                        gc_data.dirty_blist_chat_ids.insert(chat_id);
+                for (uint64 user_id: data->user_ids)
+                    if (gc_data.dialog_user_ids.insert(user_id).second)
+                        gc_data.dirty_blist_user_ids.insert(user_id);
+            }
+            gc_data.dialogs_last_msg_id = std::max(gc_data.dialogs_last_msg_id, data->last_msg_id);
             success_cb();
         }
     }, [=](const picojson::value&) {
         purple_connection_error_reason(gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
                                        i18n("Unable to retrieve dialogs list"));
-    });
+    }, VK_PRIORITY_BACKGROUND);
 }
 
-// Updates dialog_user_ids and chat_ids.
+// Updates dialog_user_ids and chat_ids. Only the dialogs with messages newer than dialogs_last_msg_id
+// are requested, unless the last full scan has been too long ago. Chats, which have become inactive,
+// are removed when their dialogs are scanned, dialogs, which have been deleted, are removed only upon
+// full scan.
 void get_users_chats_from_dialogs(PurpleConnection* gc, const SuccessCb& success_cb)
 {
+    VkData& gc_data = get_data(gc);
     GetUsersChatsData_ptr data{ new GetUsersChatsData() };
+    data->full_scan = gc_data.dialogs_last_msg_id == 0
+            || time(nullptr) - gc_data.dialogs_full_scan_time >= DIALOGS_FULL_SCAN_INTERVAL;
+    data->last_msg_id = 0;
+    if (data->full_scan)
+        vkcom_debug_info("Scanning all dialogs\n");
     get_users_chats_from_dialogs_impl(gc, success_cb, data, 0);
 }
 
@@ -479,13 +566,6 @@ int fetches_running = 0;
 // Maximum number of concurrently running HTTP requests
 const int MAX_FETCHES_RUNNING = 4;
 
-string get_filename(const char* url)
-{
-    string ret;
-    str_rsplit(url, '/', nullptr, &ret);
-    return ret;
-}
-
 void fetch_next_buddy_icon()
 {
     FetchBuddyIcon fetch = fetch_queue.back();
@@ -668,18 +748,23 @@ void remove_blist_chat(PurpleConnection* gc, PurpleChat* chat, uint64 chat_id)
 
 // Updates buddy list according to friends, user and chat infos. Adds new buddies, removes not required
 // old buddies, updates buddy aliases and avatars. Buddy icons (avatars) are updated asynchronously.
-void update_blist(PurpleConnection* gc)
+// Checks all nodes in the buddy list.
+void update_blist_full(PurpleConnection* gc)
 {
     PurpleAccount* account = purple_connection_get_account(gc);
     VkData& gc_data = get_data(gc);
 
-    // Check all currently known users if they should be added/updated to buddy list.
-    for (const auto& p: gc_data.user_infos) {
-        uint64 user_id = p.first;
+    // Check all currently known users if they should be added/updated to buddy list. Users are
+    // added in the order of ids, so that the buddy list does not depend on the order of user_infos.
+    vector<uint64> user_ids;
+    for (const auto& p: gc_data.user_infos)
+        user_ids.push_back(p.first);
+    std::sort(user_ids.begin(), user_ids.end());
+    for (uint64 user_id: user_ids) {
         if (!user_should_be_in_blist(gc, user_id))
             continue;
 
-        update_blist_buddy(gc, user_id, p.second);
+        update_blist_buddy(gc, user_id, gc_data.user_infos[user_id]);
     }
 
     // Check all current buddies in buddy list if they should be removed.
@@ -698,12 +783,15 @@ void update_blist(PurpleConnection* gc)
     g_slist_free(buddies_list);
 
     // Check all currently known chats if they should be added/updated to buddy list.
-    for (const auto& p: gc_data.chat_infos) {
-        uint64 chat_id = p.first;
+    vector<uint64> chat_ids;
+    for (const auto& p: gc_data.chat_infos)
+        chat_ids.push_back(p.first);
+    std::sort(chat_ids.begin(), chat_ids.end());
+    for (uint64 chat_id: chat_ids) {
         if (!chat_should_be_in_blist(gc, chat_id))
             continue;
 
-        update_blist_chat(gc, chat_id, p.second);
+        update_blist_chat(gc, chat_id, gc_data.chat_infos[chat_id]);
     }
 
     // Check all current chats in buddyd list if they should be removed.
@@ -720,8 +808,62 @@ void update_blist(PurpleConnection* gc)
     }
 }
 
+// Same as update_blist_full, but after the first call in the session checks only the nodes
+// for dirty_blist_user_ids and dirty_blist_chat_ids.
+void update_blist(PurpleConnection* gc)
+{
+    VkData& gc_data = get_data(gc);
+    if (!gc_data.blist_reconciled) {
+        update_blist_full(gc);
+        gc_data.blist_reconciled = true;
+        gc_data.dirty_blist_user_ids.clear();
+        gc_data.dirty_blist_chat_ids.clear();
+        return;
+    }
+
+    vkcom_debug_info("Updating %d buddies and %d chats in buddy list\n",
+                     (int)gc_data.dirty_blist_user_ids.size(), (int)gc_data.dirty_blist_chat_ids.size());
+
+    PurpleAccount* account = purple_connection_get_account(gc);
+    for (uint64 user_id: gc_data.dirty_blist_user_ids) {
+        if (user_should_be_in_blist(gc, user_id)) {
+            VkUserInfo* info = get_user_info(gc, user_id);
+            if (info)
+                update_blist_buddy(gc, user_id, *info);
+        } else {
+            PurpleBuddy* buddy = purple_find_buddy(account, user_name_from_id(user_id).data());
+            if (buddy)
+                remove_blist_buddy(gc, buddy, user_id);
+        }
+    }
+    gc_data.dirty_blist_user_ids.clear();
+
+    for (uint64 chat_id: gc_data.dirty_blist_chat_ids) {
+        if (chat_should_be_in_blist(gc, chat_id)) {
+            VkChatInfo* info = get_chat_info(gc, chat_id);
+            if (info)
+                update_blist_chat(gc, chat_id, *info);
+        } else {
+            PurpleChat* chat = find_purple_chat_by_id(gc, chat_id);
+            if (chat)
+                remove_blist_chat(gc, chat, chat_id);
+        }
+    }
+    gc_data.dirty_blist_chat_ids.clear();
+}
+
 } // namespace
 
+void update_blist_from_snapshot(PurpleConnection* gc)
+{
+    VkData& gc_data = get_data(gc);
+    if (gc_data.user_infos.empty() && gc_data.chat_infos.empty())
+        return;
+
+    vkcom_debug_info("Updating buddy list from info snapshot\n");
+    update_blist(gc);
+}
+
 void update_user_chat_infos(PurpleConnection* gc)
 {
     vkcom_debug_info("Updating full users and chats information\n");
@@ -747,6 +889,8 @@ void update_user_chat_infos(PurpleConnection* gc)
 
                     // Chat titles, participants or buddy aliases could've changed.
                     update_all_open_chat_convs(gc);
+
+                    save_info_snapshot(get_data(gc));
                 });
             });
         });
@@ -767,7 +911,7 @@ void update_friends_presence(PurpleConnection* gc, const SuccessCb& on_update_cb
         }
 
         VkData& gc_data = get_data(gc);
-        set<uint64> friend_user_ids;
+        unordered_set<uint64> friend_user_ids;
 
         const picojson::array& online = result.get("online").get<picojson::array>();
         for (const picojson::value& v: online) {
@@ -873,7 +1017,7 @@ void update_open_conv_presence(PurpleConnection *gc)
             info->online_mobile = online_mobile;
             update_buddy_presence_impl(gc, user_name_from_id(user_id), *info);
         }
-    }, nullptr);
+    }, nullptr, VK_PRIORITY_BACKGROUND);
 }
 
 void update_user_infos(PurpleConnection* gc, const set<uint64>& user_ids, const SuccessCb& on_update_cb)
@@ -920,45 +1064,47 @@ namespace
 {
 
 // Updates one entry in chat_infos. update_blist has the same meaning as in update_chat_infos
-void update_chat_info_from(PurpleConnection* gc, const picojson::value& chat,
+void update_chat_info_from(PurpleConnection* gc, const picojson::value& v,
                            bool update_blist = false)
 {
-    if (!field_is_present<double>(chat, "id") || !field_is_present<string>(chat, "title")
-            || !field_is_present<double>(chat, "admin_id")
-            || !field_is_present<picojson::array>(chat, "users")) {
-        vkcom_debug_error("Strange response from messages.getChat: %s\n", chat.serialize().data());
+    VkChatFields chat;
+    if (!json_decode(v, chat)) {
+        vkcom_debug_error("Strange response from messages.getChat: %s\n", v.serialize().data());
         purple_connection_error_reason(gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
                                        i18n("Unable to retrieve chat info"));
         return;
     }
 
-    uint64 chat_id = chat.get("id").get<double>();
+    uint64 chat_id = chat.id;
     VkData& gc_data = get_data(gc);
+    VkChatInfo* old_info = map_at_ptr(gc_data.chat_infos, chat_id);
+    // Only the title is shown in buddy list.
+    if (!old_info || old_info->title != chat.title)
+        gc_data.dirty_blist_chat_ids.insert(chat_id);
     VkChatInfo& info = gc_data.chat_infos[chat_id];
-    info.admin_id = chat.get("admin_id").get<double>();
-    info.title = chat.get("title").get<string>();
+    info.admin_id = chat.admin_id;
+    info.title = chat.title;
 
     info.participants.clear();
     set<string> already_used_names;
 
-    const picojson::array& users = chat.get("users").get<picojson::array>();
-    for (const picojson::value& u: users) {
-        if (!field_is_present<double>(u, "id")) {
-            vkcom_debug_error("Strange response from messages.getChat: %s\n",
-                              chat.serialize().data());
+    for (const picojson::value* u: chat.users) {
+        VkChatUserFields user;
+        if (!json_decode(*u, user)) {
+            vkcom_debug_error("Strange response from messages.getChat: %s\n", v.serialize().data());
             purple_connection_error_reason(gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
                                            i18n("Unable to retrieve chat info"));
             return;
         }
 
         // E-mail participants are less than zero, let's just ignore them. Also, ignore the user.
-        int64 user_id = u.get("id").get<double>();
+        int64 user_id = user.id;
         if (user_id < 0 || gc_data.self_user_id() == (uint64)user_id)
             continue;
 
         // Do not update already known users.
         if (is_unknown_user(gc, user_id))
-            update_user_info_from(gc, u);
+            update_user_info_from(gc, *u);
 
         string user_name = get_user_display_name(gc, user_id);
         if (contains(already_used_names, user_name))
@@ -22,9 +22,13 @@ using std::set;
 // proper name).
 
 // Updates list of friends, user information, chat information and updates buddy list correspondingly.
-// Updates presence for non-friends.
+// Updates presence for non-friends. Stores the info snapshot afterwards (see vk-infocache.h).
 void update_user_chat_infos(PurpleConnection* gc);
 
+// Updates buddy list according to user and chat infos, loaded from the snapshot, before they are
+// received from Vk.com. Must be called after check_blist_on_login.
+void update_blist_from_snapshot(PurpleConnection* gc);
+
 // Updates presence of friends. Must be used before longpoll starts receiving updates.
 void update_friends_presence(PurpleConnection* gc, const SuccessCb& on_update_cb);
 
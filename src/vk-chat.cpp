@@ -7,43 +7,42 @@
 
 int chat_id_to_conv_id(PurpleConnection* gc, uint64 chat_id)
 {
-    for (const pair<int, uint64>& it: get_data(gc).chat_conv_ids)
-        if (it.second == chat_id)
-            return it.first;
-
-    return 0;
+    return map_at_default(get_data(gc).chat_conv_ids, chat_id, 0);
 }
 
 
 uint64 conv_id_to_chat_id(PurpleConnection* gc, int conv_id)
 {
-    for (const pair<int, uint64>& it: get_data(gc).chat_conv_ids)
-        if (it.first == conv_id)
-            return it.second;
-
-    return 0;
+    return map_at_default(get_data(gc).conv_chat_ids, conv_id, 0);
 }
 
 int add_new_conv_id(PurpleConnection* gc, uint64 chat_id)
 {
-    int conv_id = 1;
     VkData& gc_data = get_data(gc);
-    for (const pair<int, uint64>& it: gc_data.chat_conv_ids)
-        if (it.first >= conv_id)
-            conv_id = it.first + 1;
-
     // We probably do not open more than one conversation per second, so the keys will be exhausted in 2 ** 31 seconds,
     // quite a lot of time.
-    gc_data.chat_conv_ids.emplace_back(conv_id, chat_id);
+    int conv_id = gc_data.next_conv_id++;
+
+    // Each chat can have only one open conversation.
+    int old_conv_id = chat_id_to_conv_id(gc, chat_id);
+    if (old_conv_id != 0)
+        gc_data.conv_chat_ids.erase(old_conv_id);
+
+    gc_data.chat_conv_ids[chat_id] = conv_id;
+    gc_data.conv_chat_ids[conv_id] = chat_id;
     return conv_id;
 }
 
 
 void remove_conv_id(PurpleConnection* gc, int conv_id)
 {
-    erase_if(get_data(gc).chat_conv_ids, [=](const pair<int, uint64>& p) {
-        return p.first == conv_id;
-    });
+    VkData& gc_data = get_data(gc);
+    uint64 chat_id = conv_id_to_chat_id(gc, conv_id);
+    if (chat_id == 0)
+        return;
+
+    gc_data.conv_chat_ids.erase(conv_id);
+    gc_data.chat_conv_ids.erase(chat_id);
 }
 
 namespace
@@ -156,7 +155,8 @@ void update_chat_conv(PurpleConnection* gc, uint64 chat_id)
 
 void update_all_open_chat_convs(PurpleConnection* gc)
 {
-    for (pair<int, uint64> p: get_data(gc).chat_conv_ids)
+    // update_open_chat_conv does not modify conversation ids, so it is safe to iterate.
+    for (const pair<const int, uint64>& p: get_data(gc).conv_chat_ids)
         update_open_chat_conv(gc, p.first);
 }
 
@@ -259,7 +259,7 @@ void add_user_to_chat(PurpleConnection* gc, uint64 chat_id, uint64 user_id)
         update_chat_conv(gc, chat_id);
     }, [=] (const picojson::value&) {
         show_add_user_error(gc, chat_id, user_id);
-    });
+    }, VK_PRIORITY_INTERACTIVE);
 }
 
 
@@ -284,7 +284,7 @@ void remove_user_from_chat(PurpleConnection* gc, uint64 chat_id, uint64 user_id)
         update_chat_conv(gc, chat_id);
     }, [=] (const picojson::value&) {
         show_remove_user_error(gc, chat_id, user_id);
-    });
+    }, VK_PRIORITY_INTERACTIVE);
 }
 
 void set_chat_title(PurpleConnection* gc, uint64 chat_id, const char* title)
@@ -313,6 +313,6 @@ void set_chat_title(PurpleConnection* gc, uint64 chat_id, const char* title)
         update_chat_conv(gc, chat_id);
     }, [=](const picojson::value&) {
         show_set_title_error(gc, chat_id);
-    });
+    }, VK_PRIORITY_INTERACTIVE);
 }
 
@@ -4,8 +4,11 @@
 
 #include "miscutils.h"
 
+#include "vk-api.h"
 #include "vk-auth.h"
 #include "vk-common.h"
+#include "vk-imgstore.h"
+#include "vk-infocache.h"
 
 const char VK_CLIENT_ID[] = "3833170";
 const char VK_PERMISSIONS[] = "friends,photos,audio,video,docs,status,messages,offline";
@@ -13,9 +16,9 @@ const char VK_PERMISSIONS[] = "friends,photos,audio,video,docs,status,messages,o
 namespace {
 
 // Splits the comma-separated string of integers.
-set<uint64> str_split_int(const char* str)
+unordered_set<uint64> str_split_int(const char* str)
 {
-    set<uint64> ret;
+    unordered_set<uint64> ret;
     while (*str) {
         char* next;
         uint64 i = strtoll(str, &next, 10);
@@ -152,11 +155,19 @@ bool check_if_webkit_enabled()
 } // End of anonymous namespace
 
 VkData::VkData(PurpleConnection* gc, const string& email, const string& password)
-    : m_email(email),
+    : dialogs_last_msg_id(0),
+      dialogs_full_scan_time(0),
+      msg_batch_pending(false),
+      blist_reconciled(false),
+      next_conv_id(1),
+      m_email(email),
       m_password(password),
+      m_self_user_id(0),
       m_gc(gc),
       m_closing(false),
-      m_keepalive_pool(nullptr)
+      m_keepalive_pool(nullptr),
+      m_call_queue(new VkCallQueue(gc)),
+      m_image_store(new VkImageStore())
 {
     PurpleAccount* account = purple_connection_get_account(m_gc);
 
@@ -199,6 +210,11 @@ VkData::VkData(PurpleConnection* gc, const string& email, const string& password
     uploaded_docs = uploaded_docs_from_string(str);
 
     m_options.enable_webkit_workarounds = check_if_webkit_enabled();
+
+    // The snapshot is stored per Vk.com user, so we can load it only if we are logging in
+    // with the saved token.
+    if (m_self_user_id != 0)
+        load_info_snapshot(*this);
 }
 
 VkData::~VkData()
@@ -209,16 +225,16 @@ VkData::~VkData()
     purple_account_set_string(account, "access_token", m_access_token.data());
     purple_account_set_string(account, "self_user_id", to_string(m_self_user_id).data());
 
-    string str = str_concat_int(',', m_manually_added_buddies);
+    string str = str_concat_int(',', to_sorted_vector(m_manually_added_buddies));
     purple_account_set_string(account, "manually_added_buddies", str.data());
 
-    str = str_concat_int(',', m_manually_removed_buddies);
+    str = str_concat_int(',', to_sorted_vector(m_manually_removed_buddies));
     purple_account_set_string(account, "manually_removed_buddies", str.data());
 
-    str = str_concat_int(',', m_manually_added_chats);
+    str = str_concat_int(',', to_sorted_vector(m_manually_added_chats));
     purple_account_set_string(account, "manually_added_chats", str.data());
 
-    str = str_concat_int(',', m_manually_removed_chats);
+    str = str_concat_int(',', to_sorted_vector(m_manually_removed_chats));
     purple_account_set_string(account, "manually_removed_chats", str.data());
 
     str = deferred_mark_as_read_to_string(deferred_mark_as_read);
@@ -227,6 +243,9 @@ VkData::~VkData()
     str = uploaded_docs_to_string(uploaded_docs);
     purple_account_set_string(account, "uploaded_docs", str.data());
 
+    if (m_self_user_id != 0)
+        save_info_snapshot(*this);
+
     // g_source_remove calls timeout_destroy_cb, which modifies timeout_ids, so we make a copy before
     // calling g_source_remove. Damned mutability.
     set<unsigned> timeout_ids_copy = timeout_ids;
@@ -235,6 +254,9 @@ VkData::~VkData()
 
     if (m_keepalive_pool)
         purple_http_keepalive_pool_unref(m_keepalive_pool);
+
+    delete m_call_queue;
+    delete m_image_store;
 }
 
 void VkData::authenticate(const SuccessCb& success_cb, const ErrorCb& error_cb)
@@ -353,3 +375,32 @@ void timeout_add(PurpleConnection* gc, unsigned milliseconds, const TimeoutCb& c
 
     gc_data.timeout_ids.insert(data->id);
 }
+
+void idle_add(PurpleConnection* gc, const TimeoutCb& callback)
+{
+    // See timeout_add.
+    struct IdleCbData
+    {
+        TimeoutCb callback;
+        VkData& gc_data;
+        unsigned id;
+    };
+
+    VkData& gc_data = get_data(gc);
+    if (gc_data.is_closing()) {
+        vkcom_debug_error("Programming error: idle_add called during logout\n");
+        return;
+    }
+
+    IdleCbData* data = new IdleCbData({ callback, gc_data, 0 });
+    data->id = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, [](void* user_data) -> gboolean {
+        IdleCbData* param = (IdleCbData*)user_data;
+        return param->callback();
+    }, data, [](void* user_data) {
+        IdleCbData* param = (IdleCbData*)user_data;
+        param->gc_data.timeout_ids.erase(param->id);
+        delete param;
+    });
+
+    gc_data.timeout_ids.insert(data->id);
+}
@@ -4,15 +4,23 @@
 
 #include <map>
 #include <set>
+#include <unordered_map>
+#include <unordered_set>
 
 using std::map;
 using std::pair;
 using std::set;
+using std::unordered_map;
+using std::unordered_set;
 
 #include <connection.h>
 
 #include "common.h"
 #include "contrib/purple/http.h"
+#include "packedstrings.h"
+
+class VkCallQueue;
+class VkImageStore;
 
 // We get connection options and store in this structure on login because we have no way
 // of knowing when the account options have been changed, so we want to prevent potential
@@ -49,6 +57,9 @@ enum VkErrorCodes {
 
 // Information about one user. Used mostly for "Get Info", showing buddy list tooltip etc.
 // Gets periodically updated. See vk.com for documentation on each field.
+//
+// There may be thousands of users, so the fields, which are shown only in "Get Info" dialog,
+// are packed together.
 struct VkUserInfo
 {
     // Pair name+surname. It is saved, because we can set custom alias for the user,
@@ -56,16 +67,36 @@ struct VkUserInfo
     string real_name;
 
     string activity;
-    string bdate;
     string domain;
-    string education;
     time_t last_seen;
-    string mobile_phone;
     // Both online or online_mobile can be set to true at the same time.
     bool online;
     bool online_mobile;
     string photo_min;
     string photo_max;
+
+    // bdate, education and mobile_phone.
+    PackedStrings details;
+
+    string bdate() const
+    {
+        return details.get(0);
+    }
+
+    string education() const
+    {
+        return details.get(1);
+    }
+
+    string mobile_phone() const
+    {
+        return details.get(2);
+    }
+
+    void set_details(const string& bdate, const string& education, const string& mobile_phone)
+    {
+        details = PackedStrings({ bdate, education, mobile_phone });
+    }
 };
 
 // Message, describing one received message. This structure is used for saving received messages
@@ -125,6 +156,9 @@ struct VkBlistNode
 // destroyed upon closing connection.
 typedef function_ptr<bool()> TimeoutCb;
 void timeout_add(PurpleConnection* gc, unsigned milliseconds, const TimeoutCb& callback);
+// Same as timeout_add, but the callback is called when the main loop has no events with higher
+// priority (e.g. network or UI events) to process.
+void idle_add(PurpleConnection* gc, const TimeoutCb& callback);
 
 
 // Data, associated with account. It contains all information, required for connecting and executing
@@ -168,26 +202,33 @@ public:
     // Set of user ids of friends. Updated upon login and on timer by update_users. We generally do
     // not care if this is a bit outdated. This set is updated only upon login and ones per
     // some time interval.
-    set<uint64> friend_user_ids;
+    unordered_set<uint64> friend_user_ids;
 
     // Set of user ids of all buddies (including friends) which the user has dialog with. This set
     // is updated upon login, ones per some time interval and each time we send message (if needed).
-    set<uint64> dialog_user_ids;
+    unordered_set<uint64> dialog_user_ids;
 
     // Map from user identifier to user information. All users from friend_user_ids and dialog_user_ids
     // and all chat participants must be present in this map. Gets updated periodically (once in 15 minutes).
     // Items are only added to this map and NEVER removed.
-    map<uint64, VkUserInfo> user_infos;
+    unordered_map<uint64, VkUserInfo> user_infos;
 
     // Set of ids of all chats user participates with.
     set<uint64> chat_ids;
 
+    // The id of the newest message, seen in messages.getDialogs, and the time of the last full scan
+    // of dialogs. dialog_user_ids and chat_ids are fully rescanned once in a while, otherwise only
+    // the dialogs with newer messages are requested and added (see get_users_chats_from_dialogs).
+    // Both are stored in the info snapshot.
+    uint64 dialogs_last_msg_id;
+    time_t dialogs_full_scan_time;
+
     // Map from chat identifier to chat information. Items are only added to this map and NEVER removed.
-    map<uint64, VkChatInfo> chat_infos;
+    unordered_map<uint64, VkChatInfo> chat_infos;
 
     // Map from group identifier to group information. Items are added on demand and get
     // updated only when info is re-requested and is stale.
-    map<uint64, VkGroupInfo> group_infos;
+    unordered_map<uint64, VkGroupInfo> group_infos;
 
     // There is a problem with processing outgoing messages: either they are sent by us and need no further
     // processing, or they are sent by some other client (or from website) and we need to at least append
@@ -236,12 +277,12 @@ public:
     // These two sets (manually_added_buddies and manually_removed_buddies) are updated when user selects
     // "Add buddy" or "Remove" in the buddy list. They are permanently stored in account properties,
     // loaded in VkData constructor and stored in destructor.
-    const set<uint64>& manually_added_buddies() const
+    const unordered_set<uint64>& manually_added_buddies() const
     {
         return m_manually_added_buddies;
     }
 
-    const set<uint64>& manually_removed_buddies() const
+    const unordered_set<uint64>& manually_removed_buddies() const
     {
         return m_manually_removed_buddies;
     }
@@ -263,12 +304,12 @@ public:
     // These two sets (manually_added_chats and manually_removed_chats) are updated when user selects "Add chat",
     // "Join chat" or "Remove" in the buddy list. They are permanently stored in account properties, loaded
     // in VkData constructor and stored in destructor.
-    const set<uint64>& manually_added_chats() const
+    const unordered_set<uint64>& manually_added_chats() const
     {
         return m_manually_added_chats;
     }
 
-    const set<uint64>& manually_removed_chats() const
+    const unordered_set<uint64>& manually_removed_chats() const
     {
         return m_manually_removed_chats;
     }
@@ -292,6 +333,11 @@ public:
     // we do not lose any read statuses.
     vector<VkReceivedMessage> deferred_mark_as_read;
 
+    // Incoming message ids from Long Poll, which are waiting to be received in one batch (see
+    // receive_messages_batched) and whether the batch is scheduled or being received.
+    vector<uint64> batched_msg_ids;
+    bool msg_batch_pending;
+
     // We check this collection on each file xfer and update it after upload to Vk.com. It gets stored and loaded
     // from settings.
     map<uint64, VkUploadedDocInfo> uploaded_docs;
@@ -301,11 +347,20 @@ public:
     map<uint64, VkBlistNode> blist_buddies;
     map<uint64, VkBlistNode> blist_chats;
 
-    // Unfortunately, Pidgin requires each open chat to have a unique int identifier. This vector stores mapping
-    // from Vk.com chat ids to Pidgin open chat conversation ids. See more in NOTE for chat_name_from_id
-    // in vk-common.cpp.
-    // This container should be changed into bimap.
-    vector<pair<int, uint64>> chat_conv_ids;
+    // Ids of users and chats, whose buddy list nodes may need to be added, updated or removed.
+    // Filled when user or chat infos, friends, dialogs or chats change, cleared in update_blist.
+    set<uint64> dirty_blist_user_ids;
+    set<uint64> dirty_blist_chat_ids;
+    // Set after the first update_blist in the session, which checks all buddy list nodes.
+    bool blist_reconciled;
+
+    // Unfortunately, Pidgin requires each open chat to have a unique int identifier. These two maps store
+    // mapping between Vk.com chat ids and Pidgin open chat conversation ids in both directions, they are
+    // modified only in add_new_conv_id and remove_conv_id. Conversation ids are allocated sequentially
+    // starting from next_conv_id. See more in NOTE for chat_name_from_id in vk-common.cpp.
+    unordered_map<uint64, int> chat_conv_ids;
+    unordered_map<int, uint64> conv_chat_ids;
+    int next_conv_id;
 
     // If true, connection is in "closing" state. This is set in vk_close and is used in longpoll
     // callback to differentiate the case of network timeout/silent connection dropping and connection
@@ -331,6 +386,18 @@ public:
     // upon closing the connection.
     PurpleHttpKeepalivePool* get_keepalive_pool();
 
+    // Per-connection queue of API calls, see vk_call_api.
+    VkCallQueue& call_queue()
+    {
+        return *m_call_queue;
+    }
+
+    // Per-connection store of images, shown in conversations, see VkImageStore.
+    VkImageStore& image_store()
+    {
+        return *m_image_store;
+    }
+
 private:
     string m_email;
     string m_password;
@@ -339,13 +406,13 @@ private:
 
     VkOptions m_options;
 
-    set<uint64> m_sent_msg_ids;
+    unordered_set<uint64> m_sent_msg_ids;
     steady_time_point m_last_msg_sent_time;
 
-    set<uint64> m_manually_added_buddies;
-    set<uint64> m_manually_removed_buddies;
-    set<uint64> m_manually_added_chats;
-    set<uint64> m_manually_removed_chats;
+    unordered_set<uint64> m_manually_added_buddies;
+    unordered_set<uint64> m_manually_removed_buddies;
+    unordered_set<uint64> m_manually_added_chats;
+    unordered_set<uint64> m_manually_removed_chats;
 
     PurpleConnection* m_gc;
     bool m_closing;
@@ -354,7 +421,11 @@ private:
 
     PurpleHttpKeepalivePool* m_keepalive_pool;
 
+    VkCallQueue* m_call_queue;
+    VkImageStore* m_image_store;
+
     friend void timeout_add(PurpleConnection* gc, unsigned milliseconds, const TimeoutCb& callback);
+    friend void idle_add(PurpleConnection* gc, const TimeoutCb& callback);
 };
 
 inline VkData& get_data(PurpleConnection* gc)
@@ -1,3 +1,5 @@
+#include <glib/gstdio.h>
+
 #include "miscutils.h"
 #include "vk-api.h"
 #include "vk-common.h"
@@ -25,8 +27,8 @@ PurpleXfer* new_xfer(PurpleConnection* gc, uint64 user_id)
     PurpleXfer* xfer = purple_xfer_new(purple_connection_get_account(gc), PURPLE_XFER_SEND, name.data());
 
     xfer->data = new uint64(user_id);
-    // NOTE: We are lazy and do not implement "proper" sending file in buffer. We load the
-    // contents of the file in xfer_start. A proper way would be implementing xfer write_fnc.
+    // NOTE: We do not implement xfer write_fnc, the file is read in chunks by upload_doc_for_im
+    // while uploading.
     purple_xfer_set_init_fnc(xfer, xfer_init);
 
     return xfer;
@@ -35,15 +37,6 @@ PurpleXfer* new_xfer(PurpleConnection* gc, uint64 user_id)
 namespace
 {
 
-// Returns string, containing md5sum of contents.
-string compute_md5sum(const char* contents, gsize size)
-{
-    char* str = g_compute_checksum_for_data(G_CHECKSUM_MD5, (const unsigned char*)contents, size);
-    string ret = str;
-    g_free(str);
-    return ret;
-}
-
 // Helper function, updating xfer progress and cancelling it if user has pressed cancel.
 void xfer_upload_progress(PurpleXfer* xfer, PurpleHttpConnection* http_conn, int processed, int total)
 {
@@ -109,18 +102,18 @@ bool send_doc(PurpleConnection* gc, uint64 user_id, const VkUploadedDocInfo& doc
 }
 
 // Destructor for xfer.
-void xfer_fini(PurpleXfer* xfer, char* contents)
+void xfer_fini(PurpleXfer* xfer)
 {
     delete (uint64*)xfer->data;
     purple_xfer_unref(xfer);
-
-    g_free(contents);
 }
 
 // Uploads document and sends it.
-void start_uploading_doc(PurpleConnection* gc, PurpleXfer* xfer, const VkUploadedDocInfo& doc, char* contents)
+void start_uploading_doc(PurpleConnection* gc, PurpleXfer* xfer, const VkUploadedDocInfo& doc,
+                         const string& boundary)
 {
-    upload_doc_for_im(gc, doc.filename.data(), contents, doc.size, [=](const picojson::value& v) {
+    const char* filepath = purple_xfer_get_local_filename(xfer);
+    upload_doc_for_im(gc, doc.filename.data(), filepath, doc.size, boundary, [=](const picojson::value& v) {
         uint64 user_id = *(uint64*)xfer->data;
 
         if (purple_xfer_get_status(xfer) == PURPLE_XFER_STATUS_CANCEL_LOCAL) {
@@ -133,13 +126,13 @@ void start_uploading_doc(PurpleConnection* gc, PurpleXfer* xfer, const VkUploade
                 purple_xfer_cancel_remote(xfer);
             }
         }
-        xfer_fini(xfer, contents);
+        xfer_fini(xfer);
     }, [=] {
         if (purple_xfer_get_status(xfer) == PURPLE_XFER_STATUS_CANCEL_LOCAL)
             vkcom_debug_info("Transfer has been cancelled by user\n");
         else
             purple_xfer_cancel_remote(xfer);
-        xfer_fini(xfer, contents);
+        xfer_fini(xfer);
     }, [=](PurpleHttpConnection* http_conn, int processed, int total) {
         xfer_upload_progress(xfer, http_conn, processed, total);
     });
@@ -200,35 +193,53 @@ void clean_nonexisting_docs(PurpleConnection* gc, const SuccessCb& success_cb)
     });
 }
 
-// Either finds matching doc, checks that it exists and sends it or uploads new doc.
-void find_or_upload_doc(PurpleConnection* gc, PurpleXfer* xfer, const VkUploadedDocInfo& doc, char* contents)
+// Either finds matching doc in uploaded_docs and sends it or uploads new doc. Must be called
+// after clean_nonexisting_docs.
+void find_or_upload_doc(PurpleConnection* gc, PurpleXfer* xfer, const VkUploadedDocInfo& doc,
+                        const string& boundary)
 {
-    // We have a concurrency problem here: if the document is uploaded and added during the
-    // call to clean_nonexisting_docs (between calling docs.get and parsing the results) it will
-    // not be added to uploaded_docs. It is a minor problem (the document will be reuploaded
-    // the next time it is added) and all this "check if doc still exists" approach is
-    // non-concurrency-proof already.
-    clean_nonexisting_docs(gc, [=] {
-        for (const pair<uint64, VkUploadedDocInfo>& p: get_data(gc).uploaded_docs) {
-            uint64 doc_id = p.first;
-            const VkUploadedDocInfo& updoc = p.second;
-            if (updoc.filename == doc.filename && updoc.size == doc.size
-                    && updoc.md5sum == doc.md5sum) {
-                vkcom_debug_info("Filename, size and md5sum matches the doc %llu, resending it.\n",
-                                 (unsigned long long)doc_id);
+    for (const pair<uint64, VkUploadedDocInfo>& p: get_data(gc).uploaded_docs) {
+        uint64 doc_id = p.first;
+        const VkUploadedDocInfo& updoc = p.second;
+        if (updoc.filename == doc.filename && updoc.size == doc.size
+                && updoc.md5sum == doc.md5sum) {
+            vkcom_debug_info("Filename, size and md5sum matches the doc %llu, resending it.\n",
+                             (unsigned long long)doc_id);
+
+            uint64 user_id = *(uint64*)xfer->data;
+            send_doc_url(gc, user_id, updoc.url, true);
+
+            purple_xfer_set_completed(xfer, true);
+            purple_xfer_end(xfer);
+            xfer_fini(xfer);
+            return;
+        }
+    }
 
-                uint64 user_id = *(uint64*)xfer->data;
-                send_doc_url(gc, user_id, updoc.url, true);
+    start_uploading_doc(gc, xfer, doc, boundary);
+}
 
-                purple_xfer_set_completed(xfer, true);
-                purple_xfer_end(xfer);
-                xfer_fini(xfer, contents);
-                return;
-            }
-        }
+// State of xfer before the upload: the file is scanned while stale uploaded docs are being removed.
+struct XferPrepare
+{
+    VkUploadedDocInfo doc;
+    string boundary;
+    // The number of steps (scan and clean_nonexisting_docs), which have not finished yet.
+    int pending_steps;
+    // Set if the scan has failed. The xfer is cancelled and finished then.
+    bool failed;
+};
+typedef shared_ptr<XferPrepare> XferPrepare_ptr;
+
+// Called after each of the steps finishes. Proceeds with the xfer after the last one.
+void xfer_prepare_step_finished(PurpleConnection* gc, PurpleXfer* xfer, const XferPrepare_ptr& prepare)
+{
+    prepare->pending_steps--;
+    // The xfer has already been finished if the scan has failed.
+    if (prepare->pending_steps > 0 || prepare->failed)
+        return;
 
-        start_uploading_doc(gc, xfer, doc, contents);
-    });
+    find_or_upload_doc(gc, xfer, prepare->doc, prepare->boundary);
 }
 
 void xfer_init(PurpleXfer* xfer)
@@ -244,35 +255,52 @@ void xfer_init(PurpleXfer* xfer)
     const char* filepath = purple_xfer_get_local_filename(xfer);
     const char* filename = purple_xfer_get_filename(xfer);
 
-    vkcom_debug_info("Reading file contents\n");
-
-    // Load all contents in memory.
-    char* contents;
-    gsize size;
-    if (!g_file_get_contents(filepath, &contents, &size, nullptr)) {
+    GStatBuf st;
+    if (g_stat(filepath, &st) != 0) {
         vkcom_debug_error("Unable to read file %s\n", filepath);
 
         purple_xfer_cancel_local(xfer);
-        xfer_fini(xfer, nullptr);
+        xfer_fini(xfer);
         return;
     }
 
-    if (size > (gsize)MAX_UPLOAD_SIZE) {
+    if (st.st_size > MAX_UPLOAD_SIZE) {
         vkcom_debug_info("Unable to upload files larger than %d\n", MAX_UPLOAD_SIZE);
 
         purple_xfer_cancel_remote(xfer);
-        xfer_fini(xfer, nullptr);
+        xfer_fini(xfer);
         return;
     }
 
-    vkcom_debug_info("Successfully read file contents\n");
-
-    VkUploadedDocInfo doc;
-    doc.filename = filename;
-    doc.size = size;
-    doc.md5sum = compute_md5sum(contents, size);
+    XferPrepare_ptr prepare{ new XferPrepare() };
+    prepare->doc.filename = filename;
+    prepare->doc.size = st.st_size;
+    prepare->pending_steps = 2;
+    prepare->failed = false;
+
+    // md5sum is required to find the doc in uploaded_docs and boundary is required for the upload,
+    // so the file is read once for both while docs.get is running.
+    vkcom_debug_info("Scanning file contents\n");
+    scan_doc_for_upload(gc, filepath, prepare->doc.size, [=](const string& md5sum, const string& boundary) {
+        prepare->doc.md5sum = md5sum;
+        prepare->boundary = boundary;
+        xfer_prepare_step_finished(gc, xfer, prepare);
+    }, [=] {
+        // The xfer is finished right away, because this may be called when the connection
+        // is being closed and clean_nonexisting_docs will never finish.
+        prepare->failed = true;
+        purple_xfer_cancel_local(xfer);
+        xfer_fini(xfer);
+    });
 
-    find_or_upload_doc(gc, xfer, doc, contents);
+    // We have a concurrency problem here: if the document is uploaded and added during the
+    // call to clean_nonexisting_docs (between calling docs.get and parsing the results) it will
+    // not be added to uploaded_docs. It is a minor problem (the document will be reuploaded
+    // the next time it is added) and all this "check if doc still exists" approach is
+    // non-concurrency-proof already.
+    clean_nonexisting_docs(gc, [=] {
+        xfer_prepare_step_finished(gc, xfer, prepare);
+    });
 }
 
 } // End of anonymous namespace
@@ -0,0 +1,103 @@
+#include <imgstore.h>
+
+#include "vk-imgstore.h"
+
+VkImageStore::~VkImageStore()
+{
+    // All references, including the ones held for conversations, which remain open, are dropped
+    // when the connection is destroyed.
+    for (const std::pair<const int, Image>& p: m_images)
+        for (int i = 0; i < p.second.refcount; i++)
+            purple_imgstore_unref_by_id(p.first);
+}
+
+int VkImageStore::find(const string& url)
+{
+    int* img_id = map_at_ptr(m_ids_by_url, url);
+    if (!img_id)
+        return 0;
+
+    ref(*img_id);
+    return *img_id;
+}
+
+int VkImageStore::add(const string& url, char* img_data, size_t size)
+{
+    char* hash_str = g_compute_checksum_for_data(G_CHECKSUM_MD5, (const guchar*)img_data, size);
+    string hash = hash_str;
+    g_free(hash_str);
+
+    int* existing_id = map_at_ptr(m_ids_by_hash, hash);
+    if (existing_id) {
+        g_free(img_data);
+        int img_id = *existing_id;
+        ref(img_id);
+        if (m_ids_by_url.insert(std::make_pair(url, img_id)).second)
+            m_images[img_id].urls.push_back(url);
+        return img_id;
+    }
+
+    int img_id = purple_imgstore_add_with_id(img_data, size, nullptr);
+    m_images[img_id] = { { url }, hash, 1 };
+    m_ids_by_url[url] = img_id;
+    m_ids_by_hash[hash] = img_id;
+    return img_id;
+}
+
+void VkImageStore::release(const vector<int>& img_ids)
+{
+    for (int img_id: img_ids)
+        unref(img_id);
+}
+
+void VkImageStore::ref_conv_images(const string& conv_name, const vector<int>& img_ids)
+{
+    if (img_ids.empty())
+        return;
+
+    std::set<int>& conv_img_ids = m_conv_img_ids[conv_name];
+    for (int img_id: img_ids)
+        if (conv_img_ids.insert(img_id).second)
+            ref(img_id);
+}
+
+void VkImageStore::release_conv_images(const string& conv_name)
+{
+    std::set<int>* conv_img_ids = map_at_ptr(m_conv_img_ids, conv_name);
+    if (!conv_img_ids)
+        return;
+
+    for (int img_id: *conv_img_ids)
+        unref(img_id);
+    m_conv_img_ids.erase(conv_name);
+}
+
+void VkImageStore::ref(int img_id)
+{
+    Image* image = map_at_ptr(m_images, img_id);
+    if (!image) {
+        vkcom_debug_error("Trying to reference unknown image %d\n", img_id);
+        return;
+    }
+
+    image->refcount++;
+    purple_imgstore_ref_by_id(img_id);
+}
+
+void VkImageStore::unref(int img_id)
+{
+    Image* image = map_at_ptr(m_images, img_id);
+    if (!image) {
+        vkcom_debug_error("Trying to release unknown image %d\n", img_id);
+        return;
+    }
+
+    image->refcount--;
+    if (image->refcount == 0) {
+        for (const string& url: image->urls)
+            m_ids_by_url.erase(url);
+        m_ids_by_hash.erase(image->hash);
+        m_images.erase(img_id);
+    }
+    purple_imgstore_unref_by_id(img_id);
+}
@@ -0,0 +1,62 @@
+// Deduplication of images, added to libpurple imgstore.
+
+#pragma once
+
+#include <map>
+#include <set>
+
+#include "common.h"
+
+// Keeps images (thumbnails, stickers), shown in conversations, in libpurple imgstore, so that
+// the same image, received several times, is stored only once. Images are found either by URL
+// or by MD5 of the contents.
+//
+// Each image is referenced by the conversations, which have displayed it, and by the messages,
+// which are being received (see add and release). The image is removed from imgstore when
+// the last reference is released, usually when the last conversation referencing it is closed.
+//
+// Each connection has its own store, see VkData::image_store().
+class VkImageStore
+{
+public:
+    VkImageStore() = default;
+    ~VkImageStore();
+
+    DISABLE_COPYING(VkImageStore)
+
+    // Returns imgstore id of the image, downloaded from url, and adds reference to it. Returns 0
+    // if the image has not been added.
+    int find(const string& url);
+    // Adds image, downloaded from url (g_malloc'ed memory, which is owned by the store afterwards),
+    // and returns imgstore id with reference added. If identical image has already been added,
+    // img_data is freed and the id of the existing image is returned.
+    int add(const string& url, char* img_data, size_t size);
+    // Releases references, added by find or add.
+    void release(const vector<int>& img_ids);
+
+    // Adds references to images from conv_name (as returned by user_name_from_id or
+    // chat_name_from_id). Each conversation holds one reference to each image.
+    void ref_conv_images(const string& conv_name, const vector<int>& img_ids);
+    // Releases all images, referenced by conv_name. Must be called when conversation is closed.
+    void release_conv_images(const string& conv_name);
+
+private:
+    struct Image
+    {
+        // All urls, from which this image has been downloaded.
+        vector<string> urls;
+        string hash;
+        // The number of references, each reference corresponds to imgstore reference.
+        int refcount;
+    };
+
+    std::map<int, Image> m_images;
+    std::map<string, int> m_ids_by_url;
+    std::map<string, int> m_ids_by_hash;
+    std::map<string, std::set<int>> m_conv_img_ids;
+
+    // Adds reference to the image.
+    void ref(int img_id);
+    // Releases reference to the image and removes the image if it was the last one.
+    void unref(int img_id);
+};
@@ -0,0 +1,325 @@
+#include <cstring>
+
+#include <glib/gstdio.h>
+#include <util.h>
+
+#include "vk-common.h"
+
+#include "vk-infocache.h"
+
+namespace
+{
+
+// The snapshot starts with magic and format version. All integers are stored as LEB128 varints,
+// strings are stored as length followed by bytes, collections are stored as the number
+// of elements followed by elements.
+const char SNAPSHOT_MAGIC[] = "VKIS";
+const size_t SNAPSHOT_MAGIC_LEN = 4;
+const uint64 SNAPSHOT_VERSION = 2;
+
+class SnapshotWriter
+{
+public:
+    void put_uint(uint64 v);
+    void put_string(const string& str);
+    // Ids are written in ascending order, so that the snapshot does not depend on the order
+    // of unordered sets.
+    template<typename Set>
+    void put_ids(const Set& ids)
+    {
+        put_uint(ids.size());
+        for (uint64 id: to_sorted_vector(ids))
+            put_uint(id);
+    }
+
+    const string& data() const
+    {
+        return m_data;
+    }
+
+private:
+    string m_data;
+};
+
+void SnapshotWriter::put_uint(uint64 v)
+{
+    while (v >= 0x80) {
+        m_data += char((v & 0x7F) | 0x80);
+        v >>= 7;
+    }
+    m_data += char(v);
+}
+
+void SnapshotWriter::put_string(const string& str)
+{
+    put_uint(str.size());
+    m_data += str;
+}
+
+// All get_ methods return false if the snapshot is truncated or malformed.
+class SnapshotReader
+{
+public:
+    SnapshotReader(const char* data, size_t size);
+
+    bool get_uint(uint64* v);
+    bool get_string(string* str);
+    template<typename Set>
+    bool get_ids(Set* ids)
+    {
+        uint64 count;
+        if (!get_uint(&count))
+            return false;
+        for (uint64 i = 0; i < count; i++) {
+            uint64 id;
+            if (!get_uint(&id))
+                return false;
+            ids->insert(id);
+        }
+        return true;
+    }
+
+    bool at_end() const
+    {
+        return m_cur == m_end;
+    }
+
+private:
+    const char* m_cur;
+    const char* m_end;
+};
+
+SnapshotReader::SnapshotReader(const char* data, size_t size)
+    : m_cur(data),
+      m_end(data + size)
+{
+}
+
+bool SnapshotReader::get_uint(uint64* v)
+{
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (m_cur == m_end)
+            return false;
+        unsigned char c = *m_cur++;
+        *v |= uint64(c & 0x7F) << shift;
+        if (!(c & 0x80))
+            return true;
+    }
+    return false;
+}
+
+bool SnapshotReader::get_string(string* str)
+{
+    uint64 len;
+    if (!get_uint(&len) || len > uint64(m_end - m_cur))
+        return false;
+    str->assign(m_cur, len);
+    m_cur += len;
+    return true;
+}
+
+void write_user_info(SnapshotWriter& writer, const VkUserInfo& info)
+{
+    writer.put_string(info.real_name);
+    writer.put_string(info.activity);
+    writer.put_string(info.bdate());
+    writer.put_string(info.domain);
+    writer.put_string(info.education());
+    writer.put_uint(info.last_seen);
+    writer.put_string(info.mobile_phone());
+    writer.put_string(info.photo_min);
+    writer.put_string(info.photo_max);
+}
+
+bool read_user_info(SnapshotReader& reader, VkUserInfo* info)
+{
+    uint64 last_seen;
+    string bdate;
+    string education;
+    string mobile_phone;
+    if (!reader.get_string(&info->real_name) || !reader.get_string(&info->activity)
+            || !reader.get_string(&bdate) || !reader.get_string(&info->domain)
+            || !reader.get_string(&education) || !reader.get_uint(&last_seen)
+            || !reader.get_string(&mobile_phone) || !reader.get_string(&info->photo_min)
+            || !reader.get_string(&info->photo_max))
+        return false;
+    info->set_details(bdate, education, mobile_phone);
+    info->last_seen = last_seen;
+    info->online = false;
+    info->online_mobile = false;
+    return true;
+}
+
+void write_chat_info(SnapshotWriter& writer, const VkChatInfo& info)
+{
+    writer.put_uint(info.admin_id);
+    writer.put_string(info.title);
+    writer.put_uint(info.participants.size());
+    for (const pair<uint64, string>& p: info.participants) {
+        writer.put_uint(p.first);
+        writer.put_string(p.second);
+    }
+}
+
+bool read_chat_info(SnapshotReader& reader, VkChatInfo* info)
+{
+    uint64 count;
+    if (!reader.get_uint(&info->admin_id) || !reader.get_string(&info->title)
+            || !reader.get_uint(&count))
+        return false;
+    for (uint64 i = 0; i < count; i++) {
+        uint64 user_id;
+        string name;
+        if (!reader.get_uint(&user_id) || !reader.get_string(&name))
+            return false;
+        info->participants[user_id] = std::move(name);
+    }
+    return true;
+}
+
+void write_group_info(SnapshotWriter& writer, const VkGroupInfo& info)
+{
+    writer.put_string(info.name);
+    writer.put_string(info.type);
+    writer.put_string(info.screen_name);
+}
+
+bool read_group_info(SnapshotReader& reader, VkGroupInfo* info)
+{
+    if (!reader.get_string(&info->name) || !reader.get_string(&info->type)
+            || !reader.get_string(&info->screen_name))
+        return false;
+    // Loaded group infos are considered stale and get re-requested when needed.
+    info->last_updated = steady_time_point();
+    return true;
+}
+
+// Reads map of infos, calling read_info for each value.
+template<typename Map, typename ReadInfo>
+bool read_infos(SnapshotReader& reader, Map* infos, ReadInfo read_info)
+{
+    uint64 count;
+    if (!reader.get_uint(&count))
+        return false;
+    for (uint64 i = 0; i < count; i++) {
+        uint64 id;
+        if (!reader.get_uint(&id))
+            return false;
+        typename Map::mapped_type& info = (*infos)[id];
+        if (!read_info(reader, &info))
+            return false;
+    }
+    return true;
+}
+
+// Writes map of infos in ascending order of ids, calling write_info for each value.
+template<typename Map, typename WriteInfo>
+void write_infos(SnapshotWriter& writer, const Map& infos, WriteInfo write_info)
+{
+    vector<uint64> ids;
+    ids.reserve(infos.size());
+    for (const auto& p: infos)
+        ids.push_back(p.first);
+    std::sort(ids.begin(), ids.end());
+
+    writer.put_uint(ids.size());
+    for (uint64 id: ids) {
+        writer.put_uint(id);
+        write_info(writer, infos.at(id));
+    }
+}
+
+// Returns path to the snapshot file, creating the directory if needed.
+string get_snapshot_path(uint64 self_user_id)
+{
+    char* dir = g_build_filename(purple_user_dir(), "vkcom", nullptr);
+    g_mkdir_with_parents(dir, 0700);
+    string file_name = str_format("infos-%llu", (unsigned long long)self_user_id);
+    char* path = g_build_filename(dir, file_name.data(), nullptr);
+    string ret = path;
+    g_free(path);
+    g_free(dir);
+    return ret;
+}
+
+} // End of anonymous namespace
+
+bool load_info_snapshot(VkData& gc_data)
+{
+    string path = get_snapshot_path(gc_data.self_user_id());
+    char* contents;
+    size_t size;
+    if (!g_file_get_contents(path.data(), &contents, &size, nullptr))
+        return false;
+
+    // Everything is read into temporaries first, so that broken snapshot does not leave
+    // gc_data partially filled.
+    unordered_set<uint64> friend_user_ids;
+    unordered_set<uint64> dialog_user_ids;
+    set<uint64> chat_ids;
+    unordered_map<uint64, VkUserInfo> user_infos;
+    unordered_map<uint64, VkChatInfo> chat_infos;
+    unordered_map<uint64, VkGroupInfo> group_infos;
+    uint64 dialogs_last_msg_id;
+    uint64 dialogs_full_scan_time;
+
+    bool ok = false;
+    if (size >= SNAPSHOT_MAGIC_LEN && memcmp(contents, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) == 0) {
+        SnapshotReader reader(contents + SNAPSHOT_MAGIC_LEN, size - SNAPSHOT_MAGIC_LEN);
+        uint64 version;
+        ok = reader.get_uint(&version) && version == SNAPSHOT_VERSION
+                && reader.get_ids(&friend_user_ids) && reader.get_ids(&dialog_user_ids)
+                && reader.get_ids(&chat_ids)
+                && reader.get_uint(&dialogs_last_msg_id) && reader.get_uint(&dialogs_full_scan_time)
+                && read_infos(reader, &user_infos, read_user_info)
+                && read_infos(reader, &chat_infos, read_chat_info)
+                && read_infos(reader, &group_infos, read_group_info)
+                && reader.at_end();
+    }
+    g_free(contents);
+
+    if (!ok) {
+        vkcom_debug_error("Ignoring broken or outdated info snapshot %s\n", path.data());
+        return false;
+    }
+
+    gc_data.friend_user_ids = std::move(friend_user_ids);
+    gc_data.dialog_user_ids = std::move(dialog_user_ids);
+    gc_data.chat_ids = std::move(chat_ids);
+    gc_data.dialogs_last_msg_id = dialogs_last_msg_id;
+    gc_data.dialogs_full_scan_time = dialogs_full_scan_time;
+    gc_data.user_infos = std::move(user_infos);
+    gc_data.chat_infos = std::move(chat_infos);
+    gc_data.group_infos = std::move(group_infos);
+
+    vkcom_debug_info("Loaded info snapshot: %d users, %d chats, %d groups\n",
+                     (int)gc_data.user_infos.size(), (int)gc_data.chat_infos.size(),
+                     (int)gc_data.group_infos.size());
+    return true;
+}
+
+void save_info_snapshot(const VkData& gc_data)
+{
+    SnapshotWriter writer;
+    writer.put_uint(SNAPSHOT_VERSION);
+    writer.put_ids(gc_data.friend_user_ids);
+    writer.put_ids(gc_data.dialog_user_ids);
+    writer.put_ids(gc_data.chat_ids);
+    writer.put_uint(gc_data.dialogs_last_msg_id);
+    writer.put_uint(gc_data.dialogs_full_scan_time);
+    write_infos(writer, gc_data.user_infos, write_user_info);
+    write_infos(writer, gc_data.chat_infos, write_chat_info);
+    write_infos(writer, gc_data.group_infos, write_group_info);
+
+    string contents = string(SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) + writer.data();
+    string path = get_snapshot_path(gc_data.self_user_id());
+    if (!g_file_set_contents(path.data(), contents.data(), contents.size(), nullptr)) {
+        vkcom_debug_error("Unable to save info snapshot %s\n", path.data());
+        return;
+    }
+    // The snapshot contains names, phone numbers and last seen times of all friends, so it must
+    // be readable only by the owner, like accounts.xml.
+    if (g_chmod(path.data(), 0600) != 0)
+        vkcom_debug_error("Unable to set permissions of info snapshot %s\n", path.data());
+}
@@ -0,0 +1,22 @@
+// Persistent snapshot of user, chat and group information.
+
+#pragma once
+
+#include "common.h"
+
+class VkData;
+
+// The snapshot contains friend_user_ids, dialog_user_ids, chat_ids, dialog scan state, user_infos,
+// chat_infos and group_infos from VkData and is stored in a binary file in purple user dir, one file per
+// Vk.com user. Presence information is not stored, users are loaded as offline.
+//
+// The snapshot is loaded in VkData constructor, so that the buddy list can be updated before
+// any information is received from Vk.com, and stored in VkData destructor and after each
+// periodic update of user and chat infos.
+
+// Loads the snapshot for gc_data.self_user_id() into gc_data. Returns false if there is no valid
+// snapshot, gc_data is not modified in this case.
+bool load_info_snapshot(VkData& gc_data);
+
+// Stores the snapshot for gc_data.self_user_id().
+void save_info_snapshot(const VkData& gc_data);
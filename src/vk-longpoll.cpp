@@ -1,9 +1,11 @@
 #include "common.h"
 
 #include <ctime>
+#include <deque>
 #include <server.h>
 
 #include "httputils.h"
+#include "jsonschema.h"
 #include "miscutils.h"
 #include "vk-api.h"
 #include "vk-buddy.h"
@@ -18,6 +20,14 @@
 namespace
 {
 
+// Long Poll responses are the most frequently parsed ones, so they are parsed with arena-allocated
+// jsondom, unless disabled at configure time.
+#ifdef USE_ARENA_JSON
+namespace json = jsondom;
+#else
+namespace json = picojson;
+#endif
+
 // NOTE: Re last_msg_id: last_msg_id is the id of the last message we have processed (either sent or received).
 // It is permanently stored along with account information and is equal zero upon creation of account.
 //
@@ -73,11 +83,62 @@ struct LastMsg
     const uint64 ignored;
 };
 
+// Parsed Long Poll response. It is kept alive until all its updates have been processed.
+struct LongPollResponse
+{
+#ifdef USE_ARENA_JSON
+    // The document references the text.
+    string text;
+    jsondom::document doc;
+#else
+    picojson::value root;
+#endif
+};
+typedef shared_ptr<LongPollResponse> LongPollResponse_ptr;
+
+// One update, waiting in the queue to be processed.
+struct QueuedUpdate
+{
+    LongPollResponse_ptr response;
+    const json::value* update;
+    // When the response has been received. Used for logging the delay until the update is processed.
+    steady_time_point received;
+};
+
+// Long Poll is a pipeline: the next request is sent as soon as the response has been parsed
+// and updates are processed in the idle callback. That way slow processing of a burst of updates
+// does not delay receiving the following ones. The state is shared between all the callbacks.
+struct LongPollData
+{
+    PurpleConnection* gc;
+    string server;
+    string key;
+    // Timestamp for the next request.
+    uint64 ts;
+    LastMsg last_msg;
+
+    std::deque<QueuedUpdate> updates;
+    bool processing_scheduled;
+    // True if the next request has been postponed until updates are processed.
+    bool request_postponed;
+};
+typedef shared_ptr<LongPollData> LongPollData_ptr;
+
+// The maximum number of updates in the queue. When the queue is full, the next request is
+// postponed until some of the updates are processed.
+const size_t MAX_QUEUED_UPDATES = 1000;
+// The number of updates processed in one idle callback, so that UI is not blocked.
+const size_t UPDATES_PER_IDLE = 50;
+
 // Connects to given Long Poll server and starts reading events from it. last_msg_id is explained
 // earlier, last_msg_id_from_start is a bit more complex. There are cases when request_long_poll
 // will receive messages, which have already been processed:
-void request_long_poll(PurpleConnection* gc, const string& server, const string& key, uint64 ts,
-                       LastMsg last_msg);
+void request_long_poll(const LongPollData_ptr& data);
+// Adds updates from the response to the queue and schedules processing.
+void queue_updates(const LongPollData_ptr& data, const LongPollResponse_ptr& response,
+                   const json::value& root, steady_time_point received);
+// Processes at most max_count queued updates. Returns true if there are updates left.
+bool process_queued_updates(const LongPollData_ptr& data, size_t max_count);
 // Disconnects account on Long Poll errors as we do not have anything to do after that really.
 void long_poll_fatal(PurpleConnection* gc);
 
@@ -123,25 +184,28 @@ void start_long_poll_impl(PurpleConnection* gc, uint64 last_msg_id)
                 const string& server = v.get("server").get<string>();
                 const string& key = v.get("key").get<string>();
                 double ts = v.get("ts").get<double>();
-                request_long_poll(gc, server, key, ts, { max_msg_id, max_msg_id });
+                LongPollData_ptr data(new LongPollData{ gc, server, key, uint64(ts),
+                                                        { max_msg_id, max_msg_id }, {}, false, false });
+                request_long_poll(data);
             });
         });
     }, [=](const picojson::value&) {
         long_poll_fatal(gc);
-    });
+    }, VK_PRIORITY_LONGPOLL);
 }
 
 // Reads and processes an event from updates array.
-void process_update(PurpleConnection* gc, const picojson::value& v, LastMsg& last_msg);
+void process_update(PurpleConnection* gc, const json::value& v, LastMsg& last_msg);
 
 // We request platform to detect desktop/mobile status and attachments to get "from"
 // in chats.
 const char* long_poll_url = "https://%s?act=a_check&key=%s&ts=%llu&wait=25&mode=66";
 
-void request_long_poll(PurpleConnection* gc, const string& server, const string& key, uint64 ts,
-                       LastMsg last_msg)
+void request_long_poll(const LongPollData_ptr& data)
 {
-    string server_url = str_format(long_poll_url, server.data(), key.data(), ts);
+    PurpleConnection* gc = data->gc;
+    string server_url = str_format(long_poll_url, data->server.data(), data->key.data(),
+                                   (unsigned long long)data->ts);
 #if 0
     vkcom_debug_info("Connecting to Long Poll %s\n", server_url.data());
 #endif
@@ -150,6 +214,7 @@ void request_long_poll(PurpleConnection* gc, const string& server, const string&
         // Connection has been cancelled due to account being disconnected.
         if (get_data(gc).is_closing())
             return;
+        steady_time_point received = steady_clock::now();
 
         if (purple_http_response_get_code(response) != 200) {
             vkcom_debug_error("Error while reading response from Long Poll server: %s\n",
@@ -158,16 +223,26 @@ void request_long_poll(PurpleConnection* gc, const string& server, const string&
             return;
         }
 
-        const char* response_text = purple_http_response_get_data(response, nullptr);
+        size_t response_len;
+        const char* response_text = purple_http_response_get_data(response, &response_len);
         const char* response_text_copy = response_text; // Picojson updates iterators it received.
-        picojson::value root;
-        string error = picojson::parse(root, response_text, response_text + strlen(response_text));
+        LongPollResponse_ptr parsed(new LongPollResponse());
+#ifdef USE_ARENA_JSON
+        // Updates are processed after the HTTP response is freed, so the document must reference
+        // its own copy of the text.
+        parsed->text.assign(response_text, response_len);
+        string error = parsed->doc.parse(parsed->text.data(), parsed->text.size());
+        const jsondom::value& root = parsed->doc.root();
+#else
+        string error = picojson::parse(parsed->root, response_text, response_text + response_len);
+        const picojson::value& root = parsed->root;
+#endif
         if (!error.empty()) {
             vkcom_debug_error("Error parsing %s: %s\n", response_text_copy, error.data());
             long_poll_fatal(gc);
             return;
         }
-        if (!root.is<picojson::object>()) {
+        if (!root.is<json::object>()) {
             vkcom_debug_error("Strange response from Long Poll: %s\n", response_text_copy);
             long_poll_fatal(gc);
             return;
@@ -175,27 +250,81 @@ void request_long_poll(PurpleConnection* gc, const string& server, const string&
 
         if (root.contains("failed")) {
             vkcom_debug_info("Long Poll got tired, re-requesting Long Poll server address\n");
-            start_long_poll_impl(gc, last_msg.id);
+            // Process everything we have received so far, so that last_msg is up to date.
+            process_queued_updates(data, data->updates.size());
+            start_long_poll_impl(gc, data->last_msg.id);
             return;
         }
 
-        if (!field_is_present<double>(root, "ts") || !field_is_present<picojson::array>(root, "updates")) {
+        if (!field_is_present<double>(root, "ts") || !field_is_present<json::array>(root, "updates")) {
             vkcom_debug_error("Strange response from Long Poll: %s\n", response_text_copy);
             long_poll_fatal(gc);
             return;
         }
 
-        LastMsg next_last_msg = last_msg;
+        data->ts = root.get("ts").get<double>();
+        size_t update_count = root.get("updates").get<json::array>().size();
+        queue_updates(data, parsed, root, received);
+
+        if (data->updates.size() < MAX_QUEUED_UPDATES) {
+            request_long_poll(data);
+            // Without the pipeline the next request would have been sent only after all updates
+            // were processed, compare with the processing times, logged by process_queued_updates.
+            if (update_count > 0)
+                vkcom_debug_info("Received %d Long Poll updates, next request sent in %d msec\n",
+                                 int(update_count), int(to_milliseconds(steady_clock::now() - received)));
+        } else {
+            vkcom_debug_info("Too many queued Long Poll updates, postponing the next request\n");
+            data->request_postponed = true;
+        }
+    });
+}
+
+void queue_updates(const LongPollData_ptr& data, const LongPollResponse_ptr& response,
+                   const json::value& root, steady_time_point received)
+{
+    for (const json::value& v: root.get("updates").get<json::array>())
+        data->updates.push_back({ response, &v, received });
 
-        const picojson::array& updates = root.get("updates").get<picojson::array>();
-        for (const picojson::value& v: updates)
-            process_update(gc, v, next_last_msg);
+    if (data->updates.empty() || data->processing_scheduled)
+        return;
 
-        uint64 next_ts = root.get("ts").get<double>();
-        request_long_poll(gc, server, key, next_ts, next_last_msg);
+    data->processing_scheduled = true;
+    idle_add(data->gc, [=] {
+        if (process_queued_updates(data, UPDATES_PER_IDLE))
+            return true;
+        data->processing_scheduled = false;
+        return false;
     });
 }
 
+bool process_queued_updates(const LongPollData_ptr& data, size_t max_count)
+{
+    steady_time_point start = steady_clock::now();
+    // The first update is the oldest one, it has waited the longest before being processed.
+    steady_time_point oldest_received = data->updates.empty() ? start : data->updates.front().received;
+    size_t count = 0;
+    while (!data->updates.empty() && count < max_count) {
+        QueuedUpdate queued = data->updates.front();
+        data->updates.pop_front();
+        process_update(data->gc, *queued.update, data->last_msg);
+        count++;
+    }
+    if (count > 0) {
+        steady_time_point end = steady_clock::now();
+        vkcom_debug_info("Processed %d Long Poll updates in %d msec, %d msec after receiving\n",
+                         int(count), int(to_milliseconds(end - start)),
+                         int(to_milliseconds(end - oldest_received)));
+    }
+
+    if (data->request_postponed && data->updates.size() < MAX_QUEUED_UPDATES) {
+        data->request_postponed = false;
+        request_long_poll(data);
+    }
+
+    return !data->updates.empty();
+}
+
 // Update codes coming from Long Poll
 enum LongPollCodes
 {
@@ -227,18 +356,47 @@ enum MessageFlags
     MESSAGE_FLAG_MEDIA_OLD = 512 /*DEPRECATED*/
 };
 
+// Message event: [4, msg_id, flags, user_id, timestamp, subject, text, attachments].
+struct LongPollMessage
+{
+    int code;
+    uint64 msg_id;
+    int flags;
+    // Chat id + CHAT_ID_OFFSET for chat messages.
+    uint64 user_id;
+    uint64 timestamp;
+    string subject;
+    string text;
+    const json::value* attachments;
+
+    static const JsonSchema<LongPollMessage>& schema()
+    {
+        static const JsonSchema<LongPollMessage> schema = JsonSchema<LongPollMessage>::positional({
+            JSON_FIELD(LongPollMessage, code, nullptr, JSON_REQUIRED),
+            JSON_FIELD(LongPollMessage, msg_id, nullptr, JSON_REQUIRED),
+            JSON_FIELD(LongPollMessage, flags, nullptr, JSON_REQUIRED),
+            JSON_FIELD(LongPollMessage, user_id, nullptr, JSON_REQUIRED),
+            JSON_FIELD(LongPollMessage, timestamp, nullptr, JSON_REQUIRED),
+            JSON_FIELD(LongPollMessage, subject, nullptr, JSON_OPTIONAL),
+            JSON_FIELD(LongPollMessage, text, nullptr, JSON_REQUIRED),
+            JSON_FIELD(LongPollMessage, attachments, nullptr, JSON_OPTIONAL),
+        });
+        return schema;
+    }
+};
+
 // Processes message event.
-void process_message(PurpleConnection* gc, const picojson::value& v, LastMsg& last_msg);
+void process_message(PurpleConnection* gc, const json::value& v, LastMsg& last_msg);
 // Processes user online/offline event.
-void process_online(PurpleConnection* gc, const picojson::value& v, bool online);
+void process_online(PurpleConnection* gc, const json::value& v, bool online);
 // Processes update of chat parameters.
-void process_chat_update(PurpleConnection* gc, const picojson::value& v);
+void process_chat_update(PurpleConnection* gc, const json::value& v);
 // Processes user typing event.
-void process_typing(PurpleConnection* gc, const picojson::value& v);
+void process_typing(PurpleConnection* gc, const json::value& v);
 
-void process_update(PurpleConnection* gc, const picojson::value& v, LastMsg& last_msg)
+void process_update(PurpleConnection* gc, const json::value& v, LastMsg& last_msg)
 {
-    if (!v.is<picojson::array>() || !v.contains(0)) {
+    if (!v.is<json::array>() || !v.contains(0)) {
         vkcom_debug_error("Strange response from Long Poll in updates: %s\n",
                            v.serialize().data());
         return;
@@ -269,20 +427,20 @@ void process_update(PurpleConnection* gc, const picojson::value& v, LastMsg& las
 // Process incoming and outgoing messages respectively. In general, there is duplication between these functions
 // and vk-message-recv code, they should somehow be refactored.
 void process_incoming_message_internal(PurpleConnection* gc, uint64 msg_id, int flags, uint64 user_id, string text,
-                                       uint64 timestamp, const picojson::value *attachments);
+                                       uint64 timestamp, const json::value *attachments);
 void process_outgoing_message_internal(PurpleConnection* gc, uint64 msg_id, int flags, uint64 user_id, string text,
                                        uint64 timestamp);
 
-void process_message(PurpleConnection* gc, const picojson::value& v, LastMsg& last_msg)
+void process_message(PurpleConnection* gc, const json::value& v, LastMsg& last_msg)
 {
-    if (!v.contains(6) || !v.get(1).is<double>() || !v.get(2).is<double>() || !v.get(3).is<double>()
-            || !v.get(4).is<double>() || !v.get(6).is<string>()) {
+    LongPollMessage m;
+    if (!json_decode(v, m)) {
         vkcom_debug_error("Strange response from Long Poll in updates: %s\n", v.serialize().data());
         purple_connection_error_reason(gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
                                        i18n("Unable to receive message"));
         return;
     }
-    uint64 msg_id = v.get(1).get<double>();
+    uint64 msg_id = m.msg_id;
     // Check if we already processed this message in receive_messages_range.
     if (msg_id <= last_msg.ignored)
         return;
@@ -294,10 +452,10 @@ void process_message(PurpleConnection* gc, const picojson::value& v, LastMsg& la
         save_last_msg_id(gc, msg_id);
     }
 
-    int flags = v.get(2).get<double>();
+    int flags = m.flags;
 
-    uint64 user_id = v.get(3).get<double>();
-    uint64 timestamp = v.get(4).get<double>();
+    uint64 user_id = m.user_id;
+    uint64 timestamp = m.timestamp;
     // NOTE:
     // * The text is simple UTF-8 text with some HTML leftovers:
     //   * The only tag which it may contain is <br> (API v5.0 stopped using <br>, but Long Poll
@@ -305,11 +463,9 @@ void process_message(PurpleConnection* gc, const picojson::value& v, LastMsg& la
     //   * &amp; &lt; &gt; &quot; are escaped.
     // * Links are sent as plaintext, both Vk.com and Pidgin linkify messages automatically.
     // * Smileys are returned as Unicode emoji.
-    string text = v.get(6).get<string>();
+    string text = std::move(m.text);
 
-    const picojson::value* attachments = nullptr;
-    if (v.contains(7))
-        attachments = &v.get(7);
+    const json::value* attachments = m.attachments;
 
     if (!(flags & MESSAGE_FLAGS_OUTBOX)) {
         // Processing incoming message
@@ -360,9 +516,32 @@ const uint64 CHAT_ID_OFFSET = 2000000000LL;
 
 const uint64 PLATFORM_WEB = 7;
 
+// Keys of the extra fields (the 7th element of message event), which do not require receiving
+// the message via messages.getById: the author of chat message, chat title and emoji flag.
+const char* const simple_message_keys[] = { "from", "title", "emoji" };
+
+// Returns true if the message is plain text and can be shown using only the data from Long Poll.
+// Attachments, forwarded messages, geo and chat service messages are described in the extra fields
+// only briefly and require receiving the message.
+bool is_simple_message(const json::value* attachments)
+{
+    if (!attachments)
+        return true;
+
+    bool simple = true;
+    bool is_object = json_for_each_member(*attachments, [&](const char* key, size_t key_len,
+                                                            const json::value&) {
+        for (const char* simple_key: simple_message_keys)
+            if (strlen(simple_key) == key_len && strncmp(simple_key, key, key_len) == 0)
+                return;
+        simple = false;
+    });
+    return is_object && simple;
+}
+
 void process_incoming_message_internal(PurpleConnection* gc, uint64 msg_id, int flags,
-                                       uint64 /*user_id*/, string text, uint64 /*timestamp*/,
-                                       const picojson::value* attachments)
+                                       uint64 user_id, string text, uint64 timestamp,
+                                       const json::value* attachments)
 {
     // NOTE:
     //  There are two ways of processing messages with attachments:
@@ -375,13 +554,31 @@ void process_incoming_message_internal(PurpleConnection* gc, uint64 msg_id, int
     //   * there is no video.getById so we can show no information on video;
     //   * it takes at least one additional call per message (receive_messages takes exactly one
     //     call).
+    //  Most of the messages are plain text though, they are shown right away.
 
     vkcom_debug_info("Input message specs: id %lu, flags: %d, has attachments: %d\n", (unsigned long)msg_id, (int)flags, (int)(attachments != NULL));
     if (attachments)
         vkcom_debug_info("Raw attachments: %s\n", attachments->serialize().data());
 
     convert_incoming_smileys(text);
-    receive_messages(gc, { msg_id });
+
+    if (is_simple_message(attachments)) {
+        bool unread = flags & MESSAGE_FLAG_UNREAD;
+        if (user_id < CHAT_ID_OFFSET) {
+            receive_long_poll_message(gc, msg_id, user_id, 0, text, timestamp, unread);
+            return;
+        }
+
+        // Chat messages must have the author.
+        if (attachments && attachments->get("from").is<string>()) {
+            uint64 from_id = atoll(attachments->get("from").get<string>().data());
+            receive_long_poll_message(gc, msg_id, from_id, user_id - CHAT_ID_OFFSET, text,
+                                      timestamp, unread);
+            return;
+        }
+    }
+
+    receive_messages_batched(gc, { msg_id });
 }
 
 void process_outgoing_message_internal(PurpleConnection* gc, uint64 /*msg_id*/, int /*flags*/,
@@ -423,7 +620,7 @@ void process_outgoing_message_internal(PurpleConnection* gc, uint64 /*msg_id*/,
     /* } */
 }
 
-void process_online(PurpleConnection* gc, const picojson::value& v, bool online)
+void process_online(PurpleConnection* gc, const json::value& v, bool online)
 {
     if (!v.contains(1) || !v.get(1).is<double>()) {
         vkcom_debug_error("Strange response from Long Poll in updates: %s\n",
@@ -478,7 +675,7 @@ void process_online(PurpleConnection* gc, const picojson::value& v, bool online)
     }
 }
 
-void process_chat_update(PurpleConnection* gc, const picojson::value& v)
+void process_chat_update(PurpleConnection* gc, const json::value& v)
 {
     if (!v.contains(1) || !v.get(1).is<double>()) {
         vkcom_debug_error("Strange respone form Long Poll in updates: %s\n",
@@ -492,7 +689,7 @@ void process_chat_update(PurpleConnection* gc, const picojson::value& v)
     update_chat_infos(gc, { chat_id }, nullptr, true);
 }
 
-void process_typing(PurpleConnection* gc, const picojson::value& v)
+void process_typing(PurpleConnection* gc, const json::value& v)
 {
     if (!v.contains(1) || !v.get(1).is<double>()) {
         vkcom_debug_error("Strange response from Long Poll in updates: %s\n",
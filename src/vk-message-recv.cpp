@@ -6,11 +6,14 @@
 #include <util.h>
 
 #include "httputils.h"
+#include "imagecache.h"
 #include "miscutils.h"
 #include "vk-api.h"
 #include "vk-buddy.h"
 #include "vk-chat.h"
 #include "vk-common.h"
+#include "vk-imgstore.h"
+#include "vk-schema.h"
 #include "vk-utils.h"
 #include "vk-smileys.h"
 
@@ -34,23 +37,105 @@ enum MessageStatus {
     MESSAGE_OUTGOING
 };
 
+// Text of the received message: literal text, interleaved with slots for the parts, which
+// are not known when the message is processed (thumbnails, links to unknown users and groups).
+// Slots are filled later and the final text is rendered once in finish_receiving.
+class MessageText
+{
+public:
+    bool empty() const
+    {
+        return m_segments.empty();
+    }
+
+    // Appends literal text.
+    MessageText& operator+=(const string& str);
+    // Appends slot, which contains fallback text until it is filled, and returns the slot number.
+    size_t append_slot(const string& fallback);
+    void fill_slot(size_t slot_num, const string& str);
+
+    string render() const;
+
+private:
+    // Literals and slots. Adjacent literals are merged into one segment.
+    vector<string> m_segments;
+    // Segment index for each slot.
+    vector<size_t> m_slot_segments;
+};
+
+MessageText& MessageText::operator+=(const string& str)
+{
+    if (str.empty())
+        return *this;
+
+    bool last_is_slot = !m_slot_segments.empty() && m_slot_segments.back() == m_segments.size() - 1;
+    if (m_segments.empty() || last_is_slot)
+        m_segments.push_back(str);
+    else
+        m_segments.back() += str;
+    return *this;
+}
+
+size_t MessageText::append_slot(const string& fallback)
+{
+    m_slot_segments.push_back(m_segments.size());
+    m_segments.push_back(fallback);
+    return m_slot_segments.size() - 1;
+}
+
+void MessageText::fill_slot(size_t slot_num, const string& str)
+{
+    m_segments[m_slot_segments[slot_num]] = str;
+}
+
+string MessageText::render() const
+{
+    size_t size = 0;
+    for (const string& segment: m_segments)
+        size += segment.size();
+
+    string ret;
+    ret.reserve(size);
+    for (const string& segment: m_segments)
+        ret += segment;
+    return ret;
+}
+
+// Thumbnail, which must be downloaded and shown in the message text slot.
+struct ThumbnailSlot
+{
+    string url;
+    size_t slot;
+};
+
+// User or group id, which was unknown when the message was processed, and the slot in message text
+// for the link to it.
+struct IdSlot
+{
+    uint64 id;
+    size_t slot;
+};
+
 // A structure, describing one received message.
 struct Message
 {
     uint64 mid;
     uint64 user_id;
     uint64 chat_id; // If chat_id is 0, this is a regular instant message.
-    string text;
+    MessageText text;
     time_t timestamp;
     MessageStatus status;
 
-    // A list of thumbnail URLs to download and append to message. Set in process_attachments,
-    // replaced in download_thumbnails.
-    vector<string> thumbnail_urls;
-    // A list of user and group ids, used in the message. Set in process_attachments
-    // and process_fwd_message, replaced in replace_user_ids and replace_group_ids.
-    vector<uint64> unknown_user_ids;
-    vector<uint64> unknown_group_ids;
+    // A list of thumbnails to download and show in message. Set in process_attachments,
+    // filled in download_thumbnails.
+    vector<ThumbnailSlot> thumbnails;
+    // A list of unknown user and group ids, used in the message. Set in process_attachments
+    // and process_fwd_message, filled in replace_user_ids and replace_group_ids.
+    vector<IdSlot> unknown_users;
+    vector<IdSlot> unknown_groups;
+    // Ids of images, shown in the message. Set in download_thumbnails, the references are held
+    // until the message is written to conversation in finish_receiving.
+    vector<int> img_ids;
 };
 
 // A structure, capturing all information about received messages.
@@ -68,7 +153,7 @@ void receive_messages_range_internal(const MessagesData_ptr& data, uint64 last_m
 
 // Processes one item from the result of messages.get and messages.getById.
 void process_message(const MessagesData_ptr& data, const picojson::value& fields);
-// Processes attachments: appends urls to message text, adds thumbnail_urls.
+// Processes attachments: appends urls to message text, adds thumbnails.
 void process_attachments(PurpleConnection* gc, const picojson::array& items, Message& message);
 // Processes forwarded messages: appends message text and processes attachments.
 void process_fwd_message(PurpleConnection* gc, const picojson::value& fields, Message& message);
@@ -95,21 +180,24 @@ void process_gift_attachment(const picojson::value& fields, Message& message, co
 // Processes geo: appends link to the map.
 void process_geo(const picojson::value& fields, Message& message);
 
-// Appends specific thumbnail placeholder to the end of message text. Placeholder will be replaced
-// by actual image later in download_thumbnail(). If prepend_br is false, <br> is prepended only
+// Appends specific thumbnail slot to the end of message text. The slot will be filled
+// by actual image later in download_thumbnails(). If prepend_br is false, <br> is prepended only
 // when message text is not empty.
-void append_thumbnail_placeholder(const string& thumbnail_url, Message& message,
-                                  const VkOptions& options, bool prepend_br = true);
-// Returns user/group placeholder, which should be appended to the message text. It will
-// be replaced with actual user/group name and link to the page later in replace_user/group_ids().
-string get_user_placeholder(PurpleConnection* gc, uint64 user_id, Message& message);
-string get_group_placeholder(PurpleConnection* gc, uint64 group_id, Message& message);
-
-// Downloads the given thumbnail for given message, modifies corresponding message text
-// and calls either next download_thumbnail() or finish(). message is index into m_messages,
-// thumbnail is index into thumbnail_urls.
-void download_thumbnail(const MessagesData_ptr& data, size_t msg_num, size_t thumb_num);
-// Replaces all placeholder texts for user/group ids in messages with user/group names
+void append_thumbnail_slot(const string& thumbnail_url, Message& message,
+                           const VkOptions& options, bool prepend_br = true);
+// Appends link to the user/group page to the message text. If the user/group is unknown, appends
+// slot instead, which will be filled with actual user/group name and link later
+// in replace_user/group_ids().
+void append_user_link(PurpleConnection* gc, uint64 user_id, Message& message);
+void append_group_link(PurpleConnection* gc, uint64 group_id, Message& message);
+
+// Fills the thumbnail slot in message text with the image, added to VkImageStore.
+void fill_thumbnail_slot(Message& message, size_t thumb_num, int img_id);
+// Downloads thumbnails for all messages, fills the corresponding slots in message text
+// as soon as each thumbnail is taken from image store, image cache or downloaded and calls
+// replace_user_ids().
+void download_thumbnails(const MessagesData_ptr& data);
+// Fills all slots for user/group ids in messages with user/group names
 // and hrefs. Gets information on users, which are not present in user_infos, and groups
 // from vk.com
 void replace_user_ids(const MessagesData_ptr& data);
@@ -143,25 +231,110 @@ void receive_messages_range(PurpleConnection* gc, uint64 last_msg_id, const Rece
     }
 }
 
-void receive_messages(PurpleConnection* gc, const vector<uint64>& message_ids)
+void receive_messages(PurpleConnection* gc, const vector<uint64>& message_ids,
+                      const ReceivedCb& received_cb)
 {
-    if (message_ids.empty())
+    if (message_ids.empty()) {
+        if (received_cb)
+            received_cb(0);
         return;
+    }
 
     MessagesData_ptr data{ new MessagesData() };
     data->gc = gc;
-    data->received_cb = nullptr;
+    data->received_cb = received_cb;
 
     CallParams params = { {"message_ids", str_concat_int(',', message_ids)} };
     vk_call_api_items(data->gc, "messages.getById", params, false, [=](const picojson::value& message) {
         process_message(data, message);
     }, [=] {
-        download_thumbnail(data, 0, 0);
+        download_thumbnails(data);
     }, [=](const picojson::value&) {
         finish_receiving(data);
+    }, VK_PRIORITY_LONGPOLL);
+}
+
+namespace
+{
+
+// The time to wait for more message ids before receiving the batch (in milliseconds).
+const unsigned MESSAGE_BATCH_TIMEOUT = 100;
+// The maximum number of messages received in one batch.
+const size_t MAX_MESSAGE_BATCH_SIZE = 100;
+
+// Receives the next batch of batched_msg_ids and, once it is received, the following one.
+void receive_next_message_batch(PurpleConnection* gc)
+{
+    VkData& gc_data = get_data(gc);
+    if (gc_data.batched_msg_ids.empty()) {
+        gc_data.msg_batch_pending = false;
+        return;
+    }
+
+    vector<uint64> message_ids;
+    if (gc_data.batched_msg_ids.size() <= MAX_MESSAGE_BATCH_SIZE) {
+        message_ids.swap(gc_data.batched_msg_ids);
+    } else {
+        auto batch_end = gc_data.batched_msg_ids.begin() + MAX_MESSAGE_BATCH_SIZE;
+        message_ids.assign(gc_data.batched_msg_ids.begin(), batch_end);
+        gc_data.batched_msg_ids.erase(gc_data.batched_msg_ids.begin(), batch_end);
+    }
+
+    vkcom_debug_info("Receiving batch of %d messages\n", (int)message_ids.size());
+    receive_messages(gc, message_ids, [=](uint64) {
+        // The ids, which have arrived in the meantime, have already waited long enough.
+        receive_next_message_batch(gc);
+    });
+}
+
+} // End of anonymous namespace
+
+void receive_messages_batched(PurpleConnection* gc, const vector<uint64>& message_ids)
+{
+    VkData& gc_data = get_data(gc);
+    append(gc_data.batched_msg_ids, message_ids);
+    if (gc_data.msg_batch_pending)
+        return;
+
+    gc_data.msg_batch_pending = true;
+    timeout_add(gc, MESSAGE_BATCH_TIMEOUT, [=] {
+        receive_next_message_batch(gc);
+        return false;
     });
 }
 
+void receive_long_poll_message(PurpleConnection* gc, uint64 msg_id, uint64 user_id, uint64 chat_id,
+                               const string& text, time_t timestamp, bool unread)
+{
+    VkData& gc_data = get_data(gc);
+    // The message must not be shown before the messages in the pending batch.
+    if (gc_data.msg_batch_pending) {
+        receive_messages_batched(gc, { msg_id });
+        return;
+    }
+
+    // Batches, which are started while this message is being shown, wait for it.
+    gc_data.msg_batch_pending = true;
+
+    MessagesData_ptr data{ new MessagesData() };
+    data->gc = gc;
+    data->received_cb = [=](uint64) {
+        receive_next_message_batch(gc);
+    };
+
+    Message message;
+    message.mid = msg_id;
+    message.user_id = user_id;
+    message.chat_id = chat_id;
+    message.text += text;
+    message.timestamp = timestamp;
+    message.status = unread ? MESSAGE_INCOMING_UNREAD : MESSAGE_INCOMING_READ;
+    data->messages.push_back(std::move(message));
+
+    // There is nothing to download, start with getting info on unknown users and chats.
+    add_unknown_users_chats(data);
+}
+
 namespace
 {
 
@@ -179,7 +352,7 @@ void get_last_message_id(PurpleConnection* gc, LastMessageIdCb last_message_id_c
         last_message_id_cb(v.get<double>());
     }, [=](const picojson::value&) {
         last_message_id_cb(0);
-    });
+    }, VK_PRIORITY_LONGPOLL);
 }
 
 void receive_messages_range_internal(const MessagesData_ptr& data, uint64 last_msg_id, bool outgoing)
@@ -197,10 +370,10 @@ void receive_messages_range_internal(const MessagesData_ptr& data, uint64 last_m
         if (!outgoing)
             receive_messages_range_internal(data, last_msg_id, true);
         else
-            download_thumbnail(data, 0, 0);
+            download_thumbnails(data);
     }, [=](const picojson::value&) {
         finish_receiving(data);
-    });
+    }, VK_PRIORITY_LONGPOLL);
 }
 
 
@@ -226,9 +399,8 @@ string timestamp_to_long_format(time_t timestamp)
 
 void process_message(const MessagesData_ptr& data, const picojson::value& fields)
 {
-    if (!field_is_present<double>(fields, "user_id") || !field_is_present<double>(fields, "date")
-            || !field_is_present<string>(fields, "body") || !field_is_present<double>(fields, "id")
-            || !field_is_present<double>(fields, "read_state")|| !field_is_present<double>(fields, "out")) {
+    VkMessageFields m;
+    if (!json_decode(fields, m)) {
         vkcom_debug_error("Strange response from messages.get or messages.getById: %s\n",
                            fields.serialize().data());
         return;
@@ -238,33 +410,31 @@ void process_message(const MessagesData_ptr& data, const picojson::value& fields
     vkcom_debug_info("Got Message: %s\n", fields.serialize().data());
 
     Message message;
-    message.mid = fields.get("id").get<double>();
-    message.user_id = fields.get("user_id").get<double>();
-    message.chat_id = 0;
-    if (field_is_present<double>(fields, "chat_id"))
-        message.chat_id = fields.get("chat_id").get<double>();
-
-    message.text = cleanup_message_body(fields.get("body").get<string>());
-    message.timestamp = fields.get("date").get<double>();
-    if (fields.get("out").get<double>() != 0.0)
+    message.mid = m.id;
+    message.user_id = m.user_id;
+    message.chat_id = m.chat_id;
+
+    message.text += cleanup_message_body(m.body);
+    message.timestamp = m.date;
+    if (m.out)
         message.status = MESSAGE_OUTGOING;
-    else if (fields.get("read_state").get<double>() == 0.0)
+    else if (!m.read_state)
         message.status = MESSAGE_INCOMING_UNREAD;
     else
         message.status = MESSAGE_INCOMING_READ;
 
     // Process attachments: append information to text.
-    if (field_is_present<picojson::array>(fields, "attachments"))
-        process_attachments(data->gc, fields.get("attachments").get<picojson::array>(), message);
+    if (m.attachments && m.attachments->is<picojson::array>())
+        process_attachments(data->gc, m.attachments->get<picojson::array>(), message);
 
     // Process forwarded messages.
-    if (field_is_present<picojson::array>(fields, "fwd_messages")) {
-        const picojson::array& fwd_messages = fields.get("fwd_messages").get<picojson::array>();
-        for (const picojson::value& m: fwd_messages)
-            process_fwd_message(data->gc, m, message);
+    if (m.fwd_messages && m.fwd_messages->is<picojson::array>()) {
+        const picojson::array& fwd_messages = m.fwd_messages->get<picojson::array>();
+        for (const picojson::value& fwd: fwd_messages)
+            process_fwd_message(data->gc, fwd, message);
     }
-    if (field_is_present<picojson::object>(fields, "geo"))
-        process_geo(fields.get("geo"), message);
+    if (m.geo && m.geo->is<picojson::object>())
+        process_geo(*m.geo, message);
 
     data->messages.push_back(std::move(message));
 }
@@ -331,15 +501,31 @@ void process_fwd_message(PurpleConnection* gc, const picojson::value& fields, Me
 
     uint64 user_id = fields.get("user_id").get<double>();
     string date = timestamp_to_long_format(fields.get("date").get<double>());
-    // Placeholder either contains a formed href, if the user is already known, or will be replaced
-    // with proper name and href in replace_ids().
-    string text = str_format(i18n("Forwarded message (from %s on %s):\n"),
-                             get_user_placeholder(gc, user_id, message).data(), date.data());
-    text += cleanup_message_body(fields.get("body").get<string>());
+    // The header is split around the user link, which is either a formed href, if the user is
+    // already known, or a slot, which will be filled with proper name and href in replace_user_ids().
+    // The format string is split at the first %s, which is the user, and only the rest is formatted
+    // with the date.
+    string header_format = i18n("Forwarded message (from %s on %s):\n");
+    size_t link_pos = header_format.find("%s");
+    string before_link;
+    string after_link;
+    if (link_pos != string::npos) {
+        before_link = header_format.substr(0, link_pos);
+        after_link = str_format(header_format.substr(link_pos + 2).data(), date.data());
+    } else {
+        vkcom_debug_error("Strange translation of forwarded message header: %s\n",
+                          header_format.data());
+        before_link = header_format;
+    }
+    string body = cleanup_message_body(fields.get("body").get<string>());
     // Prepend quotation marks to all forwared message lines.
-    str_replace(text, "\n", "\n    > ");
+    str_replace(after_link, "\n", "\n    > ");
+    str_replace(body, "\n", "\n    > ");
 
-    message.text += text;
+    message.text += before_link;
+    append_user_link(gc, user_id, message);
+    message.text += after_link;
+    message.text += body;
 
     if (field_is_present<picojson::array>(fields, "attachments"))
         process_attachments(gc, fields.get("attachments").get<picojson::array>(), message);
@@ -439,7 +625,7 @@ void process_photo_attachment(const picojson::value& fields, Message& message,
         message.text += str_format("📷 <a href='%s'>%s</a>", url.data(), photo_text.data());
     else
         message.text += str_format("📷 <a href='%s'>%s</a>", url.data(), url.data());
-    append_thumbnail_placeholder(thumbnail, message, options);
+    append_thumbnail_slot(thumbnail, message, options);
 }
 
 void process_video_attachment(const picojson::value& fields, Message& message,
@@ -469,7 +655,7 @@ void process_video_attachment(const picojson::value& fields, Message& message,
                                title.data(),
                                description.c_str());
 
-    append_thumbnail_placeholder(thumbnail, message, options);
+    append_thumbnail_slot(thumbnail, message, options);
 }
 
 void process_audio_attachment(const picojson::value& fields, Message& message)
@@ -490,21 +676,18 @@ void process_audio_attachment(const picojson::value& fields, Message& message)
 void process_doc_attachment(const picojson::value& fields, Message& message,
                             const VkOptions& options)
 {
-    if (!field_is_present<string>(fields, "url") || !field_is_present<string>(fields, "title")) {
+    VkDocFields doc;
+    if (!json_decode(fields, doc)) {
         vkcom_debug_error("Strange attachment in response from messages.get "
                            "or messages.getById: %s\n", fields.serialize().data());
         return;
     }
-    const string& url = fields.get("url").get<string>();
-    const string& title = fields.get("title").get<string>();
 
-    message.text += str_format("🖹 <a href='%s'>%s</a>", url.data(), title.data());
+    message.text += str_format("🖹 <a href='%s'>%s</a>", doc.url.data(), doc.title.data());
 
     // Check if we've got a thumbnail.
-    if (field_is_present<string>(fields, "photo_130")) {
-        const string& thumbnail = fields.get("photo_130").get<string>();
-        append_thumbnail_placeholder(thumbnail, message, options);
-    }
+    if (!doc.photo_130.empty())
+        append_thumbnail_slot(doc.photo_130, message, options);
 }
 
 void process_wall_attachment(PurpleConnection* gc, const picojson::value& fields, Message& message)
@@ -530,9 +713,9 @@ void process_wall_attachment(PurpleConnection* gc, const picojson::value& fields
         to_id = fields.get("from_id").get<double>();
 
     if (to_id > 0) {
-        message.text += get_user_placeholder(gc, to_id, message);
+        append_user_link(gc, to_id, message);
     } else {
-        message.text += get_group_placeholder(gc, -to_id, message);
+        append_group_link(gc, -to_id, message);
     }
 
     string wall_url = str_format("https://vk.com/wall%lld_%llu", (long long)to_id,
@@ -597,7 +780,7 @@ void process_link_attachment(const picojson::value& fields, Message& message,
     }
 
     if (!image_src.empty())
-        append_thumbnail_placeholder(image_src, message, options);
+        append_thumbnail_slot(image_src, message, options);
 }
 
 void process_album_attachment(const picojson::value& fields, Message& message)
@@ -636,7 +819,7 @@ void process_sticker_attachment(const picojson::value& fields, Message& message,
         }
         if (sz_smallest) {
             thumbnail = sz_smallest->get("url").get<string>();
-            append_thumbnail_placeholder(thumbnail, message, options, false);
+            append_thumbnail_slot(thumbnail, message, options, false);
         }
     }
 }
@@ -656,7 +839,7 @@ void process_gift_attachment(const picojson::value& fields, Message& message, co
         return;
     }
 
-    append_thumbnail_placeholder(thumbnail, message, options, false);
+    append_thumbnail_slot(thumbnail, message, options, false);
 }
 
 
@@ -720,15 +903,15 @@ void process_geo(const picojson::value& fields, Message& message)
                              i18n("on Google maps"));
 }
 
-void append_thumbnail_placeholder(const string& thumbnail_url, Message& message,
-                                  const VkOptions& options, bool prepend_br)
+void append_thumbnail_slot(const string& thumbnail_url, Message& message,
+                           const VkOptions& options, bool prepend_br)
 {
-    // Append the image placeholder only when the message will not be stored directly to log,
+    // Append the image slot only when the message will not be stored directly to log,
     // otherwise the image will not be shown anyway.
     // TODO: If the conversation is open and an outgoing message has been received, we should show
     // the image too.
     if (message.status == MESSAGE_INCOMING_UNREAD) {
-        // We will download the image later and replace the placeholder.
+        // We will download the image later and fill the slot.
         if (!message.text.empty() || prepend_br)
             message.text += "<br>";
         if (options.enable_webkit_workarounds) {
@@ -736,75 +919,107 @@ void append_thumbnail_placeholder(const string& thumbnail_url, Message& message,
             // at all and append <img src=> instead.
             message.text += str_format("<img src=\"%s\" width=\"100%%\">", thumbnail_url.data());
         } else {
-            message.text += str_format("<thumbnail-placeholder-%zu>", message.thumbnail_urls.size());
-            message.thumbnail_urls.push_back(thumbnail_url);
+            size_t slot = message.text.append_slot("");
+            message.thumbnails.push_back(ThumbnailSlot{ thumbnail_url, slot });
         }
     }
 }
 
-string get_user_placeholder(PurpleConnection* gc, uint64 user_id, Message& message)
+void append_user_link(PurpleConnection* gc, uint64 user_id, Message& message)
 {
     if (user_id == 0)
-        return "";
+        return;
 
     VkUserInfo* info = get_user_info(gc, user_id);
     // We can have user_info, but the user can be unknown.
     if (info && !is_unknown_user(gc, user_id)) {
-        return get_user_href(user_id, *info);
+        message.text += get_user_href(user_id, *info);
     } else {
-        // We will get user information later and replace the placeholder.
-        string text = str_format("<user-placeholder-%zu>", message.unknown_user_ids.size());
-        message.unknown_user_ids.push_back(user_id);
-        return text;
+        // We will get user information later and fill the slot. The slot is left empty if it fails.
+        size_t slot = message.text.append_slot("");
+        message.unknown_users.push_back(IdSlot{ user_id, slot });
     }
 }
 
-string get_group_placeholder(PurpleConnection* gc, uint64 group_id, Message& message)
+void append_group_link(PurpleConnection* gc, uint64 group_id, Message& message)
 {
     if (group_id == 0)
-        return "";
+        return;
 
     VkGroupInfo* info = get_group_info(gc, group_id);
     // We can have group_info, but the group can be unknown.
     if (info && !is_unknown_group(gc, group_id)) {
-        return get_group_href(group_id, *info);
+        message.text += get_group_href(group_id, *info);
     } else {
-        // We will get group information later and replace the placeholder.
-        string text = str_format("<group-placeholder-%zu>", message.unknown_group_ids.size());
-        message.unknown_group_ids.push_back(group_id);
-        return text;
+        // We will get group information later and fill the slot. The slot is left empty if it fails.
+        size_t slot = message.text.append_slot("");
+        message.unknown_groups.push_back(IdSlot{ group_id, slot });
     }
 }
 
-void download_thumbnail(const MessagesData_ptr& data, size_t msg_num, size_t thumb_num)
+// The maximum number of thumbnails, downloaded simultaneously.
+const size_t MAX_THUMBNAILS_IN_FLIGHT = 4;
+// Timeout for downloading one thumbnail in seconds.
+const int THUMBNAIL_TIMEOUT = 30;
+
+void fill_thumbnail_slot(Message& message, size_t thumb_num, int img_id)
 {
-    if (msg_num >= data->messages.size()) {
-        replace_user_ids(data);
-        return;
-    }
-    if (thumb_num >= data->messages[msg_num].thumbnail_urls.size()) {
-        download_thumbnail(data, msg_num + 1, 0);
-        return;
+    message.img_ids.push_back(img_id);
+    message.text.fill_slot(message.thumbnails[thumb_num].slot, str_format("<img id=\"%d\">", img_id));
+}
+
+void download_thumbnails(const MessagesData_ptr& data)
+{
+    // Message and thumbnail indices for each url.
+    typedef std::pair<size_t, size_t> ThumbnailPos;
+    shared_ptr<vector<ThumbnailPos>> positions(new vector<ThumbnailPos>());
+    vector<string> urls;
+    VkImageStore& image_store = get_data(data->gc).image_store();
+    for (size_t msg_num = 0; msg_num < data->messages.size(); msg_num++) {
+        Message& message = data->messages[msg_num];
+        const vector<ThumbnailSlot>& thumbnails = message.thumbnails;
+        for (size_t thumb_num = 0; thumb_num < thumbnails.size(); thumb_num++) {
+            const string& url = thumbnails[thumb_num].url;
+            int img_id = image_store.find(url);
+            if (img_id != 0) {
+                fill_thumbnail_slot(message, thumb_num, img_id);
+                continue;
+            }
+
+            size_t size;
+            char* img_data = image_cache_get(url, &size);
+            if (img_data) {
+                img_id = image_store.add(url, img_data, size);
+                fill_thumbnail_slot(message, thumb_num, img_id);
+                continue;
+            }
+
+            positions->push_back(ThumbnailPos(msg_num, thumb_num));
+            urls.push_back(url);
+        }
     }
 
-    const string& url = data->messages[msg_num].thumbnail_urls[thumb_num];
-    http_get(data->gc, url, [=](PurpleHttpConnection*, PurpleHttpResponse* response) {
+    http_get_all(data->gc, urls, MAX_THUMBNAILS_IN_FLIGHT, THUMBNAIL_TIMEOUT,
+                 [=](size_t url_num, PurpleHttpResponse* response) {
         if (!purple_http_response_is_successful(response)) {
             vkcom_debug_error("Unable to download thumbnail: %s\n",
                                purple_http_response_get_error(response));
-            download_thumbnail(data, msg_num, thumb_num + 1);
             return;
         }
 
-        size_t size;
-        const char* img_data = purple_http_response_get_data(response, &size);
-        int img_id = purple_imgstore_add_with_id(g_memdup(img_data, size), size, nullptr);
+        size_t msg_num = (*positions)[url_num].first;
+        size_t thumb_num = (*positions)[url_num].second;
 
-        string img_tag = str_format("<img id=\"%d\">", img_id);
-        string img_placeholder = str_format("<thumbnail-placeholder-%zu>", thumb_num);
-        str_replace(data->messages[msg_num].text, img_placeholder, img_tag);
+        Message& message = data->messages[msg_num];
+        const string& url = message.thumbnails[thumb_num].url;
 
-        download_thumbnail(data, msg_num, thumb_num + 1);
+        size_t size;
+        const char* img_data = purple_http_response_get_data(response, &size);
+        image_cache_put(url, img_data, size);
+        int img_id = get_data(data->gc).image_store().add(url, (char*)g_memdup(img_data, size), size);
+        fill_thumbnail_slot(message, thumb_num, img_id);
+    }, [=] {
+        replace_user_ids(data);
     });
 }
 
@@ -813,23 +1028,20 @@ void replace_user_ids(const MessagesData_ptr& data)
     // Get all user ids, which are not present in user_infos.
     set<uint64> unknown_user_ids;
     for (const Message& message: data->messages) {
-        insert_if(unknown_user_ids, message.unknown_user_ids, [=](uint64 user_id) {
-            return is_unknown_user(data->gc, user_id);
-        });
+        for (const IdSlot& user: message.unknown_users)
+            if (is_unknown_user(data->gc, user.id))
+                unknown_user_ids.insert(user.id);
     }
 
     update_user_infos(data->gc, unknown_user_ids, [=] {
         for (Message& m: data->messages) {
-            for (size_t i = 0; i < m.unknown_user_ids.size(); i++) {
-                uint64 id = m.unknown_user_ids[i];
-                VkUserInfo* info = get_user_info(data->gc, id);
+            for (const IdSlot& user: m.unknown_users) {
+                VkUserInfo* info = get_user_info(data->gc, user.id);
                 // Getting the user info could fail.
                 if (!info)
                     continue;
 
-                string placeholder = str_format("<user-placeholder-%zu>", i);
-                string href = get_user_href(id, *info);
-                str_replace(m.text, placeholder, href);
+                m.text.fill_slot(user.slot, get_user_href(user.id, *info));
             }
         }
 
@@ -841,23 +1053,20 @@ void replace_group_ids(const MessagesData_ptr& data)
 {
     vector<uint64> group_ids;
     for (const Message& m: data->messages) {
-        append_if(group_ids, m.unknown_group_ids, [=](uint64 group_id) {
-            return is_unknown_group(data->gc, group_id);
-        });
+        for (const IdSlot& group: m.unknown_groups)
+            if (is_unknown_group(data->gc, group.id))
+                group_ids.push_back(group.id);
     }
 
     update_groups_info(data->gc, group_ids, [=] {
         for (Message& m: data->messages) {
-            for (size_t i = 0; i < m.unknown_group_ids.size(); i++) {
-                uint64 group_id = m.unknown_group_ids[i];
-                VkGroupInfo* info = get_group_info(data->gc, group_id);
+            for (const IdSlot& group: m.unknown_groups) {
+                VkGroupInfo* info = get_group_info(data->gc, group.id);
                 // Getting the group info could fail.
                 if (!info)
                     continue;
 
-                string placeholder = str_format("<group-placeholder-%zu>", i);
-                string href = get_group_href(group_id, *info);
-                str_replace(m.text, placeholder, href);
+                m.text.fill_slot(group.slot, get_group_href(group.id, *info));
             }
         }
 
@@ -915,26 +1124,51 @@ void finish_receiving(const MessagesData_ptr& data)
 
     // We could've received duplicate messages if a new message arrived between asking for
     // two message batches (with two different offsets). In this case batches overlap (offset
-    // starts counting from other base).
-    unique(data->messages, [](const Message& a, const Message& b) {
-        return a.mid == b.mid;
-    });
+    // starts counting from other base). Duplicates hold references to their images, taken
+    // in download_thumbnails, so they are released before the duplicates are removed.
+    VkImageStore& image_store = get_data(data->gc).image_store();
+    size_t unique_size = 0;
+    for (size_t i = 0; i < data->messages.size(); i++) {
+        if (unique_size > 0 && data->messages[unique_size - 1].mid == data->messages[i].mid) {
+            image_store.release(data->messages[i].img_ids);
+            continue;
+        }
+        if (i != unique_size)
+            data->messages[unique_size] = std::move(data->messages[i]);
+        unique_size++;
+    }
+    data->messages.erase(data->messages.begin() + unique_size, data->messages.end());
 
     PurpleLogCache logs(data->gc);
-    for (const Message& m: data->messages) {
+    for (Message& m: data->messages) {
+        // All slots are filled by now, so the text is rendered only once.
+        string text = m.text.render();
         if (m.status == MESSAGE_INCOMING_UNREAD) {
-            // Open new conversation for received message.
+            // Open new conversation for received message. The conversation will keep the images
+            // even if the chat conversation is opened later.
             if (m.chat_id == 0) {
                 string from = user_name_from_id(m.user_id);
-                serv_got_im(data->gc, from.data(), m.text.data(), PURPLE_MESSAGE_RECV, m.timestamp);
+                image_store.ref_conv_images(from, m.img_ids);
+                serv_got_im(data->gc, from.data(), text.data(), PURPLE_MESSAGE_RECV, m.timestamp);
             } else {
                 // Ideally, the chat info would be already added, so the lambda will be called in the current
-                // context.
-                open_chat_conv(data->gc, m.chat_id, [=] {
-                    int conv_id = chat_id_to_conv_id(data->gc, m.chat_id);
-                    string from = get_user_display_name(data->gc, m.user_id, m.chat_id);
-                    serv_got_chat_in(data->gc, conv_id, from.data(), PURPLE_MESSAGE_RECV, m.text.data(),
-                                     m.timestamp);
+                // context. The lambda takes over the references of the message to its images and passes
+                // them to the conversation only when it has been opened. If the connection is closed
+                // before that, they are released together with the image store.
+                uint64 user_id = m.user_id;
+                uint64 chat_id = m.chat_id;
+                time_t timestamp = m.timestamp;
+                vector<int> img_ids = std::move(m.img_ids);
+                m.img_ids.clear();
+                open_chat_conv(data->gc, chat_id, [=] {
+                    VkImageStore& image_store = get_data(data->gc).image_store();
+                    image_store.ref_conv_images(chat_name_from_id(chat_id), img_ids);
+                    image_store.release(img_ids);
+
+                    int conv_id = chat_id_to_conv_id(data->gc, chat_id);
+                    string from = get_user_display_name(data->gc, user_id, chat_id);
+                    serv_got_chat_in(data->gc, conv_id, from.data(), PURPLE_MESSAGE_RECV, text.data(),
+                                     timestamp);
                 });
             }
         } else { // m.status == MESSAGE_INCOMING_READ || m.status == MESSAGE_OUTGOING
@@ -958,13 +1192,14 @@ void finish_receiving(const MessagesData_ptr& data)
 
             PurpleConversation* conv = find_conv_for_id(data->gc, m.user_id, m.chat_id);
             if (conv) {
+                image_store.ref_conv_images(purple_conversation_get_name(conv), m.img_ids);
                 if (m.chat_id == 0)
                     // It is possible to use real name as the second parameter instead of username
                     // in the form of "idXXX".
-                    purple_conv_im_write(PURPLE_CONV_IM(conv), from.data(), m.text.data(), flags,
+                    purple_conv_im_write(PURPLE_CONV_IM(conv), from.data(), text.data(), flags,
                                          m.timestamp);
                 else
-                    purple_conv_chat_write(PURPLE_CONV_CHAT(conv), from.data(), m.text.data(), flags,
+                    purple_conv_chat_write(PURPLE_CONV_CHAT(conv), from.data(), text.data(), flags,
                                            m.timestamp);
             } else {
                 PurpleLog* log;
@@ -972,7 +1207,7 @@ void finish_receiving(const MessagesData_ptr& data)
                     log = logs.for_user(m.user_id);
                 else
                     log = logs.for_chat(m.chat_id);
-                purple_log_write(log, flags, from.data(), m.timestamp, m.text.data());
+                purple_log_write(log, flags, from.data(), m.timestamp, text.data());
             }
         }
     }
@@ -984,6 +1219,10 @@ void finish_receiving(const MessagesData_ptr& data)
             unread_messages.push_back(VkReceivedMessage{ m.mid, m.user_id, m.chat_id });
     mark_message_as_read(data->gc, unread_messages);
 
+    // Images are now referenced by conversations, if needed.
+    for (const Message& m: data->messages)
+        image_store.release(m.img_ids);
+
     // Sets the last message id as m_messages are sorted by mid.
     uint64 max_msg_id = 0;
     if (!data->messages.empty())
@@ -1057,7 +1296,7 @@ void mark_messages_as_read_impl(PurpleConnection* gc, const Cont& message_ids)
 
     vkcom_debug_info("Marking %d messages as read\n", (int)message_ids.size());
     CallParams params = { {"message_ids", str_concat_int(',', message_ids)} };
-    vk_call_api(gc, "messages.markAsRead", params, nullptr, nullptr);
+    vk_call_api(gc, "messages.markAsRead", params, nullptr, nullptr, VK_PRIORITY_INTERACTIVE);
 }
 
 } // namespace
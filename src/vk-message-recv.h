@@ -16,7 +16,19 @@ typedef function_ptr<void(uint64 max_msg_id)> ReceivedCb;
 void receive_messages_range(PurpleConnection* gc, uint64 last_msg_id, const ReceivedCb& received_cb);
 
 // Receives messages with given ids. Suitable for small amount of message_ids (< 100).
-void receive_messages(PurpleConnection* gc, const vector<uint64>& message_ids);
+void receive_messages(PurpleConnection* gc, const vector<uint64>& message_ids,
+                      const ReceivedCb& received_cb = nullptr);
+
+// Receives messages with given ids after a short delay, so that ids from multiple calls are
+// received with one messages.getById call. Batches are received one after another, so messages
+// are shown in the order of their ids.
+void receive_messages_batched(PurpleConnection* gc, const vector<uint64>& message_ids);
+
+// Shows incoming message, which has been completely described by Long Poll event (i.e. plain text
+// without attachments or forwarded messages), without calling messages.getById. text must be
+// already converted to Pidgin markup. chat_id is zero for non-chat messages.
+void receive_long_poll_message(PurpleConnection* gc, uint64 msg_id, uint64 user_id, uint64 chat_id,
+                               const string& text, time_t timestamp, bool unread);
 
 // Marks messages as read or defers marking them until it is appropriate to mark them as read.
 void mark_message_as_read(PurpleConnection* gc, const vector<VkReceivedMessage>& messages);
@@ -144,7 +144,11 @@ void upload_imgstore_images_impl(PurpleConnection* gc, const UploadImgstoreImage
     size_t size = purple_imgstore_get_size(img);
 
     vkcom_debug_info("Uploading img %d\n", img_id);
+    // contents are read while the request is being sent, the image must not be freed until then,
+    // even if the conversation is closed.
+    purple_imgstore_ref_by_id(img_id);
     upload_photo_for_im(gc, filename, contents, size, [=](const picojson::value& v) {
+        purple_imgstore_unref_by_id(img_id);
         vkcom_debug_info("Sucessfully uploaded img %d\n", img_id);
         if (!v.is<picojson::array>() || !v.contains(0)) {
             vkcom_debug_error("Unknown photos.saveMessagesPhoto result: %s\n", v.serialize().data());
@@ -175,6 +179,7 @@ void upload_imgstore_images_impl(PurpleConnection* gc, const UploadImgstoreImage
             upload_imgstore_images_impl(gc, images, uploaded_cb, error_cb, offset + 1);
         }
     }, [=] {
+        purple_imgstore_unref_by_id(img_id);
         if (error_cb)
             error_cb();
     });
@@ -305,7 +310,7 @@ void send_message_internal(PurpleConnection* gc, const SendMessage_ptr& message,
             message->success_cb();
     }, [=](const picojson::value& error) {
         process_im_error(error, gc, message);
-    });
+    }, VK_PRIORITY_INTERACTIVE);
 }
 
 void process_im_error(const picojson::value& error, PurpleConnection* gc, const SendMessage_ptr& message)
@@ -362,7 +367,7 @@ void show_error(PurpleConnection* gc, const SendMessage& message)
 unsigned send_typing_notification(PurpleConnection* gc, uint64 user_id)
 {
     CallParams params = { {"user_id", to_string(user_id)}, {"type", "typing"} };
-    vk_call_api(gc, "messages.setActivity", params, nullptr, nullptr);
+    vk_call_api(gc, "messages.setActivity", params, nullptr, nullptr, VK_PRIORITY_INTERACTIVE);
 
     add_buddy_if_needed(gc, user_id);
 
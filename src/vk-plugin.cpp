@@ -12,6 +12,7 @@
 #include "vk-chat.h"
 #include "vk-common.h"
 #include "vk-filexfer.h"
+#include "vk-imgstore.h"
 #include "vk-longpoll.h"
 #include "vk-message-recv.h"
 #include "vk-message-send.h"
@@ -287,6 +288,9 @@ void vk_login(PurpleAccount* account)
         // Remember current aliases and groups of buddies and chats to check whether user has modified them later.
         check_blist_on_login(gc);
 
+        // Show buddies and chats from the previous session until the fresh infos are received.
+        update_blist_from_snapshot(gc);
+
         // Start Long Poll event processing. Buddy list and unread messages will be retrieved there.
         start_long_poll(gc);
 
@@ -424,15 +428,16 @@ void vk_get_info(PurpleConnection* gc, const char* who)
         purple_notify_user_info_add_section_break(info);
         purple_notify_user_info_add_pair_plaintext(info, i18n("Name"), user_info->real_name.data());
 
-        if (!user_info->bdate.empty())
-            purple_notify_user_info_add_pair_plaintext(info, i18n("Birthdate"),
-                                                       user_info->bdate.data());
-        if (!user_info->education.empty())
-            purple_notify_user_info_add_pair_plaintext(info, i18n("Education"),
-                                                       user_info->education.data());
-        if (!user_info->mobile_phone.empty())
+        string bdate = user_info->bdate();
+        string education = user_info->education();
+        string mobile_phone = user_info->mobile_phone();
+        if (!bdate.empty())
+            purple_notify_user_info_add_pair_plaintext(info, i18n("Birthdate"), bdate.data());
+        if (!education.empty())
+            purple_notify_user_info_add_pair_plaintext(info, i18n("Education"), education.data());
+        if (!mobile_phone.empty())
             purple_notify_user_info_add_pair_plaintext(info, i18n("Mobile phone"),
-                                                       user_info->mobile_phone.data());
+                                                       mobile_phone.data());
         if (!user_info->activity.empty())
             purple_notify_user_info_add_pair_plaintext(info, i18n("Status"),
                                                        user_info->activity.data());
@@ -543,6 +548,7 @@ void vk_chat_leave(PurpleConnection* gc, int id)
     }
 
     vkcom_debug_error("Leaving chat%llu\n", (unsigned long long)chat_id);
+    get_data(gc).image_store().release_conv_images(chat_name_from_id(chat_id));
     remove_conv_id(gc, id);
     remove_chat_if_needed(gc, chat_id);
 }
@@ -578,10 +584,12 @@ void vk_rename_group(PurpleConnection*, const char*,  PurpleGroup*, GList*)
 {
 }
 
-// Conversation is closed, we may want to remove buddy from buddy list if it has been added there temporarily.
+// Conversation is closed, we release the images, shown in it, and may want to remove buddy from buddy list
+// if it has been added there temporarily.
 void vk_convo_closed(PurpleConnection* gc, const char* who)
 {
     vkcom_debug_info("Conversation with %s closed\n", who);
+    get_data(gc).image_store().release_conv_images(who);
 
     uint64 user_id = user_id_from_name(who);
     if (user_id == 0)
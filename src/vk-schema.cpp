@@ -0,0 +1,89 @@
+#include "vk-schema.h"
+
+const JsonSchema<VkLastSeenFields>& VkLastSeenFields::schema()
+{
+    static const JsonSchema<VkLastSeenFields> schema = {
+        JSON_FIELD(VkLastSeenFields, time, "time", JSON_REQUIRED),
+    };
+    return schema;
+}
+
+const JsonSchema<VkUserFields>& VkUserFields::schema()
+{
+    static const JsonSchema<VkUserFields> schema = {
+        JSON_FIELD(VkUserFields, id, "id", JSON_REQUIRED),
+        JSON_FIELD(VkUserFields, first_name, "first_name", JSON_REQUIRED),
+        JSON_FIELD(VkUserFields, last_name, "last_name", JSON_REQUIRED),
+        JSON_FIELD(VkUserFields, deactivated, "deactivated", JSON_OPTIONAL),
+        JSON_FIELD(VkUserFields, activity, "activity", JSON_OPTIONAL),
+        JSON_FIELD(VkUserFields, bdate, "bdate", JSON_OPTIONAL),
+        JSON_FIELD(VkUserFields, domain, "domain", JSON_OPTIONAL),
+        JSON_FIELD(VkUserFields, faculty_name, "faculty_name", JSON_OPTIONAL),
+        JSON_FIELD(VkUserFields, graduation, "graduation", JSON_OPTIONAL),
+        JSON_FIELD(VkUserFields, last_seen, "last_seen", JSON_OPTIONAL),
+        JSON_FIELD(VkUserFields, mobile_phone, "mobile_phone", JSON_OPTIONAL),
+        JSON_FIELD(VkUserFields, online, "online", JSON_OPTIONAL),
+        JSON_FIELD(VkUserFields, online_mobile, "online_mobile", JSON_OPTIONAL),
+        JSON_FIELD(VkUserFields, photo_50, "photo_50", JSON_OPTIONAL),
+        JSON_FIELD(VkUserFields, photo_max_orig, "photo_max_orig", JSON_OPTIONAL),
+        JSON_FIELD(VkUserFields, university_name, "university_name", JSON_OPTIONAL),
+    };
+    return schema;
+}
+
+const JsonSchema<VkChatUserFields>& VkChatUserFields::schema()
+{
+    static const JsonSchema<VkChatUserFields> schema = {
+        JSON_FIELD(VkChatUserFields, id, "id", JSON_REQUIRED),
+    };
+    return schema;
+}
+
+const JsonSchema<VkChatFields>& VkChatFields::schema()
+{
+    static const JsonSchema<VkChatFields> schema = {
+        JSON_FIELD(VkChatFields, id, "id", JSON_REQUIRED),
+        JSON_FIELD(VkChatFields, admin_id, "admin_id", JSON_REQUIRED),
+        JSON_FIELD(VkChatFields, title, "title", JSON_REQUIRED),
+        JSON_FIELD(VkChatFields, users, "users", JSON_REQUIRED),
+    };
+    return schema;
+}
+
+const JsonSchema<VkGroupFields>& VkGroupFields::schema()
+{
+    static const JsonSchema<VkGroupFields> schema = {
+        JSON_FIELD(VkGroupFields, id, "id", JSON_REQUIRED),
+        JSON_FIELD(VkGroupFields, name, "name", JSON_REQUIRED),
+        JSON_FIELD(VkGroupFields, type, "type", JSON_REQUIRED),
+        JSON_FIELD(VkGroupFields, screen_name, "screen_name", JSON_OPTIONAL),
+    };
+    return schema;
+}
+
+const JsonSchema<VkMessageFields>& VkMessageFields::schema()
+{
+    static const JsonSchema<VkMessageFields> schema = {
+        JSON_FIELD(VkMessageFields, id, "id", JSON_REQUIRED),
+        JSON_FIELD(VkMessageFields, user_id, "user_id", JSON_REQUIRED),
+        JSON_FIELD(VkMessageFields, chat_id, "chat_id", JSON_OPTIONAL),
+        JSON_FIELD(VkMessageFields, date, "date", JSON_REQUIRED),
+        JSON_FIELD(VkMessageFields, body, "body", JSON_REQUIRED),
+        JSON_FIELD(VkMessageFields, read_state, "read_state", JSON_REQUIRED),
+        JSON_FIELD(VkMessageFields, out, "out", JSON_REQUIRED),
+        JSON_FIELD(VkMessageFields, attachments, "attachments", JSON_OPTIONAL),
+        JSON_FIELD(VkMessageFields, fwd_messages, "fwd_messages", JSON_OPTIONAL),
+        JSON_FIELD(VkMessageFields, geo, "geo", JSON_OPTIONAL),
+    };
+    return schema;
+}
+
+const JsonSchema<VkDocFields>& VkDocFields::schema()
+{
+    static const JsonSchema<VkDocFields> schema = {
+        JSON_FIELD(VkDocFields, url, "url", JSON_REQUIRED),
+        JSON_FIELD(VkDocFields, title, "title", JSON_REQUIRED),
+        JSON_FIELD(VkDocFields, photo_130, "photo_130", JSON_OPTIONAL),
+    };
+    return schema;
+}
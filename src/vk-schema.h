@@ -0,0 +1,109 @@
+// Typed descriptions of objects, returned by Vk.com API.
+
+#pragma once
+
+#include "common.h"
+
+#include "jsonschema.h"
+
+// Each struct describes the fields of one object type, which we use. Members are named after
+// JSON keys. Decode objects with json_decode(v, out), which returns false if the object lacks
+// required fields.
+
+// "last_seen" field of user object.
+struct VkLastSeenFields
+{
+    uint64 time;
+
+    static const JsonSchema<VkLastSeenFields>& schema();
+};
+
+// User object, returned by users.get, friends.get and messages.getChat (see user_fields
+// in vk-buddy.cpp).
+struct VkUserFields
+{
+    // Negative ids are used for e-mail participants in chats.
+    int64 id;
+    string first_name;
+    string last_name;
+    // Set if user has been deleted or banned.
+    string deactivated;
+
+    string activity;
+    string bdate;
+    string domain;
+    string faculty_name;
+    int graduation;
+    VkLastSeenFields last_seen;
+    string mobile_phone;
+    bool online;
+    bool online_mobile;
+    string photo_50;
+    string photo_max_orig;
+    string university_name;
+
+    static const JsonSchema<VkUserFields>& schema();
+};
+
+// Chat participant in VkChatFields. Only id is required, because e-mail participants are returned
+// without names. Known users are not updated, so the rest of user object is decoded as VkUserFields
+// only when needed.
+struct VkChatUserFields
+{
+    // Negative ids are used for e-mail participants.
+    int64 id;
+
+    static const JsonSchema<VkChatUserFields>& schema();
+};
+
+// Chat object, returned by messages.getChat with "fields" parameter.
+struct VkChatFields
+{
+    uint64 id;
+    uint64 admin_id;
+    string title;
+    // User objects, see VkChatUserFields.
+    vector<const picojson::value*> users;
+
+    static const JsonSchema<VkChatFields>& schema();
+};
+
+// Group object, returned by groups.getById.
+struct VkGroupFields
+{
+    uint64 id;
+    string name;
+    string type;
+    string screen_name;
+
+    static const JsonSchema<VkGroupFields>& schema();
+};
+
+// Message object, returned by messages.get and messages.getById. Attachments, forwarded messages
+// and geo point to the values inside the decoded tree and are nullptr if absent.
+struct VkMessageFields
+{
+    uint64 id;
+    uint64 user_id;
+    uint64 chat_id;
+    uint64 date;
+    string body;
+    bool read_state;
+    bool out;
+
+    const picojson::value* attachments;
+    const picojson::value* fwd_messages;
+    const picojson::value* geo;
+
+    static const JsonSchema<VkMessageFields>& schema();
+};
+
+// Doc object, e.g. doc attachment.
+struct VkDocFields
+{
+    string url;
+    string title;
+    string photo_130;
+
+    static const JsonSchema<VkDocFields>& schema();
+};
@@ -1,9 +1,13 @@
+#include <algorithm>
+#include <cstring>
 #include <gio/gio.h>
+#include <glib/gstdio.h>
 #include <random>
 
 #include "httputils.h"
 #include "miscutils.h"
 #include "vk-api.h"
+#include "vk-common.h"
 
 #include "vk-upload.h"
 
@@ -11,20 +15,177 @@
 namespace
 {
 
+// Size of chunks, in which files are read.
+const size_t UPLOAD_CHUNK_SIZE = 64 * 1024;
+
+// Contents of the uploaded file, either kept in memory or read from file while uploading.
+struct UploadContents
+{
+    // nullptr if contents are read from filepath.
+    const char* data;
+    string filepath;
+    size_t size;
+    // Multipart boundary, checked by scan_doc_for_upload. Empty if it must be chosen
+    // by prepare_upload_request (only for in-memory contents).
+    string boundary;
+};
+
+// State of scan_doc_for_upload.
+struct DocScan
+{
+    string filepath;
+    uint64 size;
+    FILE* file;
+    GChecksum* checksum;
+    string boundary;
+    // The last boundary.size() - 1 bytes of the previous chunk, followed by the current chunk,
+    // so that occurences of boundary, crossing the chunk boundary, are found too.
+    vector<char> buf;
+    size_t kept;
+    // The number of bytes, read since the last restart.
+    uint64 scanned;
+
+    DocScannedCb scanned_cb;
+    ErrorCb error_cb;
+    // Set when either scanned_cb or error_cb has been called.
+    bool finished;
+
+    DocScan()
+        : size(0),
+          file(nullptr),
+          checksum(nullptr),
+          kept(0),
+          scanned(0),
+          finished(false)
+    {
+    }
+
+    ~DocScan()
+    {
+        if (file)
+            fclose(file);
+        if (checksum)
+            g_checksum_free(checksum);
+        // The idle callback has been removed before the scan finished, i.e. the connection
+        // has been closed.
+        if (!finished) {
+            vkcom_debug_info("Scan of %s has been interrupted\n", filepath.data());
+            if (error_cb)
+                error_cb();
+        }
+    }
+
+    DISABLE_COPYING(DocScan)
+};
+typedef shared_ptr<DocScan> DocScan_ptr;
+
+// Starts the scan from the beginning of the file with a new boundary.
+void restart_doc_scan(DocScan* scan);
+// Reads the next chunk of the file. Returns false if the scan is finished.
+bool scan_doc_chunk(DocScan* scan);
+// Marks the scan as finished and calls error_cb.
+void fail_doc_scan(DocScan* scan);
+// Generates random boundary string for multipart/form-data POST requests.
+string generate_boundary();
+
 // Helper function, which is used by upload_doc and upload_photo.
 void upload_file(PurpleConnection* gc, const char* get_upload_server, const char* partname, const char* name,
-                 const void* contents, size_t size, const UploadedCb& uploaded_cb, const ErrorCb& error_cb,
+                 const UploadContents& contents, const UploadedCb& uploaded_cb, const ErrorCb& error_cb,
                  const UploadProgressCb& upload_progress_cb = nullptr);
 
 } // End of anonymous namespace
 
-void upload_doc_for_im(PurpleConnection* gc, const char* name, const void* contents, size_t size,
-                       const UploadedCb& uploaded_cb, const ErrorCb& error_cb,
+void scan_doc_for_upload(PurpleConnection* gc, const string& filepath, uint64 size,
+                         const DocScannedCb& scanned_cb, const ErrorCb& error_cb)
+{
+    DocScan_ptr scan{ new DocScan() };
+    scan->filepath = filepath;
+    scan->size = size;
+    scan->scanned_cb = scanned_cb;
+    scan->error_cb = error_cb;
+    scan->file = g_fopen(filepath.data(), "rb");
+    if (!scan->file) {
+        vkcom_debug_error("Unable to read file %s\n", filepath.data());
+        fail_doc_scan(scan.get());
+        return;
+    }
+    scan->checksum = g_checksum_new(G_CHECKSUM_MD5);
+    restart_doc_scan(scan.get());
+
+    // One chunk is read per idle call, so that the UI and network are not blocked by large files.
+    idle_add(gc, [=] {
+        return scan_doc_chunk(scan.get());
+    });
+}
+
+namespace
+{
+
+void restart_doc_scan(DocScan* scan)
+{
+    rewind(scan->file);
+    g_checksum_reset(scan->checksum);
+    scan->boundary = generate_boundary();
+    scan->buf.resize(scan->boundary.size() - 1 + UPLOAD_CHUNK_SIZE);
+    scan->kept = 0;
+    scan->scanned = 0;
+}
+
+void fail_doc_scan(DocScan* scan)
+{
+    scan->finished = true;
+    if (scan->error_cb)
+        scan->error_cb();
+}
+
+bool scan_doc_chunk(DocScan* scan)
+{
+    size_t read = fread(scan->buf.data() + scan->kept, 1, UPLOAD_CHUNK_SIZE, scan->file);
+    if (read == 0) {
+        if (ferror(scan->file)) {
+            vkcom_debug_error("Unable to read file %s\n", scan->filepath.data());
+            fail_doc_scan(scan);
+        } else if (scan->scanned != scan->size) {
+            // The upload request is built for the size, which has been passed to us.
+            vkcom_debug_error("File %s has changed: expected %llu bytes, read %llu\n",
+                              scan->filepath.data(), (unsigned long long)scan->size,
+                              (unsigned long long)scan->scanned);
+            fail_doc_scan(scan);
+        } else {
+            scan->finished = true;
+            scan->scanned_cb(g_checksum_get_string(scan->checksum), scan->boundary);
+        }
+        return false;
+    }
+    scan->scanned += read;
+
+    g_checksum_update(scan->checksum, (const unsigned char*)scan->buf.data() + scan->kept, read);
+
+    const string& boundary = scan->boundary;
+    size_t len = scan->kept + read;
+    vector<char>::iterator end = scan->buf.begin() + len;
+    if (std::search(scan->buf.begin(), end, boundary.begin(), boundary.end()) != end) {
+        // Should practically never happen with 48 random characters.
+        vkcom_debug_info("Boundary found in %s, rescanning with a new one\n", scan->filepath.data());
+        restart_doc_scan(scan);
+        return true;
+    }
+
+    scan->kept = std::min(len, boundary.size() - 1);
+    memmove(scan->buf.data(), scan->buf.data() + len - scan->kept, scan->kept);
+    return true;
+}
+
+} // End of anonymous namespace
+
+void upload_doc_for_im(PurpleConnection* gc, const char* name, const string& filepath, size_t size,
+                       const string& boundary, const UploadedCb& uploaded_cb, const ErrorCb& error_cb,
                        const UploadProgressCb& upload_progress_cb)
 {
     vkcom_debug_info("Uploading document for IM\n");
 
-    upload_file(gc, "docs.getWallUploadServer", "file", name, contents, size, [=](const picojson::value& v) {
+    UploadContents contents = { nullptr, filepath, size, boundary };
+    upload_file(gc, "docs.getWallUploadServer", "file", name, contents, [=](const picojson::value& v) {
         if (!field_is_present<string>(v, "file")) {
             vkcom_debug_error("Strange response from upload server: %s\n", v.serialize().data());
             if (error_cb)
@@ -49,7 +210,8 @@ void upload_photo_for_im(PurpleConnection* gc, const char* name, const void* con
 {
     vkcom_debug_info("Uploading photo for IM\n");
 
-    upload_file(gc, "photos.getMessagesUploadServer", "photo", name, contents, size, [=](const picojson::value& v) {
+    UploadContents photo_contents = { (const char*)contents, string(), size, string() };
+    upload_file(gc, "photos.getMessagesUploadServer", "photo", name, photo_contents, [=](const picojson::value& v) {
         if (!(field_is_present<int>(v, "server") || field_is_present<string>(v, "server"))
             || !field_is_present<string>(v, "photo") || !field_is_present<string>(v, "hash")) {
             vkcom_debug_error("Strange response from upload server: %s\n", v.serialize().data());
@@ -74,22 +236,48 @@ void upload_photo_for_im(PurpleConnection* gc, const char* name, const void* con
 namespace
 {
 
+// Multipart body of the upload request: header, file contents and footer. Passed as user data
+// to body_reader, must be alive until the request finishes.
+struct UploadBody
+{
+    string header;
+    UploadContents contents;
+    string footer;
+    // File, from which contents are read, opened on the first read. nullptr for in-memory contents.
+    FILE* file;
+
+    UploadBody()
+        : file(nullptr)
+    {
+    }
+
+    ~UploadBody()
+    {
+        if (file)
+            fclose(file);
+    }
+
+    DISABLE_COPYING(UploadBody)
+};
+
 // Initiates HTTP transfer to upload_url.
 void start_upload(PurpleConnection* gc, const string& upload_url, const char* partname, const char* name,
-                  const void* contents, size_t size, const UploadedCb& uploaded_cb, const ErrorCb& error_cb,
+                  const UploadContents& contents, const UploadedCb& uploaded_cb, const ErrorCb& error_cb,
                   const UploadProgressCb& upload_progress_cb);
 // Prepares HTTP POST request with multipart/form-data with partname, containing given contents.
-PurpleHttpRequest* prepare_upload_request(const string& url, const char* partname, const void* contents,
-                                          size_t size, const char* name);
-// Generates random boundary string for multipart/form-data POST requests.
-string generate_boundary();
+// Body of the request is read from body, which must be deleted after the request finishes.
+PurpleHttpRequest* prepare_upload_request(const string& url, const char* partname, const UploadContents& contents,
+                                          const char* name, UploadBody** body);
+// PurpleHttpContentReader for UploadBody.
+void body_reader(PurpleHttpConnection* http_conn, gchar* buffer, size_t offset, size_t length,
+                 gpointer user_data, PurpleHttpContentReaderCb cb);
 
 // Helper function which calls upload_progress_cb
 void progress_watcher(PurpleHttpConnection* http_conn, gboolean reading_state, int processed, int total,
                       void* progress_data);
 
 void upload_file(PurpleConnection* gc, const char* get_upload_server, const char* partname, const char* name,
-                 const void* contents, size_t size, const UploadedCb& uploaded_cb, const ErrorCb& error_cb,
+                 const UploadContents& contents, const UploadedCb& uploaded_cb, const ErrorCb& error_cb,
                  const UploadProgressCb& upload_progress_cb)
 {
     vk_call_api(gc, get_upload_server, CallParams(), [=](const picojson::value& result) {
@@ -103,7 +291,7 @@ void upload_file(PurpleConnection* gc, const char* get_upload_server, const char
         const string& upload_url = result.get("upload_url").get<string>();
         vkcom_debug_info("Uploading to %s\n", upload_url.data());
 
-        start_upload(gc, upload_url, partname, name, contents, size, uploaded_cb, error_cb, upload_progress_cb);
+        start_upload(gc, upload_url, partname, name, contents, uploaded_cb, error_cb, upload_progress_cb);
     }, [=](const picojson::value&) {
         if (error_cb)
             error_cb();
@@ -111,12 +299,13 @@ void upload_file(PurpleConnection* gc, const char* get_upload_server, const char
 }
 
 void start_upload(PurpleConnection* gc, const string& upload_url, const char* partname, const char* name,
-                  const void* contents, size_t size, const UploadedCb& uploaded_cb, const ErrorCb& error_cb,
+                  const UploadContents& contents, const UploadedCb& uploaded_cb, const ErrorCb& error_cb,
                   const UploadProgressCb& upload_progress_cb)
 {
     vkcom_debug_info("Starting upload\n");
 
-    PurpleHttpRequest* request = prepare_upload_request(upload_url, partname, contents, size, name);
+    UploadBody* body;
+    PurpleHttpRequest* request = prepare_upload_request(upload_url, partname, contents, name, &body);
     UploadProgressCb* progress_data = nullptr;
     if (upload_progress_cb)
         progress_data = new UploadProgressCb(upload_progress_cb);
@@ -124,6 +313,7 @@ void start_upload(PurpleConnection* gc, const string& upload_url, const char* pa
     PurpleHttpConnection* http_conn = http_request(gc, request,
     [=](PurpleHttpConnection*, PurpleHttpResponse* response) {
         delete progress_data;
+        delete body;
 
         if (!purple_http_response_is_successful(response)) {
             if (error_cb)
@@ -131,10 +321,11 @@ void start_upload(PurpleConnection* gc, const string& upload_url, const char* pa
             return;
         }
 
-        const char* response_text = purple_http_response_get_data(response, nullptr);
+        size_t response_len;
+        const char* response_text = purple_http_response_get_data(response, &response_len);
         const char* response_text_copy = response_text; // Picojson updates iterators it received.
         picojson::value root;
-        string error = picojson::parse(root, response_text, response_text + strlen(response_text));
+        string error = picojson::parse(root, response_text, response_text + response_len);
         if (!error.empty()) {
             vkcom_debug_error("Error parsing %s: %s\n", response_text_copy, error.data());
             if (error_cb)
@@ -147,23 +338,31 @@ void start_upload(PurpleConnection* gc, const string& upload_url, const char* pa
         uploaded_cb(root);
     });
     purple_http_request_unref(request);
+    // The connection is being closed, the callback will never be called.
+    if (!http_conn) {
+        delete progress_data;
+        delete body;
+        if (error_cb)
+            error_cb();
+        return;
+    }
     purple_http_conn_set_progress_watcher(http_conn, progress_watcher, progress_data, -1);
 }
 
-PurpleHttpRequest* prepare_upload_request(const string& url, const char* partname, const void* contents,
-                                          size_t size, const char* name)
+PurpleHttpRequest* prepare_upload_request(const string& url, const char* partname, const UploadContents& contents,
+                                          const char* name, UploadBody** body)
 {
-    PurpleHttpRequest* request = purple_http_request_new(url.data());
-    purple_http_request_set_method(request, "POST");
-
-    string boundary;
-    while (true) {
-        boundary = generate_boundary();
+    string boundary = contents.boundary;
+    if (boundary.empty()) {
         // Check if boundary is not present in the contents.
-        if (!g_strstr_len((const char*)contents, size, boundary.data()))
-            break;
+        const char* end = contents.data + contents.size;
+        do {
+            boundary = generate_boundary();
+        } while (std::search(contents.data, end, boundary.begin(), boundary.end()) != end);
     }
 
+    PurpleHttpRequest* request = purple_http_request_new(url.data());
+    purple_http_request_set_method(request, "POST");
     purple_http_request_header_set_printf(request, "Content-type", "multipart/form-data; boundary=%s",
                                           boundary.data());
 
@@ -175,33 +374,24 @@ PurpleHttpRequest* prepare_upload_request(const string& url, const char* partnam
         mime_type = g_strdup("application/octet-stream");
     g_free(content_type);
 
-    vkcom_debug_info("Sending file %s with size %zu and mime-type %s to %s\n", name, size,
+    vkcom_debug_info("Sending file %s with size %zu and mime-type %s to %s\n", name, contents.size,
                      mime_type, url.data());
-    string body_header = str_format("--%s\r\n"
-                                    "Content-Disposition: form-data; name=\"%s\"; filename=\"%s\"\r\n"
-                                    "Content-Type: %s\r\n"
-                                    "Content-Length: %zu\r\n"
-                                    "\r\n", boundary.data(), partname, name, mime_type, size);
-    string body_footer = str_format("\r\n--%s--", boundary.data());
+    *body = new UploadBody();
+    (*body)->header = str_format("--%s\r\n"
+                                 "Content-Disposition: form-data; name=\"%s\"; filename=\"%s\"\r\n"
+                                 "Content-Type: %s\r\n"
+                                 "Content-Length: %zu\r\n"
+                                 "\r\n", boundary.data(), partname, name, mime_type, contents.size);
+    (*body)->contents = contents;
+    (*body)->footer = str_format("\r\n--%s--", boundary.data());
     g_free(mime_type);
 
-    // Yes, we copy file contents in memory, let's hope again, that user will not be uploading large files.
-    // Anyway, we will have to add compression to zip on-the-fly for most of the file types later.
-    // Another copy happens in set_contents, so it's a good thing we capped the size of the files
-    // to 150mb!
-    //
-    // TODO: Add properly this stuff via purple_http_request_set_contents_reader.
-    vector<char> body;
-    body.reserve(body_header.size() + size + body_footer.size());
-    append(body, body_header);
-    const char* char_contents = (const char*)contents;
-    body.insert(body.end(), char_contents, char_contents + size);
-    append(body, body_footer);
-    body.insert(body.end(), body_footer.begin(), body_footer.end());
-
+    // The body is never stored in memory as a whole, body_reader reads it piece by piece
+    // when http connection is ready to send more data.
+    size_t body_size = (*body)->header.size() + contents.size + (*body)->footer.size();
     // Set an hour timeout, so that we never timeout anyway.
     purple_http_request_set_timeout(request, 3600);
-    purple_http_request_set_contents(request, body.data(), body.size());
+    purple_http_request_set_contents_reader(request, body_reader, body_size, *body);
 
     return request;
 }
@@ -219,6 +409,61 @@ string generate_boundary()
     return ret;
 }
 
+// Reads length bytes of contents, starting from offset, into buffer. Returns false if contents
+// could not be read.
+bool read_body_contents(UploadBody* body, size_t offset, char* buffer, size_t length)
+{
+    if (body->contents.data) {
+        memcpy(buffer, body->contents.data + offset, length);
+        return true;
+    }
+
+    if (!body->file) {
+        body->file = g_fopen(body->contents.filepath.data(), "rb");
+        if (!body->file)
+            return false;
+    }
+    // The request may be restarted (e.g. after redirect), so offset is not always the current position.
+    if (ftell(body->file) != (long)offset && fseek(body->file, offset, SEEK_SET) != 0)
+        return false;
+    return fread(buffer, 1, length, body->file) == length;
+}
+
+void body_reader(PurpleHttpConnection* http_conn, gchar* buffer, size_t offset, size_t length,
+                 gpointer user_data, PurpleHttpContentReaderCb cb)
+{
+    UploadBody* body = (UploadBody*)user_data;
+    size_t header_end = body->header.size();
+    size_t contents_end = header_end + body->contents.size;
+    size_t body_size = contents_end + body->footer.size();
+    if (offset > body_size)
+        offset = body_size;
+    length = std::min(length, body_size - offset);
+
+    size_t stored = 0;
+    while (stored < length) {
+        size_t pos = offset + stored;
+        size_t part_len;
+        if (pos < header_end) {
+            part_len = std::min(length - stored, header_end - pos);
+            memcpy(buffer + stored, body->header.data() + pos, part_len);
+        } else if (pos < contents_end) {
+            part_len = std::min(length - stored, contents_end - pos);
+            if (!read_body_contents(body, pos - header_end, buffer + stored, part_len)) {
+                vkcom_debug_error("Unable to read file %s\n", body->contents.filepath.data());
+                cb(http_conn, FALSE, FALSE, 0);
+                return;
+            }
+        } else {
+            part_len = std::min(length - stored, body_size - pos);
+            memcpy(buffer + stored, body->footer.data() + pos - contents_end, part_len);
+        }
+        stored += part_len;
+    }
+
+    cb(http_conn, TRUE, offset + stored == body_size, stored);
+}
+
 void progress_watcher(PurpleHttpConnection* http_conn, gboolean reading_state, int processed, int total,
                       void* progress_data)
 {
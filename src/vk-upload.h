@@ -14,13 +14,23 @@ const int MAX_UPLOAD_SIZE = 150 * 1024 * 1024;
 
 typedef function_ptr<void(const picojson::value& result)> UploadedCb;
 typedef function_ptr<void(PurpleHttpConnection* http_conn, int processed, int total)> UploadProgressCb;
+typedef function_ptr<void(const string& md5sum, const string& boundary)> DocScannedCb;
+
+// Reads the document at filepath once, in chunks, computing its md5sum and choosing multipart boundary,
+// which does not occur in the document. Chunks are read in idle callbacks, so that the scan runs
+// concurrently with API calls, which precede the upload. Either scanned_cb or error_cb is called.
+// The scan fails if the number of read bytes differs from size (the file has changed). If the scan
+// is interrupted by closing the connection, error_cb is called while the connection data is being
+// destroyed, so it must not use it.
+void scan_doc_for_upload(PurpleConnection* gc, const string& filepath, uint64 size,
+                         const DocScannedCb& scanned_cb, const ErrorCb& error_cb);
 
 // Uploads document via docs.getWallUploadServer which means document will be prepared to be
 // sent as attachment via im. value returned via UploadedCb call is returned from docs.save
-// call.
-// NOTE: contents must be valid until either uploaded_cb or error_cb is called.
-void upload_doc_for_im(PurpleConnection* gc, const char* name, const void* contents, size_t size,
-                       const UploadedCb& uploaded_cb, const ErrorCb& error_cb,
+// call. The document is read from filepath in chunks while uploading, size must be equal to the size
+// of the file and boundary must be the one returned by scan_doc_for_upload.
+void upload_doc_for_im(PurpleConnection* gc, const char* name, const string& filepath, size_t size,
+                       const string& boundary, const UploadedCb& uploaded_cb, const ErrorCb& error_cb,
                        const UploadProgressCb& upload_progress_cb = nullptr);
 
 // Uploads photo via docs.getWallUploadServer which means document will be prepared to be
@@ -2,6 +2,7 @@
 #include "miscutils.h"
 #include "vk-api.h"
 #include "vk-common.h"
+#include "vk-schema.h"
 
 #include "vk-utils.h"
 
@@ -339,19 +340,18 @@ void update_groups_info(PurpleConnection* gc, vector<uint64> group_ids, const Su
 
         const picojson::array& groups = result.get<picojson::array>();
         for (const picojson::value& v: groups) {
-            if (!field_is_present<double>(v, "id") || !field_is_present<string>(v, "name")
-                    || !field_is_present<string>(v, "type")) {
+            VkGroupFields group;
+            if (!json_decode(v, group)) {
                 vkcom_debug_error("Wrong type returned as users.get call result: %s\n",
                                    result.serialize().data());
                 return;
             }
 
-            uint64 id = v.get("id").get<double>();
-            VkGroupInfo& info = get_data(gc).group_infos[id];
-            info.name = v.get("name").get<string>();
-            info.type = v.get("type").get<string>();
-            if (field_is_present<string>(v, "screen_name"))
-                info.screen_name = v.get("screen_name").get<string>();
+            VkGroupInfo& info = get_data(gc).group_infos[group.id];
+            info.name = group.name;
+            info.type = group.type;
+            if (!group.screen_name.empty())
+                info.screen_name = group.screen_name;
             info.last_updated = steady_clock::now();
         }
 
@@ -0,0 +1,91 @@
+// Checks that match_execute_errors assigns errors from "execute_errors" to the right methods,
+// including the methods, which legitimately return false.
+
+#include <cstdio>
+#include <cstring>
+
+#include "executeerrors.h"
+
+namespace
+{
+
+picojson::value parse(const char* json)
+{
+    picojson::value v;
+    string error = picojson::parse(v, json, json + strlen(json));
+    assert(error.empty());
+    return v;
+}
+
+// Runs match_execute_errors and compares the index of the error, matched to each method (-1 for
+// no error), and the number of unmatched errors with the expected ones.
+int check(const char* name, const vector<string>& methods, const char* results_json,
+          const char* errors_json, const vector<int>& expected, size_t expected_unmatched)
+{
+    picojson::value results = parse(results_json);
+    picojson::value errors = parse(errors_json);
+    const picojson::array& errors_array = errors.get<picojson::array>();
+
+    vector<const picojson::value*> unmatched;
+    vector<const picojson::value*> matched = match_execute_errors(methods,
+                                                                  results.get<picojson::array>(),
+                                                                  errors_array, &unmatched);
+    vector<int> indices;
+    for (const picojson::value* error: matched)
+        indices.push_back(error ? int(error - errors_array.data()) : -1);
+
+    if (indices == expected && unmatched.size() == expected_unmatched)
+        return 0;
+
+    fprintf(stderr, "%s: got", name);
+    for (int i: indices)
+        fprintf(stderr, " %d", i);
+    fprintf(stderr, ", %zu unmatched\n", unmatched.size());
+    return 1;
+}
+
+} // End of anonymous namespace
+
+int main()
+{
+    int failures = 0;
+
+    failures += check("no errors", { "users.get", "messages.markAsRead" }, "[[{\"id\":1}],1]",
+                      "[]", { -1, -1 }, 0);
+
+    // groups.isMember returns false for non-members, it must not get the error of messages.send.
+    failures += check("failure mixed with false result",
+                      { "groups.isMember", "messages.send", "users.get" }, "[false,false,[]]",
+                      "[{\"method\":\"messages.send\",\"error_code\":7,\"error_msg\":\"Permission\"}]",
+                      { -1, 0, -1 }, 0);
+
+    failures += check("failure before false result of the same method",
+                      { "groups.isMember", "groups.isMember" }, "[false,false]",
+                      "[{\"method\":\"groups.isMember\",\"error_code\":15,\"error_msg\":\"Access\"}]",
+                      { 0, -1 }, 0);
+
+    failures += check("failure after success of the same method",
+                      { "users.get", "users.get" }, "[[{\"id\":1}],false]",
+                      "[{\"method\":\"users.get\",\"error_code\":6,\"error_msg\":\"Too many\"}]",
+                      { -1, 0 }, 0);
+
+    failures += check("several errors in order",
+                      { "messages.send", "users.get", "messages.send", "messages.send" },
+                      "[false,[],1,false]",
+                      "[{\"method\":\"messages.send\",\"error_code\":9,\"error_msg\":\"Flood\"},"
+                      "{\"method\":\"messages.send\",\"error_code\":5,\"error_msg\":\"Auth\"}]",
+                      { 0, -1, -1, 1 }, 0);
+
+    failures += check("unmatched errors",
+                      { "users.get" }, "[false]",
+                      "[{\"method\":\"users.get\",\"error_code\":6,\"error_msg\":\"Too many\"},"
+                      "{\"method\":\"friends.get\",\"error_code\":6,\"error_msg\":\"Too many\"},"
+                      "\"garbage\"]",
+                      { 0 }, 2);
+
+    if (failures > 0) {
+        fprintf(stderr, "%d failures\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,141 @@
+// Checks that Trie::scan finds the same keys as calling Trie::match at each offset on random keys
+// and texts, both when all matches are accepted and when some of them are rejected.
+
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <cpputils/trie.h>
+
+using cpputils::Trie;
+using std::string;
+using std::vector;
+
+namespace
+{
+
+struct Match
+{
+    size_t offset;
+    size_t length;
+    int value;
+
+    bool operator==(const Match& other) const
+    {
+        return offset == other.offset && length == other.length && value == other.value;
+    }
+};
+
+// Decides whether the match is accepted. Depends only on the match, so that both scan and
+// the reference implementation get the same decisions.
+typedef bool (*Accept)(size_t offset, size_t length);
+
+bool accept_all(size_t, size_t)
+{
+    return true;
+}
+
+bool accept_none(size_t, size_t)
+{
+    return false;
+}
+
+bool accept_some(size_t offset, size_t length)
+{
+    return (offset * 7 + length) % 3 != 0;
+}
+
+// Calls Trie::match at each offset, continuing after accepted matches.
+vector<Match> match_at_each_offset(const Trie<int>& trie, const string& text, Accept accept)
+{
+    vector<Match> ret;
+    for (size_t offset = 0; offset < text.size();) {
+        size_t length;
+        const int* value = trie.match(text.data() + offset, &length);
+        if (value && accept(offset, length)) {
+            ret.push_back(Match{ offset, length, *value });
+            offset += length;
+        } else {
+            offset++;
+        }
+    }
+    return ret;
+}
+
+vector<Match> scan(const Trie<int>& trie, const string& text, Accept accept)
+{
+    vector<Match> ret;
+    trie.scan(text.data(), text.size(), [&](size_t offset, size_t length, int value) {
+        if (!accept(offset, length))
+            return false;
+        ret.push_back(Match{ offset, length, value });
+        return true;
+    });
+    return ret;
+}
+
+// Returns a random string of length [min_length, max_length] over alphabet. A small alphabet gives
+// a lot of overlapping keys and matches.
+string random_string(std::mt19937& rng, const string& alphabet, size_t min_length,
+                     size_t max_length)
+{
+    size_t length = std::uniform_int_distribution<size_t>(min_length, max_length)(rng);
+    std::uniform_int_distribution<size_t> char_dist(0, alphabet.size() - 1);
+    string ret;
+    for (size_t i = 0; i < length; i++)
+        ret += alphabet[char_dist(rng)];
+    return ret;
+}
+
+void print_matches(const char* name, const vector<Match>& matches)
+{
+    fprintf(stderr, "%s:", name);
+    for (const Match& m: matches)
+        fprintf(stderr, " (%zu, %zu, %d)", m.offset, m.length, m.value);
+    fprintf(stderr, "\n");
+}
+
+} // End of anonymous namespace
+
+int main()
+{
+    std::mt19937 rng(12345);
+    // Keys use only a part of the text alphabet, so that scan skips bytes, which no key starts with.
+    // Non-ASCII bytes are included, because smileys are mostly UTF-8.
+    const string key_alphabet = "ab:)\xF0\x9F";
+    const string text_alphabet = key_alphabet + "xy \xD0";
+    const Accept accepts[] = { accept_all, accept_none, accept_some };
+    const char* accept_names[] = { "accept_all", "accept_none", "accept_some" };
+
+    int failures = 0;
+    for (int trie_num = 0; trie_num < 500; trie_num++) {
+        Trie<int> trie;
+        size_t num_keys = std::uniform_int_distribution<size_t>(0, 20)(rng);
+        for (size_t i = 0; i < num_keys; i++)
+            trie.insert(random_string(rng, key_alphabet, 1, 5).data(), int(i));
+        trie.freeze();
+
+        for (int text_num = 0; text_num < 20; text_num++) {
+            string text = random_string(rng, text_alphabet, 0, 60);
+            for (size_t a = 0; a < sizeof(accepts) / sizeof(accepts[0]); a++) {
+                vector<Match> expected = match_at_each_offset(trie, text, accepts[a]);
+                vector<Match> scanned = scan(trie, text, accepts[a]);
+                if (scanned == expected)
+                    continue;
+
+                fprintf(stderr, "Trie %d, text %d, %s: scan differs from match\n", trie_num,
+                        text_num, accept_names[a]);
+                print_matches("expected", expected);
+                print_matches("scanned", scanned);
+                failures++;
+            }
+        }
+    }
+
+    if (failures > 0) {
+        fprintf(stderr, "%d failures\n", failures);
+        return 1;
+    }
+    return 0;
+}